@@ -0,0 +1,157 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+// Measures how long it takes to find the interpreter in a Python process: with
+// no symbol cache, with a cache that has to be filled in (cold), and with one
+// that already has the interpreter's symbols (warm). Then it samples the
+// process the way pystack does, with and without --native, and through
+// libpystack's C API, to count the allocations that each sample makes once the
+// sampler has warmed up.
+//
+// Usage: bench-attach PYTHON [ITERATIONS]
+//
+// Prints one JSON object per case.
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./aggregate.h"
+#include "./bench.h"
+#include "./exc.h"
+#include "./libpystack.h"
+#include "./pyframe.h"
+#include "./sampler.h"
+#include "./symcache.h"
+
+using namespace pystack;
+
+namespace {
+const char kScript[] = "import time\nwhile True:\n    time.sleep(1)\n";
+
+// Samples to take before counting allocations, to fill the sampler's buffers
+const size_t kWarmupTicks = 10;
+
+pid_t Spawn(const char *python) {
+  const pid_t pid = fork();
+  if (pid == 0) {
+    execl(python, python, "-c", kScript, nullptr);
+    perror(python);
+    _exit(1);
+  }
+  return pid;
+}
+
+// Wait for the interpreter to start up
+bool WaitForPython(pid_t pid) {
+  for (int i = 0; i < 100; i++) {
+    try {
+      LocatePython(pid, MemoryMap(pid));
+      return true;
+    } catch (const std::runtime_error &exc) {
+      // libpython may not be loaded yet
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  }
+  return false;
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: bench-attach PYTHON [ITERATIONS]\n";
+    return 1;
+  }
+  const size_t iterations = argc > 2 ? std::stoul(argv[2]) : 200;
+  char dir[] = "/tmp/pystack-bench.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  const std::string cache_dir = std::string(dir) + "/cache";
+  const std::string cache_file = cache_dir + "/symbols";
+
+  const pid_t pid = Spawn(argv[1]);
+  int status = 0;
+  if (WaitForPython(pid)) {
+    try {
+      const SymbolCache cache(cache_dir);
+      Run("attach_nocache", iterations,
+          [&]() { LocatePython(pid, MemoryMap(pid)); });
+      Run("attach_cold", iterations, [&]() {
+        unlink(cache_file.c_str());
+        LocatePython(pid, MemoryMap(pid), &cache);
+      });
+      Run("attach_warm", iterations,
+          [&]() { LocatePython(pid, MemoryMap(pid), &cache); });
+
+      StringTable strings;
+      CallTree tree(&strings);
+      for (bool native : {false, true}) {
+        Sampler sampler(
+            1, SampleMode::kWall, false, native, false, &cache, &strings,
+            [&](uint64_t, pid_t, const std::vector<Thread> &threads) {
+              for (const auto &thread : threads) {
+                tree.Add(thread.stack);
+              }
+            });
+        sampler.Add(pid);
+        for (size_t i = 0; i < kWarmupTicks; i++) {
+          sampler.Tick(0);
+        }
+        Run(native ? "sample_native" : "sample_warm", iterations,
+            [&]() { sampler.Tick(0); });
+      }
+
+      // pystack_open() uses the default cache, so point it at ours
+      setenv("PYSTACK_CACHE_DIR", cache_dir.c_str(), 1);
+      pystack_target *target;
+      if (pystack_open(pid, PYSTACK_MODE_WALL, 0, &target) != PYSTACK_OK) {
+        throw FatalException(pystack_last_error());
+      }
+      std::vector<pystack_thread> threads(64);
+      std::vector<pystack_frame> frames(4096);
+      pystack_buffer buffer = {threads.data(), threads.size(), frames.data(),
+                               frames.size(), 0, 0};
+      for (size_t i = 0; i < kWarmupTicks; i++) {
+        pystack_sample(target, &buffer);
+      }
+      Run("sample_capi", iterations,
+          [&]() { pystack_sample(target, &buffer); });
+      pystack_close(target);
+    } catch (const FatalException &exc) {
+      std::cerr << exc.what() << std::endl;
+      status = 1;
+    }
+  } else {
+    std::cerr << "Failed to find the interpreter in " << argv[1] << std::endl;
+    status = 1;
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  unlink(cache_file.c_str());
+  rmdir(cache_dir.c_str());
+  rmdir(dir);
+  return status;
+}
@@ -0,0 +1,61 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+// Shared by the benchmarks: times a case and counts the heap allocations that
+// it makes, by replacing the global operator new.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+namespace pystack {
+// The number of calls to operator new so far, from any thread
+size_t Allocations();
+
+// Run fn iterations times, and print a JSON object with the times that it took
+// and the average number of allocations per iteration. Steady-state sampling
+// should make none.
+template <typename F>
+void Run(const char *name, size_t iterations, F fn) {
+  std::vector<double> times;
+  times.reserve(iterations);
+  size_t allocs = 0;
+  for (size_t i = 0; i < iterations; i++) {
+    const size_t before = Allocations();
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    const auto end = std::chrono::steady_clock::now();
+    allocs += Allocations() - before;
+    times.push_back(
+        std::chrono::duration<double, std::micro>(end - start).count());
+  }
+  std::sort(times.begin(), times.end());
+  double sum = 0;
+  for (double t : times) {
+    sum += t;
+  }
+  std::cout << "{\"benchmark\": \"" << name
+            << "\", \"iterations\": " << iterations
+            << ", \"mean_us\": " << sum / iterations
+            << ", \"p50_us\": " << times[times.size() / 2]
+            << ", \"min_us\": " << times.front()
+            << ", \"allocs\": " << static_cast<double>(allocs) / iterations
+            << "}" << std::endl;
+}
+}  // namespace pystack
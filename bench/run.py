@@ -0,0 +1,165 @@
+# This file is part of Pystack.
+#
+# Pystack is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Pystack is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+"""Runs pystack against the synthetic workloads and reports what it costs.
+
+Usage: run.py [--pystack PATH] [--bench-walk PATH] [--seconds SECONDS]
+              [--rates RATE,...] PYTHON
+
+For each workload and sample rate this prints one JSON object with the samples
+per second that pystack achieved, the CPU it used (as a fraction of one CPU),
+how much it slowed the workload down, and how long the workload was stopped
+for each sample. With --bench-walk it also takes a snapshot of each workload
+and prints how long the walker takes to replay it.
+"""
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import resource
+import signal
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+WORKLOADS = [
+    ("recursion", 10),
+    ("recursion", 100),
+    ("recursion", 500),
+    ("threads", 16),
+    ("longname", 1024),
+    ("lnotab", 20000),
+]
+
+# How long to let the workload start up before measuring it, in seconds.
+WARMUP = 1.0
+
+
+class Workload(object):
+    def __init__(self, python, kind, arg):
+        script = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                              "workload.py")
+        self.proc = subprocess.Popen([python, script, kind, str(arg)],
+                                     stdout=subprocess.PIPE)
+
+    def count(self):
+        """The number of iterations the workload has done so far."""
+        self.proc.send_signal(signal.SIGUSR1)
+        return int(self.proc.stdout.readline()), time.time()
+
+    def close(self):
+        if self.proc.returncode is None:
+            self.proc.kill()
+            self.proc.wait()
+
+
+def child_cpu():
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return usage.ru_utime + usage.ru_stime
+
+
+def run_pystack(args, workload, kind, rate):
+    cmd = [args.pystack, "-f", "-s", str(args.seconds), "-r", str(1.0 / rate),
+           "--stats=json"]
+    if kind == "threads":
+        cmd.append("-t")
+    cmd.append(str(workload.proc.pid))
+    cpu = child_cpu()
+    start = time.time()
+    with open(os.devnull, "w") as devnull:
+        proc = subprocess.Popen(cmd, stdout=devnull, stderr=subprocess.PIPE)
+        err = proc.communicate()[1].decode("utf-8", "replace")
+    wall = time.time() - start
+    if proc.returncode != 0:
+        raise RuntimeError("%s failed: %s" % (" ".join(cmd), err))
+    return json.loads(err.strip().splitlines()[-1]), (child_cpu() - cpu) / wall
+
+
+def bench_walk(args, workload, kind, arg):
+    tmpdir = tempfile.mkdtemp(prefix="pystack-bench.")
+    try:
+        snapshot = os.path.join(tmpdir, "snapshot")
+        with open(os.devnull, "w") as devnull:
+            subprocess.check_call(
+                [args.pystack, "-t", "--snapshot", snapshot,
+                 str(workload.proc.pid)], stdout=devnull)
+        # don't let the workload compete with the walker for the CPU
+        workload.close()
+        out = subprocess.check_output([args.bench_walk, snapshot])
+        for line in out.decode("utf-8").splitlines():
+            result = json.loads(line)
+            result.update({"workload": kind, "arg": arg})
+            print(json.dumps(result, sort_keys=True))
+        sys.stdout.flush()
+    finally:
+        shutil.rmtree(tmpdir)
+
+
+def bench(args, kind, arg):
+    workload = Workload(args.python, kind, arg)
+    try:
+        time.sleep(WARMUP)
+        count, now = workload.count()
+        time.sleep(args.seconds)
+        base_count, base_now = workload.count()
+        base_rate = (base_count - count) / (base_now - now)
+        for rate in args.rates:
+            count, now = workload.count()
+            stats, cpu = run_pystack(args, workload, kind, rate)
+            end_count, end_now = workload.count()
+            work_rate = (end_count - count) / (end_now - now)
+            phases = stats["phases"]
+            walk = phases["walk"]
+            result = {
+                "workload": kind,
+                "arg": arg,
+                "target_rate": rate,
+                "samples": stats["samples"],
+                "samples_per_sec": stats.get("rate", 0),
+                "missed": stats.get("missed", 0),
+                "tracer_cpu": round(cpu, 4),
+                "target_slowdown": round(1 - work_rate / base_rate, 4),
+                "syscalls_per_sample": stats["syscalls"]["per_sample"],
+                "bytes_per_sample": stats["bytes"]["per_sample"],
+                "walk_us": round(walk["total_us"] / max(walk["count"], 1), 3),
+                "stopped_us": stats["stopped_us"],
+            }
+            print(json.dumps(result, sort_keys=True))
+            sys.stdout.flush()
+        if args.bench_walk:
+            bench_walk(args, workload, kind, arg)
+    finally:
+        workload.close()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--pystack", default="pystack")
+    parser.add_argument("--bench-walk")
+    parser.add_argument("--seconds", type=float, default=3)
+    parser.add_argument("--rates", default="100,1000")
+    parser.add_argument("python")
+    args = parser.parse_args()
+    args.rates = [float(r) for r in args.rates.split(",")]
+    for kind, arg in WORKLOADS:
+        bench(args, kind, arg)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,79 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+// Measures how long it takes to walk the stacks of every thread in a snapshot
+// (see pystack --snapshot), with a new walker each time (cold) and with one
+// that has cached the code objects (warm). Replaying a snapshot makes no system
+// calls, so this times just the walker. The warm case reuses its threads and
+// adds them to a call tree, as pystack -f does, and should make no
+// allocations.
+//
+// Usage: bench-walk SNAPSHOT [ITERATIONS]
+//
+// Prints one JSON object per case.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./aggregate.h"
+#include "./bench.h"
+#include "./exc.h"
+#include "./pyframe.h"
+#include "./snapshot.h"
+
+using namespace pystack;
+
+namespace {
+// Walks to take before counting allocations, to size the walker's buffers
+const size_t kWarmupWalks = 10;
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: bench-walk SNAPSHOT [ITERATIONS]\n";
+    return 1;
+  }
+  const size_t iterations = argc > 2 ? std::stoul(argv[2]) : 1000;
+  try {
+    SnapshotMemory mem(argv[1]);
+    StringTable strings;
+    Run("walk_cold", iterations, [&]() {
+      std::vector<Thread> threads;
+      StackWalker::Create(&mem, mem.addrs().version, &strings)
+          ->GetThreads(mem.addrs(), &threads);
+    });
+    std::unique_ptr<StackWalker> walker =
+        StackWalker::Create(&mem, mem.addrs().version, &strings);
+    std::vector<Thread> threads;
+    CallTree tree(&strings);
+    auto walk = [&]() {
+      walker->GetThreads(mem.addrs(), &threads);
+      for (const auto &thread : threads) {
+        tree.Add(thread.stack);
+      }
+    };
+    // the first walk fills the caches, and the next reuses the cached frames
+    for (size_t i = 0; i < kWarmupWalks; i++) {
+      walk();
+    }
+    Run("walk_warm", iterations, walk);
+  } catch (const std::exception &exc) {
+    std::cerr << exc.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+# This file is part of Pystack.
+#
+# Pystack is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Pystack is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+"""Synthetic Python processes for the sampling benchmarks.
+
+Usage: workload.py KIND [ARG]
+
+Each kind keeps the CPU busy in a loop with a particular shape of stack:
+
+  recursion N  the loop runs N frames deep
+  threads N    N threads each run the loop a few frames deep
+  longname N   the loop runs in code whose filename is N bytes long
+  lnotab N     the loop is at the end of a function of N lines, so finding
+               its line number means decoding the whole line number table
+
+The process counts the iterations of the loop, and prints the total to stdout
+when it gets SIGUSR1, so the harness can measure how much sampling slows it
+down.
+"""
+
+from __future__ import print_function
+
+import signal
+import sys
+import threading
+
+counts = []
+
+
+def report(signum, frame):
+    print(sum(counts))
+    sys.stdout.flush()
+
+
+def spin(slot):
+    while True:
+        for _ in range(1000):
+            pass
+        counts[slot] += 1
+
+
+def recurse(depth, slot):
+    if depth <= 1:
+        spin(slot)
+    else:
+        recurse(depth - 1, slot)
+
+
+def run_recursion(depth):
+    counts.append(0)
+    recurse(depth, 0)
+
+
+def run_threads(n):
+    for i in range(n):
+        counts.append(0)
+        t = threading.Thread(target=recurse, args=(5, i))
+        t.daemon = True
+        t.start()
+    while True:
+        signal.pause()
+
+
+def run_code(filename, lines):
+    source = ["def hot(slot):"]
+    source.extend("    x%d = %d" % (i, i) for i in range(lines))
+    source.append("    spin(slot)")
+    namespace = {"spin": spin}
+    exec(compile("\n".join(source), filename, "exec"), namespace)
+    counts.append(0)
+    namespace["hot"](0)
+
+
+def main():
+    kind = sys.argv[1]
+    arg = int(sys.argv[2]) if len(sys.argv) > 2 else 0
+    signal.signal(signal.SIGUSR1, report)
+    if kind == "recursion":
+        run_recursion(arg or 100)
+    elif kind == "threads":
+        run_threads(arg or 16)
+    elif kind == "longname":
+        name = "/" + "x" * max((arg or 1024) - 11, 1) + "/hot_path.py"
+        run_code(name, 1)
+    elif kind == "lnotab":
+        run_code("<lnotab>", arg or 20000)
+    else:
+        sys.exit("Unknown workload: " + kind)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,71 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./aggregate.h"
+
+#include <sstream>
+
+namespace pystack {
+uint32_t CallTree::Intern(const Frame &frame) {
+  auto it = frames_.find(frame);
+  if (it != frames_.end()) {
+    return it->second;
+  }
+  std::ostringstream ss;
+  WriteFrame(ss, *strings_, frame);
+  const uint32_t id = labels_.size();
+  labels_.push_back(ss.str());
+  frames_.insert({frame, id});
+  return id;
+}
+
+void CallTree::Add(const std::vector<Frame> &stack, uint64_t count) {
+  if (stack.empty()) {
+    return;
+  }
+  uint32_t node = 0;
+  for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+    const uint32_t frame = Intern(*it);
+    const uint64_t key = static_cast<uint64_t>(node) << 32 | frame;
+    auto child = children_.find(key);
+    if (child != children_.end()) {
+      node = child->second;
+    } else {
+      const uint32_t parent = node;
+      node = nodes_.size();
+      nodes_.push_back({parent, frame, 0});
+      children_.insert({key, node});
+    }
+  }
+  nodes_[node].count += count;
+}
+
+void CallTree::WriteFolded(std::ostream &os) const {
+  std::vector<uint32_t> path;
+  for (uint32_t i = 1; i < nodes_.size(); i++) {
+    if (nodes_[i].count == 0) {
+      continue;
+    }
+    path.clear();
+    for (uint32_t n = i; n != 0; n = nodes_[n].parent) {
+      path.push_back(nodes_[n].frame);
+    }
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+      os << (it == path.rbegin() ? "" : ";") << labels_[*it];
+    }
+    os << ' ' << nodes_[i].count << '\n';
+  }
+}
+}  // namespace pystack
@@ -0,0 +1,69 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./frame.h"
+
+namespace pystack {
+
+// A call tree that samples are added to. Each distinct frame is interned once,
+// and each node in the tree is keyed by its parent node and the frame's id, so
+// memory use grows with the number of distinct stacks rather than the number of
+// samples.
+class CallTree {
+ public:
+  // The filenames of the frames are in strings
+  explicit CallTree(const StringTable *strings)
+      : strings_(strings), nodes_{{0, 0, 0}} {}
+
+  // Add a sample. The stack is in the order returned by GetStack (most recent
+  // frame first).
+  void Add(const std::vector<Frame> &stack, uint64_t count = 1);
+
+  // Write the tree in Brendan Gregg's folded stack format, i.e. one line per
+  // distinct stack in the form "outer;...;inner count". This is the input
+  // format of flamegraph.pl.
+  void WriteFolded(std::ostream &os) const;
+
+  inline size_t frames() const { return frames_.size(); }
+  inline size_t nodes() const { return nodes_.size(); }
+
+ private:
+  struct Node {
+    uint32_t parent;
+    uint32_t frame;
+    uint64_t count;  // samples that ended at exactly this node
+  };
+
+  const StringTable *strings_;
+
+  // Frame ids are indices into labels_
+  std::unordered_map<Frame, uint32_t, FrameHash> frames_;
+  std::vector<std::string> labels_;
+
+  // Node 0 is the root. The children map is keyed by (parent << 32 | frame).
+  std::vector<Node> nodes_;
+  std::unordered_map<uint64_t, uint32_t> children_;
+
+  uint32_t Intern(const Frame &frame);
+};
+}  // namespace pystack
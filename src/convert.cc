@@ -0,0 +1,228 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <getopt.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "./aggregate.h"
+#include "./config.h"
+#include "./exc.h"
+#include "./record.h"
+
+using namespace pystack;
+
+namespace {
+const char usage_str[] =
+    "Usage: pystack-convert [-h|--help] [-f|--format text|folded|json] FILE\n";
+
+// The length of the UTF-8 sequence at pos, or 0 if it isn't valid: truncated,
+// overlong, a surrogate or beyond U+10FFFF.
+size_t Utf8Length(const std::string &str, size_t pos) {
+  const unsigned char c = str[pos];
+  size_t len;
+  uint32_t cp;
+  if (c < 0x80) {
+    return 1;
+  } else if (c >= 0xc2 && c <= 0xdf) {
+    len = 2;
+    cp = c & 0x1f;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    len = 3;
+    cp = c & 0x0f;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    len = 4;
+    cp = c & 0x07;
+  } else {
+    return 0;
+  }
+  if (pos + len > str.size()) {
+    return 0;
+  }
+  for (size_t i = 1; i < len; i++) {
+    const unsigned char cont = str[pos + i];
+    if ((cont & 0xc0) != 0x80) {
+      return 0;
+    }
+    cp = (cp << 6) | (cont & 0x3f);
+  }
+  if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000) ||
+      (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+    return 0;
+  }
+  return len;
+}
+
+// Write a string as JSON. Names can have bytes that aren't UTF-8, like the
+// surrogate escapes of file names, which become U+FFFD.
+void WriteJSONString(std::ostream &os, const std::string &str) {
+  os << '"';
+  for (size_t i = 0; i < str.size();) {
+    const size_t len = Utf8Length(str, i);
+    if (len == 0) {
+      os << "\\ufffd";
+      i++;
+      continue;
+    } else if (len > 1) {
+      os.write(str.data() + i, len);
+      i += len;
+      continue;
+    }
+    const char c = str[i++];
+    switch (c) {
+      case '"':
+        os << "\\\"";
+        break;
+      case '\\':
+        os << "\\\\";
+        break;
+      case '\n':
+        os << "\\n";
+        break;
+      case '\t':
+        os << "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          os << buf;
+        } else {
+          os << c;
+        }
+    }
+  }
+  os << '"';
+}
+
+// Samples in the same format that pystack prints them
+void ConvertText(RecordReader *reader) {
+  RecordedSample sample;
+  for (bool first = true; reader->Next(&sample); first = false) {
+    if (!first) {
+      std::cout << "\n";
+    }
+    if (sample.thread != 0) {
+      std::cout << "Thread " << sample.thread << "\n";
+    }
+    for (auto it = sample.stack.rbegin(); it != sample.stack.rend(); ++it) {
+      WriteFrame(std::cout, reader->strings(), *it);
+      std::cout << "\n";
+    }
+  }
+}
+
+void ConvertFolded(RecordReader *reader) {
+  CallTree tree(&reader->strings());
+  RecordedSample sample;
+  while (reader->Next(&sample)) {
+    tree.Add(sample.stack, sample.weight);
+  }
+  tree.WriteFolded(std::cout);
+}
+
+// A JSON array with one object per sample. Stacks are listed outermost frame
+// first, like the text output.
+void ConvertJSON(RecordReader *reader) {
+  RecordedSample sample;
+  std::cout << "[";
+  for (bool first = true; reader->Next(&sample); first = false) {
+    std::cout << (first ? "\n" : ",\n") << "{\"pid\": " << sample.pid
+              << ", \"time\": " << sample.timestamp
+              << ", \"thread\": " << sample.thread
+              << ", \"weight\": " << sample.weight << ", \"stack\": [";
+    for (auto it = sample.stack.rbegin(); it != sample.stack.rend(); ++it) {
+      const bool native = it->line == kNativeLine;
+      const bool label = it->line == kLabelLine;
+      std::cout << (it == sample.stack.rbegin() ? "" : ", ") << "{\"file\": ";
+      WriteJSONString(std::cout, reader->strings().Get(it->file));
+      std::cout << ", \"function\": ";
+      WriteJSONString(std::cout, reader->strings().Get(it->name));
+      if (native) {
+        std::cout << ", \"native\": true";
+      } else if (label) {
+        std::cout << ", \"label\": true";
+      } else {
+        std::cout << ", \"first_line\": " << it->first_line
+                  << ", \"line\": " << it->line;
+      }
+      std::cout << "}";
+    }
+    std::cout << "]}";
+  }
+  std::cout << "\n]\n";
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string format = "text";
+  for (;;) {
+    static struct option long_options[] = {
+        {"format", required_argument, 0, 'f'},
+        {"help", no_argument, 0, 'h'},
+        {"version", no_argument, 0, 'v'},
+        {0, 0, 0, 0}};
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "f:hv", long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+    switch (c) {
+      case 'f':
+        format = optarg;
+        break;
+      case 'h':
+        std::cout << usage_str;
+        return 0;
+      case 'v':
+        std::cout << PACKAGE_STRING << "\n";
+        return 0;
+      case '?':
+        // getopt_long should already have printed an error message
+        break;
+      default:
+        abort();
+    }
+  }
+  if (optind != argc - 1) {
+    std::cerr << usage_str;
+    return 1;
+  }
+  try {
+    RecordReader reader(argv[argc - 1]);
+    if (format == "text") {
+      ConvertText(&reader);
+    } else if (format == "folded") {
+      ConvertFolded(&reader);
+    } else if (format == "json") {
+      ConvertJSON(&reader);
+    } else {
+      std::cerr << "Unknown format " << format << "\n" << usage_str;
+      return 1;
+    }
+    std::cout << std::flush;
+    if (reader.truncated()) {
+      std::cerr << "Warning: the recording ends with an incomplete block\n";
+    }
+  } catch (const std::exception &exc) {
+    std::cerr << exc.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
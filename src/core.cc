@@ -0,0 +1,214 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./core.h"
+
+#include <elf.h>
+#include <sys/procfs.h>
+#include <sys/user.h>
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <utility>
+
+#include "./exc.h"
+
+namespace pystack {
+namespace {
+void ThrowBadCore(const std::string &path, const char *why) {
+  std::ostringstream ss;
+  ss << "Bad core file " << path << ": " << why;
+  throw FatalException(ss.str());
+}
+
+// The NT_FILE note is a count and a page size, then the start, end and file
+// offset (in pages) of each mapping, and then all of their paths.
+std::vector<Mapping> ParseFileNote(const std::string &path,
+                                   const ElfNote &note) {
+  const uint64_t *words = static_cast<const uint64_t *>(note.desc);
+  const size_t max_words = note.size / sizeof(uint64_t);
+  if (max_words < 2 || words[0] > (max_words - 2) / 3) {
+    ThrowBadCore(path, "NT_FILE is truncated");
+  }
+  const size_t count = words[0];
+  const uint64_t page_size = words[1];
+  const char *names = reinterpret_cast<const char *>(words + 2 + count * 3);
+  const char *end = static_cast<const char *>(note.desc) + note.size;
+  std::vector<Mapping> mappings;
+  for (size_t i = 0; i < count; i++) {
+    const uint64_t *entry = words + 2 + i * 3;
+    const char *nul = static_cast<const char *>(memchr(names, 0, end - names));
+    if (nul == nullptr) {
+      ThrowBadCore(path, "NT_FILE is truncated");
+    }
+    mappings.push_back(
+        {entry[0], entry[1], entry[2] * page_size, true, false, names});
+    names = nul + 1;
+  }
+  return mappings;
+}
+}  // namespace
+
+CoreFile::CoreFile(const std::string &path)
+    : path_(path), pid_(0), maps_(std::vector<Mapping>()) {
+  core_.Open(path);
+  const unsigned char *ident =
+      static_cast<const unsigned char *>(core_.At(0, sizeof(Elf64_Ehdr)));
+  if (memcmp(ident, ELFMAG, SELFMAG) != 0 || ident[EI_CLASS] != ELFCLASS64 ||
+      core_.type() != ET_CORE) {
+    ThrowBadCore(path, "not a 64-bit ELF core file");
+  }
+
+  for (const auto &ph : core_.Segments()) {
+    if (ph.p_type != PT_LOAD || ph.p_offset > core_.size()) {
+      continue;
+    }
+    // a core that was cut short has the start of the segments that fit
+    const size_t filesz = std::min<size_t>(
+        {ph.p_filesz, ph.p_memsz, core_.size() - ph.p_offset});
+    segments_.push_back(
+        {ph.p_vaddr, ph.p_vaddr + ph.p_memsz, ph.p_vaddr + filesz,
+         static_cast<const char *>(core_.At(ph.p_offset, filesz))});
+  }
+  std::sort(segments_.begin(), segments_.end(),
+            [](const Segment &a, const Segment &b) {
+              return a.start < b.start;
+            });
+
+  bool found_files = false;
+  for (const auto &note : core_.Notes()) {
+    if (note.name != "CORE") {
+      continue;
+    }
+    if (note.type == NT_PRSTATUS && pid_ == 0 &&
+        note.size >= sizeof(elf_prstatus)) {
+      // the first thread is the one that dumped the core
+      pid_ = static_cast<const elf_prstatus *>(note.desc)->pr_pid;
+    } else if (note.type == NT_FILE && !found_files) {
+      maps_ = MemoryMap(ParseFileNote(path, note));
+      found_files = true;
+    }
+  }
+  if (!found_files) {
+    ThrowBadCore(path, "there's no NT_FILE note");
+  }
+}
+
+std::vector<NativeRegs> CoreFile::Registers() const {
+#if defined(__x86_64__)
+  std::vector<NativeRegs> regs;
+  for (const auto &note : core_.Notes()) {
+    if (note.name != "CORE" || note.type != NT_PRSTATUS ||
+        note.size < sizeof(elf_prstatus)) {
+      continue;
+    }
+    // pr_reg has the layout of user_regs_struct
+    const elf_prstatus *status = static_cast<const elf_prstatus *>(note.desc);
+    user_regs_struct r;
+    static_assert(sizeof(status->pr_reg) == sizeof(r), "unexpected pr_reg");
+    memcpy(&r, &status->pr_reg, sizeof(r));
+    regs.push_back({status->pr_pid, r.rip, r.rsp, r.rbp, r.fs_base});
+  }
+  return regs;
+#else
+  throw FatalException("Native stacks are only supported on x86-64");
+#endif
+}
+
+std::string CoreFile::Executable() const {
+  // AT_PHDR is the address of the executable's program headers
+  for (const auto &note : core_.Notes()) {
+    if (note.name != "CORE" || note.type != NT_AUXV) {
+      continue;
+    }
+    const Elf64_auxv_t *auxv = static_cast<const Elf64_auxv_t *>(note.desc);
+    for (size_t i = 0; i < note.size / sizeof(*auxv); i++) {
+      if (auxv[i].a_type == AT_PHDR) {
+        const Mapping *m = maps_.Find(auxv[i].a_un.a_val);
+        if (m != nullptr) {
+          return m->path;
+        }
+      }
+    }
+  }
+  // the executable is usually mapped first
+  if (maps_.mappings().empty()) {
+    ThrowBadCore(path_, "no files were mapped");
+  }
+  return maps_.mappings().front().path;
+}
+
+void CoreFile::ReadV(const Span *spans, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    char *out = static_cast<char *>(spans[i].buf);
+    unsigned long addr = spans[i].addr;
+    size_t left = spans[i].len;
+    while (left) {
+      const size_t len = Copy(addr, out, left);
+      if (len == 0) {
+        std::ostringstream ss;
+        ss << "Address " << reinterpret_cast<void *>(addr)
+           << " isn't in core file " << path_;
+        throw InvalidDataException(ss.str());
+      }
+      out += len;
+      addr += len;
+      left -= len;
+    }
+  }
+}
+
+size_t CoreFile::Copy(unsigned long addr, char *out, size_t len) {
+  auto next = std::upper_bound(
+      segments_.begin(), segments_.end(), addr,
+      [](unsigned long a, const Segment &seg) { return a < seg.start; });
+  if (next != segments_.begin()) {
+    const Segment &seg = *(next - 1);
+    if (addr < seg.file_end) {
+      len = std::min(len, seg.file_end - addr);
+      memcpy(out, seg.data + (addr - seg.start), len);
+      return len;
+    }
+  }
+
+  // the memory wasn't dumped, so read it from the file that was mapped there
+  const Mapping *m = maps_.Find(addr);
+  if (m == nullptr || m->path.empty()) {
+    return 0;
+  }
+  auto it = files_.find(m->path);
+  if (it == files_.end()) {
+    std::unique_ptr<ELF> file(new ELF);
+    try {
+      file->Open(m->path);
+    } catch (const FatalException &exc) {
+      file.reset();  // don't try again
+    }
+    it = files_.insert(std::make_pair(m->path, std::move(file))).first;
+  }
+  const unsigned long offset = m->offset + (addr - m->start);
+  if (it->second == nullptr || offset >= it->second->size()) {
+    return 0;
+  }
+  len = std::min({len, m->end - addr, it->second->size() - offset});
+  if (next != segments_.end()) {
+    // the next segment may have a copy of the rest that has been written to
+    len = std::min(len, next->start - addr);
+  }
+  memcpy(out, it->second->At(offset, len), len);
+  return len;
+}
+}  // namespace pystack
@@ -0,0 +1,79 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./maps.h"
+#include "./memory.h"
+#include "./symbol.h"
+#include "./unwind.h"
+
+namespace pystack {
+
+// The memory of a process from its core dump. The core file is mmap'ed, and
+// reads are copied straight out of its PT_LOAD segments, so even a huge core
+// is only paged in as far as the stacks need.
+//
+// The kernel doesn't normally dump memory that it can read back from a file,
+// like the text of the executable and libraries. Reads of that memory are
+// served from the files listed in the core's NT_FILE note instead, which have
+// to be at the same paths as on the machine that dumped the core.
+class CoreFile : public MemoryReader {
+ public:
+  explicit CoreFile(const std::string &path);
+
+  void ReadV(const Span *spans, size_t n) override;
+
+  // The process that dumped the core
+  inline pid_t pid() const { return pid_; }
+
+  // The files that were mapped into the process
+  inline const MemoryMap &maps() const { return maps_; }
+
+  // The path of the executable, as it was mapped into the process
+  std::string Executable() const;
+
+  // The registers of each thread when the core was dumped. Throws
+  // FatalException on architectures other than x86-64.
+  std::vector<NativeRegs> Registers() const;
+
+ private:
+  struct Segment {
+    unsigned long start;
+    unsigned long end;       // of the segment in memory
+    unsigned long file_end;  // of the part that's in the core
+    const char *data;
+  };
+
+  std::string path_;
+  ELF core_;
+  pid_t pid_;
+  std::vector<Segment> segments_;  // sorted by address
+  MemoryMap maps_;
+  std::map<std::string, std::unique_ptr<ELF>> files_;  // opened on demand
+
+  // Copy up to len bytes at addr, but not past the end of the segment or file
+  // mapping that addr is in. Returns how many bytes were copied.
+  size_t Copy(unsigned long addr, char *out, size_t len);
+};
+}  // namespace pystack
@@ -0,0 +1,431 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./daemon.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "./exc.h"
+#include "./socket.h"
+
+namespace pystack {
+namespace {
+// Requests are short, so anything longer than this is garbage
+const size_t kMaxRequest = 4096;
+
+// How long a client gets to send its request, so a stuck one can't hold up the
+// others
+const time_t kRequestTimeout = 1;
+
+// The default time between the samples of a profile, in seconds
+const double kDefaultPeriod = 0.01;
+
+// How often an idle session passes on the signals sent to its process
+const uint64_t kPollInterval = 10000000;  // 10ms
+
+const char kHelp[] =
+    "add PID [gil|wall|cpu] [native]  register a process (wall by default)\n"
+    "remove PID                       detach from a process\n"
+    "list                             list the registered processes\n"
+    "dump PID                         sample a process now\n"
+    "start PID [SECONDS]              start profiling, every SECONDS (0.01)\n"
+    "stop PID                         stop profiling\n"
+    "profile PID                      the profile so far, as folded stacks\n"
+    "stats PID                        the sampling counters of a process\n"
+    "help                             this message\n";
+
+const char *ModeName(SampleMode mode) {
+  switch (mode) {
+    case SampleMode::kGil:
+      return "gil";
+    case SampleMode::kWall:
+      return "wall";
+    case SampleMode::kCpu:
+      return "cpu";
+  }
+  return "?";
+}
+
+bool ParseMode(const std::string &name, SampleMode *mode) {
+  for (SampleMode m : {SampleMode::kGil, SampleMode::kWall, SampleMode::kCpu}) {
+    if (name == ModeName(m)) {
+      *mode = m;
+      return true;
+    }
+  }
+  return false;
+}
+
+pid_t ParsePid(const std::string &arg) {
+  char *end;
+  const long pid = std::strtol(arg.c_str(), &end, 10);
+  if (arg.empty() || *end != '\0' || pid <= 0 ||
+      pid > std::numeric_limits<pid_t>::max()) {
+    throw NonFatalException("Bad PID: " + arg);
+  }
+  return pid;
+}
+
+// Print the threads of a sample like pystack does
+void WriteThreads(std::ostream &os, const std::vector<Thread> &threads,
+                  const StringTable &strings, bool all_threads) {
+  bool first = true;
+  for (const auto &thread : threads) {
+    if (thread.weight == 0) {
+      continue;
+    }
+    if (all_threads) {
+      os << (first ? "" : "\n") << "Thread " << thread.id
+         << (thread.gil ? " (holds the GIL)" : "") << "\n";
+    }
+    first = false;
+    for (auto it = thread.stack.rbegin(); it != thread.stack.rend(); ++it) {
+      WriteFrame(os, strings, *it);
+      os << "\n";
+    }
+  }
+}
+}  // namespace
+
+Session::Session(pid_t pid, SampleMode mode, const SymbolCache *cache,
+                 StringTable *strings, NativeModules *modules)
+    : pid_(pid),
+      mode_(mode),
+      strings_(strings),
+      tree_(strings),
+      samples_(0),
+      done_(false),
+      thread_(&Session::Run, this) {
+  try {
+    Call([this, pid, mode, cache, strings, modules]() {
+      target_.reset(
+          new Target(pid, mode, false, false, cache, strings, modules));
+    });
+  } catch (...) {
+    // the destructor won't run, so stop the thread here
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+    throw;
+  }
+}
+
+Session::~Session() {
+  // detaching has to be done by the session's thread too
+  Call([this]() { target_.reset(); });
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+  }
+  cond_.notify_one();
+  thread_.join();
+}
+
+void Session::Call(const std::function<void()> &fn) {
+  std::packaged_task<void()> task(fn);
+  std::future<void> result = task.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(task));
+  }
+  cond_.notify_one();
+  result.get();
+}
+
+void Session::Run() {
+  uint64_t next_poll = MonotonicNanos() + kPollInterval;
+  for (;;) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto ready = [this]() { return done_ || !queue_.empty(); };
+      if (ticker_ || error_.empty()) {
+        uint64_t wake = next_poll;
+        if (ticker_) {
+          wake = std::min(wake, ticker_->next());
+        }
+        // MonotonicNanos is CLOCK_MONOTONIC, which is steady_clock's clock
+        const std::chrono::steady_clock::time_point deadline(
+            (std::chrono::nanoseconds(wake)));
+        cond_.wait_until(lock, deadline, ready);
+      } else {
+        cond_.wait(lock, ready);
+      }
+      if (!queue_.empty()) {
+        task = std::move(queue_.front());
+        queue_.pop_front();
+      } else if (done_) {
+        return;
+      }
+    }
+    if (task.valid()) {
+      task();
+    } else if (ticker_ && MonotonicNanos() >= ticker_->next()) {
+      try {
+        Sample();
+      } catch (const std::exception &exc) {
+        // a fatal error has stopped the profile, and Describe() says why
+      }
+      if (ticker_) {
+        ticker_->Advance(std::numeric_limits<uint64_t>::max());
+      }
+      next_poll = MonotonicNanos() + kPollInterval;
+    } else if (MonotonicNanos() >= next_poll) {
+      Poll();
+      next_poll = MonotonicNanos() + kPollInterval;
+    }
+  }
+}
+
+void Session::Poll() {
+  if (!target_ || !error_.empty()) {
+    return;
+  }
+  try {
+    target_->Poll();
+  } catch (const FatalException &exc) {
+    error_ = exc.what();
+    ticker_.reset();
+  }
+}
+
+void Session::Sample() {
+  if (!error_.empty()) {
+    throw FatalException(error_);
+  }
+  try {
+    if (!target_->Sample()) {
+      return;
+    }
+  } catch (const FatalException &exc) {
+    error_ = exc.what();
+    ticker_.reset();
+    throw;
+  }
+  // a dump during a profile counts too, which matters in cpu mode: its sample
+  // takes the CPU time used since the last tick
+  if (ticker_) {
+    for (const auto &thread : target_->threads()) {
+      if (thread.weight) {
+        tree_.Add(thread.stack, thread.weight);
+      }
+    }
+    samples_++;
+  }
+}
+
+std::string Session::Dump() {
+  std::ostringstream ss;
+  Call([this, &ss]() {
+    Sample();
+    WriteThreads(ss, target_->threads(), *strings_,
+                 mode_ != SampleMode::kGil);
+  });
+  return ss.str();
+}
+
+void Session::Start(uint64_t period_ns) {
+  Call([this, period_ns]() {
+    if (!error_.empty()) {
+      throw FatalException(error_);
+    }
+    tree_ = CallTree(strings_);
+    samples_ = 0;
+    ticker_.reset(new Ticker(period_ns));
+  });
+}
+
+void Session::Stop() {
+  Call([this]() { ticker_.reset(); });
+}
+
+std::string Session::Profile() {
+  std::ostringstream ss;
+  Call([this, &ss]() { tree_.WriteFolded(ss); });
+  return ss.str();
+}
+
+std::string Session::Stats() {
+  std::ostringstream ss;
+  Call([this, &ss]() { WriteStats(ss, target_->stats(), nullptr); });
+  return ss.str();
+}
+
+std::string Session::Describe() {
+  std::ostringstream ss;
+  Call([this, &ss]() {
+    ss << pid_ << " " << ModeName(mode_) << " ";
+    if (!error_.empty()) {
+      ss << "failed: " << error_;
+    } else if (ticker_) {
+      ss << "profiling, " << samples_ << " samples, " << ticker_->missed()
+         << " missed";
+    } else {
+      ss << "idle, " << samples_ << " samples in the last profile";
+    }
+  });
+  return ss.str();
+}
+
+Daemon::Daemon(const std::string &path, const SymbolCache *cache)
+    : path_(path), fd_(ListenUnix(path)), cache_(cache) {}
+
+Daemon::~Daemon() {
+  // detach from everything before the socket goes away
+  sessions_.clear();
+  close(fd_);
+  unlink(path_.c_str());
+}
+
+void Daemon::Add(pid_t pid, SampleMode mode, bool native) {
+  if (sessions_.count(pid)) {
+    std::ostringstream ss;
+    ss << "PID " << pid << " is already registered";
+    throw NonFatalException(ss.str());
+  }
+  if (native && !modules_) {
+    modules_.reset(new NativeModules(&strings_));
+  }
+  sessions_[pid].reset(new Session(pid, mode, cache_, &strings_,
+                                   native ? modules_.get() : nullptr));
+}
+
+Session *Daemon::Find(pid_t pid) {
+  auto it = sessions_.find(pid);
+  if (it == sessions_.end()) {
+    std::ostringstream ss;
+    ss << "PID " << pid << " isn't registered";
+    throw NonFatalException(ss.str());
+  }
+  return it->second.get();
+}
+
+std::string Daemon::Handle(const std::string &request) {
+  std::istringstream in(request);
+  std::vector<std::string> args;
+  for (std::string arg; in >> arg;) {
+    args.push_back(arg);
+  }
+  std::string out;
+  try {
+    const std::string command = args.empty() ? "" : args[0];
+    const bool has_pid = command != "help" && command != "list";
+    if (has_pid && args.size() < 2) {
+      throw NonFatalException("Usage:\n" + std::string(kHelp));
+    }
+    const pid_t pid = has_pid ? ParsePid(args[1]) : 0;
+    if (command == "help") {
+      out = kHelp;
+    } else if (command == "list") {
+      for (const auto &s : sessions_) {
+        out += s.second->Describe() + "\n";
+      }
+    } else if (command == "add") {
+      SampleMode mode = SampleMode::kWall;
+      bool native = false;
+      for (size_t i = 2; i < args.size(); i++) {
+        if (args[i] == "native") {
+          native = true;
+        } else if (!ParseMode(args[i], &mode)) {
+          throw NonFatalException("Unknown mode: " + args[i]);
+        }
+      }
+      Add(pid, mode, native);
+    } else if (command == "remove") {
+      Find(pid);
+      sessions_.erase(pid);
+    } else if (command == "dump") {
+      out = Find(pid)->Dump();
+    } else if (command == "start") {
+      const double period =
+          args.size() > 2 ? std::strtod(args[2].c_str(), nullptr) : 0;
+      if (args.size() > 2 && !(period > 0)) {
+        throw NonFatalException("Bad sampling period: " + args[2]);
+      }
+      Find(pid)->Start(
+          static_cast<uint64_t>((period > 0 ? period : kDefaultPeriod) * 1e9));
+    } else if (command == "stop") {
+      Find(pid)->Stop();
+    } else if (command == "profile") {
+      out = Find(pid)->Profile();
+    } else if (command == "stats") {
+      out = Find(pid)->Stats();
+    } else {
+      throw NonFatalException("Unknown command: " + command + "\n" + kHelp);
+    }
+  } catch (const std::exception &exc) {
+    return std::string("ERROR ") + exc.what() + "\n";
+  }
+  return "OK\n" + out;
+}
+
+void Daemon::Serve(const volatile sig_atomic_t *stop) {
+  while (!*stop) {
+    const int conn = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn == -1) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        std::cerr << "Failed to accept a connection: " << strerror(errno)
+                  << std::endl;
+      }
+      continue;
+    }
+    try {
+      Serve(conn);
+    } catch (const FatalException &exc) {
+      // the client went away, which only matters to the client
+    }
+    close(conn);
+  }
+}
+
+void Daemon::Serve(int conn) {
+  // The socket file is only accessible to our user, but check anyway, since
+  // a request can ptrace anything that we can.
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+      (cred.uid != geteuid() && cred.uid != 0)) {
+    WriteAll(conn, "ERROR Permission denied\n");
+    return;
+  }
+  const timeval timeout = {kRequestTimeout, 0};
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  std::string request = ReadUntil(conn, kMaxRequest, true);
+  const size_t end = request.find('\n');
+  if (end == std::string::npos && request.size() == kMaxRequest) {
+    WriteAll(conn, "ERROR Request too long\n");
+    return;
+  }
+  request.resize(std::min(end, request.size()));
+  WriteAll(conn, Handle(request));
+}
+}  // namespace pystack
@@ -0,0 +1,145 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <signal.h>
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "./aggregate.h"
+#include "./frame.h"
+#include "./sampler.h"
+#include "./stats.h"
+#include "./symcache.h"
+#include "./ticker.h"
+#include "./unwind.h"
+
+namespace pystack {
+
+// A process registered with the daemon. It stays attached, with its symbols,
+// maps and stack walker caches warm, so a sample costs what it does in the
+// middle of a pystack session. The Target lives on the session's own thread,
+// since ptrace requests have to come from the thread that attached, and that
+// thread also takes the samples of a profile in the background.
+class Session {
+ public:
+  // Attach to the process. Throws FatalException if it can't be sampled.
+  Session(pid_t pid, SampleMode mode, const SymbolCache *cache,
+          StringTable *strings, NativeModules *modules);
+  ~Session();
+
+  Session(const Session &other) = delete;
+  Session &operator=(const Session &other) = delete;
+
+  // Take a sample now, and print it like pystack does
+  std::string Dump();
+
+  // Start a new profile, sampling every period_ns nanoseconds, and throw away
+  // the previous one
+  void Start(uint64_t period_ns);
+
+  // Stop sampling. The profile is kept until the next Start().
+  void Stop();
+
+  // The profile so far, in the folded stack format
+  std::string Profile();
+
+  // The counters of the target, as pystack --stats prints them
+  std::string Stats();
+
+  // One line about the session, for the list command
+  std::string Describe();
+
+  inline pid_t pid() const { return pid_; }
+
+ private:
+  pid_t pid_;
+  SampleMode mode_;
+  StringTable *strings_;
+
+  // Only used on the session's thread
+  std::unique_ptr<Target> target_;
+  std::unique_ptr<Ticker> ticker_;  // while profiling
+  CallTree tree_;
+  size_t samples_;   // in the profile
+  std::string error_;  // why the target can't be sampled any more
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::packaged_task<void()>> queue_;
+  bool done_;
+  std::thread thread_;
+
+  // Run fn on the session's thread, and wait for it. Exceptions are rethrown.
+  void Call(const std::function<void()> &fn);
+
+  // Take a sample, and add it to the profile if there's one going
+  void Sample();
+
+  // Pass on the target's signals between samples, noting if it has exited
+  void Poll();
+
+  void Run();
+};
+
+// Serves requests for samples of the registered processes over a UNIX socket.
+// A request is one line, "COMMAND [ARG...]", and the response is "OK" or
+// "ERROR message" on a line of its own, followed by the output of the command.
+// Connections are served one at a time, and closed after the response.
+class Daemon {
+ public:
+  // Listen on path. The symbol cache is optional.
+  Daemon(const std::string &path, const SymbolCache *cache);
+  ~Daemon();
+
+  Daemon(const Daemon &other) = delete;
+  Daemon &operator=(const Daemon &other) = delete;
+
+  // Register a process. Throws if it's already registered, or if it can't be
+  // sampled.
+  void Add(pid_t pid, SampleMode mode, bool native);
+
+  // Serve requests until stop is set, e.g. by a signal handler. Signals
+  // interrupt waiting for a connection, so they should be installed without
+  // SA_RESTART.
+  void Serve(const volatile sig_atomic_t *stop);
+
+  // Answer one request, returning the whole response
+  std::string Handle(const std::string &request);
+
+ private:
+  std::string path_;
+  int fd_;
+  const SymbolCache *cache_;
+  StringTable strings_;
+  std::unique_ptr<NativeModules> modules_;  // created by the first --native
+  std::map<pid_t, std::unique_ptr<Session>> sessions_;
+
+  // Read a request from a connection, and write the response
+  void Serve(int conn);
+
+  Session *Find(pid_t pid);
+};
+}  // namespace pystack
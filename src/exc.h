@@ -30,4 +30,13 @@ class FatalException : public std::runtime_error {
   explicit FatalException(const std::string &what_arg)
       : std::runtime_error(what_arg) {}
 };
+
+// The data read out of the target doesn't make sense. If the target is stopped
+// this is fatal, but if it's running it can just mean that the data changed
+// while we were reading it.
+class InvalidDataException : public FatalException {
+ public:
+  explicit InvalidDataException(const std::string &what_arg)
+      : FatalException(what_arg) {}
+};
 }  // namespace pystack
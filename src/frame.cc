@@ -0,0 +1,48 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./frame.h"
+
+namespace pystack {
+uint32_t StringTable::Intern(const std::string &str) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = ids_.find(str);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+  const uint32_t id = strings_.size();
+  strings_.push_back(str);
+  ids_.insert({str, id});
+  return id;
+}
+
+const std::string &StringTable::Get(uint32_t id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return strings_.at(id);
+}
+
+size_t StringTable::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return strings_.size();
+}
+
+void WriteFrame(std::ostream &os, const StringTable &strings,
+                const Frame &frame) {
+  os << strings.Get(frame.file) << ':' << strings.Get(frame.name);
+  if (frame.line < kLabelLine) {
+    os << ':' << frame.line;
+  }
+}
+}  // namespace pystack
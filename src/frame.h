@@ -0,0 +1,110 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pystack {
+
+// Interns the strings of the frames (file and function names), so that a
+// frame is just a few ids. Ids are dense, starting from 0, and a string's id
+// never changes. Stack walkers on different threads can share a table, and only
+// allocate when they find a string that isn't in it yet.
+class StringTable {
+ public:
+  StringTable() {}
+
+  StringTable(const StringTable &other) = delete;
+  StringTable &operator=(const StringTable &other) = delete;
+
+  uint32_t Intern(const std::string &str);
+
+  // The reference stays valid for as long as the table.
+  const std::string &Get(uint32_t id) const;
+
+  size_t size() const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, uint32_t> ids_;
+  std::deque<std::string> strings_;  // a deque doesn't move what it holds
+};
+
+// A frame of a stack. The file and name are ids in the StringTable of whatever
+// made the frame, and first_line is the line where the function starts, which
+// tells apart functions of the same name in one file. Native frames have
+// kNativeLine as both lines, the library as their file and the symbol as their
+// name. The label of an idle sample, like <idle>:epoll_wait, is a frame with
+// kLabelLine as both lines.
+struct Frame {
+  uint32_t file;
+  uint32_t name;
+  uint32_t first_line;
+  uint32_t line;
+};
+
+const uint32_t kNativeLine = UINT32_MAX;
+const uint32_t kLabelLine = UINT32_MAX - 1;
+
+// The file of the label frames
+const char kIdleLabel[] = "<idle>";
+
+inline bool operator==(const Frame &a, const Frame &b) {
+  return a.file == b.file && a.name == b.name &&
+         a.first_line == b.first_line && a.line == b.line;
+}
+
+inline bool operator!=(const Frame &a, const Frame &b) { return !(a == b); }
+
+struct FrameHash {
+  size_t operator()(const Frame &frame) const {
+    const uint64_t a = static_cast<uint64_t>(frame.file) << 32 | frame.name;
+    const uint64_t b =
+        static_cast<uint64_t>(frame.first_line) << 32 | frame.line;
+    return std::hash<uint64_t>()(a ^ (b * 0x9e3779b97f4a7c15));
+  }
+};
+
+// Write a frame as file:function:line, library:symbol for a native frame, or
+// <idle>:reason for a label
+void WriteFrame(std::ostream &os, const StringTable &strings,
+                const Frame &frame);
+
+// How a thread was spending its time when it was sampled, from /proc. Threads
+// are only classified when the sampling mode needs it.
+enum class ThreadState : uint8_t {
+  kUnknown,
+  kRunning,  // on a CPU, or ready to run
+  kIdle,     // blocked in a system call, or asleep
+};
+
+struct Thread {
+  unsigned long id;  // the thread's identifier, as in thread.get_ident()
+  bool gil;          // true if this thread holds the GIL
+  ThreadState state = ThreadState::kUnknown;
+  // What the sample counts for: 1, or microseconds of CPU time in cpu mode. A
+  // thread with a weight of 0 didn't run, and isn't part of the sample.
+  uint64_t weight = 1;
+  std::vector<Frame> stack;
+};
+}  // namespace pystack
@@ -0,0 +1,91 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace pystack {
+namespace {
+// Each power of two is split into 1 << kSubBits buckets.
+const int kSubBits = 4;
+const uint64_t kSub = 1 << kSubBits;
+const size_t kBuckets = (64 - kSubBits + 1) * kSub;
+
+size_t BucketOf(uint64_t value) {
+  if (value < kSub) {
+    return value;
+  }
+  const int shift = 63 - __builtin_clzll(value) - kSubBits;
+  return (shift + 1) * kSub + ((value >> shift) - kSub);
+}
+
+// The largest value that goes in the bucket.
+uint64_t BucketLimit(size_t bucket) {
+  if (bucket < kSub) {
+    return bucket;
+  }
+  const int shift = bucket / kSub - 1;
+  const uint64_t mantissa = bucket % kSub + kSub;
+  return ((mantissa + 1) << shift) - 1;
+}
+}  // namespace
+
+Histogram::Histogram()
+    : buckets_(kBuckets),
+      count_(0),
+      sum_(0),
+      min_(std::numeric_limits<uint64_t>::max()),
+      max_(0) {}
+
+void Histogram::Add(uint64_t value) {
+  buckets_[BucketOf(value)]++;
+  count_++;
+  sum_ += value;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+}
+
+void Histogram::Merge(const Histogram &other) {
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+}
+
+double Histogram::mean() const {
+  return count_ ? static_cast<double>(sum_) / count_ : 0;
+}
+
+uint64_t Histogram::Percentile(double q) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  const uint64_t rank = std::max<uint64_t>(1, std::ceil(q * count_));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      return std::max(min_, std::min(max_, BucketLimit(i)));
+    }
+  }
+  return max_;
+}
+}  // namespace pystack
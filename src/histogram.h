@@ -0,0 +1,52 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace pystack {
+
+// A histogram of non-negative values (e.g. durations in nanoseconds) with
+// logarithmic buckets. Each power of two is split into 16 linear buckets, so
+// percentiles are accurate to within about 6% of the value, and the memory
+// used doesn't depend on the number of values added.
+class Histogram {
+ public:
+  Histogram();
+
+  void Add(uint64_t value);
+
+  // Add all of the values in another histogram
+  void Merge(const Histogram &other);
+
+  inline uint64_t count() const { return count_; }
+  inline uint64_t min() const { return count_ ? min_ : 0; }
+  inline uint64_t max() const { return max_; }
+  double mean() const;
+
+  // The value below which a fraction q (between 0 and 1) of the values fall.
+  uint64_t Percentile(double q) const;
+
+ private:
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t min_;
+  uint64_t max_;
+};
+}  // namespace pystack
@@ -0,0 +1,222 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./libpystack.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <new>
+
+#include "./exc.h"
+#include "./frame.h"
+#include "./sampler.h"
+#include "./symcache.h"
+#include "./unwind.h"
+
+// The handle is declared by the C header, so it can't be in our namespace. It
+// owns everything that pystack shares between targets.
+struct pystack_target {
+  pystack::StringTable strings;
+  std::unique_ptr<pystack::SymbolCache> cache;
+  std::unique_ptr<pystack::NativeModules> modules;
+  std::unique_ptr<pystack::Target> target;
+};
+
+namespace pystack {
+namespace {
+const int kAllFlags =
+    PYSTACK_NONBLOCKING | PYSTACK_NATIVE | PYSTACK_WAIT | PYSTACK_NO_CACHE;
+
+// By PYSTACK_MODE_ value
+const SampleMode kModes[] = {SampleMode::kGil, SampleMode::kWall,
+                             SampleMode::kCpu};
+
+// A fixed buffer, so that failing doesn't allocate
+thread_local char last_error[512];
+
+int Fail(int code, const char *what) {
+  snprintf(last_error, sizeof(last_error), "%s", what);
+  return code;
+}
+
+// Call fn, turning what it throws into a return code, since exceptions can't
+// be allowed to reach the caller.
+template <typename F>
+int Guard(F fn) {
+  try {
+    return fn();
+  } catch (const std::bad_alloc &exc) {
+    return Fail(PYSTACK_ERROR_NOMEM, "Out of memory");
+  } catch (const FatalException &exc) {
+    return Fail(PYSTACK_ERROR_PROCESS, exc.what());
+  } catch (const NonFatalException &exc) {
+    return Fail(PYSTACK_ERROR_PROCESS, exc.what());
+  } catch (const std::exception &exc) {
+    return Fail(PYSTACK_ERROR_INTERNAL, exc.what());
+  } catch (...) {
+    return Fail(PYSTACK_ERROR_INTERNAL, "Unknown exception");
+  }
+}
+
+void CopyFrame(const StringTable &strings, const Frame &frame,
+               pystack_frame *out) {
+  out->file = strings.Get(frame.file).c_str();
+  out->function = strings.Get(frame.name).c_str();
+  if (frame.line == kNativeLine || frame.line == kLabelLine) {
+    out->first_line = 0;
+    out->line = 0;
+    out->kind =
+        frame.line == kNativeLine ? PYSTACK_FRAME_NATIVE : PYSTACK_FRAME_LABEL;
+  } else {
+    out->first_line = frame.first_line;
+    out->line = frame.line;
+    out->kind = PYSTACK_FRAME_PYTHON;
+  }
+}
+
+int StateCode(ThreadState state) {
+  switch (state) {
+    case ThreadState::kRunning:
+      return PYSTACK_THREAD_RUNNING;
+    case ThreadState::kIdle:
+      return PYSTACK_THREAD_IDLE;
+    default:
+      return PYSTACK_THREAD_UNKNOWN;
+  }
+}
+
+// Copy the threads of the last sample that are part of it into the caller's
+// buffers, for as long as there's room.
+int CopySample(const pystack_target &target, pystack_buffer *buffer) {
+  int ret = PYSTACK_OK;
+  for (const auto &thread : target.target->threads()) {
+    if (!thread.weight) {
+      continue;
+    } else if (buffer->num_threads == buffer->max_threads) {
+      ret = PYSTACK_TRUNCATED;
+      break;
+    }
+    pystack_thread *out = &buffer->threads[buffer->num_threads++];
+    out->id = thread.id;
+    out->weight = thread.weight;
+    out->state = StateCode(thread.state);
+    out->holds_gil = thread.gil;
+    pystack_frame *frames = buffer->frames + buffer->num_frames;
+    const size_t n = std::min(thread.stack.size(),
+                              buffer->max_frames - buffer->num_frames);
+    if (n < thread.stack.size()) {
+      ret = PYSTACK_TRUNCATED;
+    }
+    for (size_t i = 0; i < n; i++) {
+      CopyFrame(target.strings, thread.stack[i], &frames[i]);
+    }
+    out->frames = frames;
+    out->num_frames = n;
+    buffer->num_frames += n;
+  }
+  return ret;
+}
+}  // namespace
+}  // namespace pystack
+
+using namespace pystack;
+
+int pystack_open(pid_t pid, int mode, int flags, pystack_target **target) {
+  if (target == nullptr || pid <= 0) {
+    return Fail(PYSTACK_ERROR_INVALID, "Invalid target");
+  } else if (mode < PYSTACK_MODE_GIL || mode > PYSTACK_MODE_CPU) {
+    return Fail(PYSTACK_ERROR_INVALID, "Invalid mode");
+  } else if (flags & ~kAllFlags) {
+    return Fail(PYSTACK_ERROR_INVALID, "Invalid flags");
+  }
+  return Guard([=]() {
+    std::unique_ptr<pystack_target> handle(new pystack_target);
+    if (!(flags & PYSTACK_NO_CACHE)) {
+      handle->cache.reset(new SymbolCache(SymbolCache::DefaultDir()));
+    }
+    if (flags & PYSTACK_NATIVE) {
+      handle->modules.reset(new NativeModules(&handle->strings));
+    }
+    handle->target.reset(new Target(
+        pid, kModes[mode], flags & PYSTACK_NONBLOCKING,
+        flags & PYSTACK_WAIT, handle->cache.get(), &handle->strings,
+        handle->modules.get()));
+    *target = handle.release();
+    return PYSTACK_OK;
+  });
+}
+
+int pystack_sample(pystack_target *target, pystack_buffer *buffer) {
+  if (target == nullptr || buffer == nullptr ||
+      (buffer->max_threads && buffer->threads == nullptr) ||
+      (buffer->max_frames && buffer->frames == nullptr)) {
+    return Fail(PYSTACK_ERROR_INVALID, "Invalid buffer");
+  }
+  buffer->num_threads = 0;
+  buffer->num_frames = 0;
+  return Guard([=]() {
+    if (!target->target->Sample()) {
+      return PYSTACK_AGAIN;
+    }
+    return CopySample(*target, buffer);
+  });
+}
+
+int pystack_poll(pystack_target *target) {
+  if (target == nullptr) {
+    return Fail(PYSTACK_ERROR_INVALID, "Invalid target");
+  }
+  return Guard([=]() {
+    target->target->Poll();
+    return PYSTACK_OK;
+  });
+}
+
+int pystack_close(pystack_target *target) {
+  if (target == nullptr) {
+    return PYSTACK_OK;
+  }
+  const int ret = Guard([=]() {
+    target->target->Detach();
+    return PYSTACK_OK;
+  });
+  delete target;
+  return ret;
+}
+
+const char *pystack_strerror(int code) {
+  switch (code) {
+    case PYSTACK_OK:
+      return "Success";
+    case PYSTACK_TRUNCATED:
+      return "The sample didn't fit in the buffers";
+    case PYSTACK_AGAIN:
+      return "No sample this time";
+    case PYSTACK_ERROR_INVALID:
+      return "Invalid argument";
+    case PYSTACK_ERROR_PROCESS:
+      return "The process can't be sampled";
+    case PYSTACK_ERROR_NOMEM:
+      return "Out of memory";
+    case PYSTACK_ERROR_INTERNAL:
+      return "Internal error";
+    default:
+      return "Unknown error";
+  }
+}
+
+const char *pystack_last_error(void) { return last_error; }
@@ -0,0 +1,136 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+// libpystack takes the Python stacks of other processes, for programs that
+// want to sample from their own scheduler rather than run pystack and parse
+// its output. It's a C API, so that it can be used from any language.
+//
+// A target is opened once, which attaches to the process and finds its
+// interpreter, and then sampled as often as you like into buffers that you
+// own. Once a target has seen the process's threads and code, sampling it
+// doesn't allocate memory. Nothing is thrown: every function returns one of
+// the codes below, and pystack_last_error() says what went wrong.
+//
+// ptrace requests can only be made by the thread that attached to a process,
+// so a target must only be used by the thread that opened it. Different
+// threads can have targets of their own.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped by changes that break existing callers
+#define PYSTACK_API_VERSION 1
+
+// Return codes. The positive ones aren't errors.
+#define PYSTACK_OK 0
+// The sample didn't fit in the buffers, and what did fit is in them
+#define PYSTACK_TRUNCATED 1
+// There's no sample this time, because the stacks kept changing while a
+// non-blocking target read them, or the interpreter isn't loaded yet
+#define PYSTACK_AGAIN 2
+// An argument is wrong, like an unknown mode or flag
+#define PYSTACK_ERROR_INVALID (-1)
+// The process can't be sampled: it has exited, it isn't Python, or we aren't
+// allowed to trace it. A target that returns this should be closed.
+#define PYSTACK_ERROR_PROCESS (-2)
+#define PYSTACK_ERROR_NOMEM (-3)
+// A bug in libpystack
+#define PYSTACK_ERROR_INTERNAL (-4)
+
+// What a sample is of, as with pystack --mode
+#define PYSTACK_MODE_GIL 0   // the thread that holds the GIL
+#define PYSTACK_MODE_WALL 1  // every thread
+#define PYSTACK_MODE_CPU 2   // threads that ran, weighted by their CPU time
+
+// Flags for pystack_open(), as with the pystack options of the same names
+#define PYSTACK_NONBLOCKING 0x1  // don't stop the process to sample it
+#define PYSTACK_NATIVE 0x2       // native stacks with the Python frames merged
+#define PYSTACK_WAIT 0x4         // open it even if libpython isn't loaded yet
+#define PYSTACK_NO_CACHE 0x8     // don't use the interpreter symbol cache
+
+#define PYSTACK_FRAME_PYTHON 0
+#define PYSTACK_FRAME_NATIVE 1
+// The end of an idle thread's stack, like <idle>:epoll_wait
+#define PYSTACK_FRAME_LABEL 2
+
+#define PYSTACK_THREAD_UNKNOWN 0  // the mode doesn't need to know
+#define PYSTACK_THREAD_RUNNING 1
+#define PYSTACK_THREAD_IDLE 2
+
+// A frame. The strings belong to the target, and stay valid until it's closed.
+struct pystack_frame {
+  const char *file;      // the Python file, the library, or <idle>
+  const char *function;  // the function, the symbol, or why it's idle
+  uint32_t first_line;   // where a Python function starts, otherwise 0
+  uint32_t line;         // the line of a Python frame, otherwise 0
+  int kind;              // a PYSTACK_FRAME_ value
+};
+
+struct pystack_thread {
+  uint64_t id;      // as in thread.get_ident(), or 0 if the mode doesn't say
+  uint64_t weight;  // 1, or microseconds of CPU time in cpu mode
+  int state;        // a PYSTACK_THREAD_ value
+  int holds_gil;
+  // The thread's frames, innermost first. They point into the frames buffer.
+  const struct pystack_frame *frames;
+  size_t num_frames;
+};
+
+// The buffers to sample into, which you allocate, and which can be reused for
+// every sample of every target. pystack_sample() sets the counts.
+struct pystack_buffer {
+  struct pystack_thread *threads;
+  size_t max_threads;
+  struct pystack_frame *frames;
+  size_t max_frames;
+  size_t num_threads;
+  size_t num_frames;
+};
+
+typedef struct pystack_target pystack_target;
+
+// Attach to a process and find its interpreter. On success *target is set to
+// a handle that has to be closed with pystack_close().
+int pystack_open(pid_t pid, int mode, int flags, pystack_target **target);
+
+// Sample the process. On PYSTACK_OK and PYSTACK_TRUNCATED the buffer has the
+// threads that the mode is about, and otherwise it's empty.
+int pystack_sample(pystack_target *target, struct pystack_buffer *buffer);
+
+// While a process is attached, the signals sent to it wait for us to pass
+// them on, which sampling does. If you sample less often than every 10ms or
+// so, call this in between so that the process gets them promptly.
+int pystack_poll(pystack_target *target);
+
+// Detach from the process and free the target, even if this returns an error.
+int pystack_close(pystack_target *target);
+
+// A description of a return code
+const char *pystack_strerror(int code);
+
+// What went wrong in the last call on this thread that returned an error. The
+// string is overwritten by the next error.
+const char *pystack_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
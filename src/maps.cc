@@ -0,0 +1,239 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./maps.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <utility>
+
+#include "./exc.h"
+#include "./ticker.h"
+
+namespace pystack {
+namespace {
+void ThrowMapsError(pid_t pid) {
+  std::ostringstream ss;
+  ss << "Failed to read memory map of PID " << pid << ": " << strerror(errno);
+  throw FatalException(ss.str());
+}
+
+// Read the whole of a file in /proc, which doesn't know its size in advance
+bool ReadProcFile(const std::string &path, std::string *out) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  out->clear();
+  char buf[65536];
+  for (;;) {
+    const ssize_t n = read(fd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      const int err = errno;
+      close(fd);
+      errno = err;
+      return n == 0;
+    }
+    out->append(buf, n);
+  }
+}
+
+// Parse a line like:
+// 7f2a3c000000-7f2a3c021000 r-xp 00001000 fd:01 1234   /usr/lib/libfoo.so
+bool ParseLine(const char *line, const char *end, Mapping *m) {
+  char *pos;
+  m->start = strtoul(line, &pos, 16);
+  if (*pos++ != '-') {
+    return false;
+  }
+  m->end = strtoul(pos, &pos, 16);
+  if (*pos++ != ' ' || end - pos < 5) {
+    return false;
+  }
+  m->readable = pos[0] == 'r';
+  m->executable = pos[2] == 'x';
+  m->offset = strtoul(pos + 5, &pos, 16);
+
+  // skip the device and inode to get to the path, if there is one
+  for (int field = 0; field < 2 && pos < end; field++) {
+    while (pos < end && *pos == ' ') {
+      pos++;
+    }
+    while (pos < end && *pos != ' ') {
+      pos++;
+    }
+  }
+  while (pos < end && *pos == ' ') {
+    pos++;
+  }
+  m->path.assign(pos, end - pos);
+  return m->start < m->end;
+}
+
+// The part of a path after the last slash
+const char *FileName(const std::string &path) {
+  const size_t slash = path.rfind('/');
+  return path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+}  // namespace
+
+MemoryMap::MemoryMap(pid_t pid)
+    : pid_(pid),
+      refreshes_(0),
+      refresh_ns_(0),
+      max_refresh_ns_(0),
+      generation_(0) {
+  Refresh();
+}
+
+MemoryMap::MemoryMap(std::vector<Mapping> mappings)
+    : pid_(0),
+      refreshes_(0),
+      refresh_ns_(0),
+      max_refresh_ns_(0),
+      generation_(0),
+      mappings_(std::move(mappings)) {
+  std::sort(mappings_.begin(), mappings_.end(),
+            [](const Mapping &a, const Mapping &b) {
+              return a.start < b.start;
+            });
+  IndexFiles();
+}
+
+bool MemoryMap::Refresh() {
+  if (pid_ == 0) {
+    return false;
+  }
+  const uint64_t start = MonotonicNanos();
+  const bool changed = Parse();
+  const uint64_t elapsed = MonotonicNanos() - start;
+  refreshes_++;
+  refresh_ns_ += elapsed;
+  max_refresh_ns_ = std::max(max_refresh_ns_, elapsed);
+  return changed;
+}
+
+bool MemoryMap::Parse() {
+  std::ostringstream ss;
+  ss << "/proc/" << pid_ << "/maps";
+  std::string text;
+  if (!ReadProcFile(ss.str(), &text)) {
+    ThrowMapsError(pid_);
+  }
+  if (text == text_) {
+    return false;
+  }
+
+  std::vector<Mapping> mappings;
+  Mapping m;
+  for (size_t pos = 0; pos < text.size();) {
+    size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos) {
+      eol = text.size();
+    }
+    if (ParseLine(text.data() + pos, text.data() + eol, &m)) {
+      mappings.push_back(m);
+    }
+    pos = eol + 1;
+  }
+  // the kernel lists them in order, but it's cheap to make sure
+  std::sort(
+      mappings.begin(), mappings.end(),
+      [](const Mapping &a, const Mapping &b) { return a.start < b.start; });
+  mappings_ = std::move(mappings);
+  text_ = std::move(text);
+  IndexFiles();
+  generation_++;
+  return true;
+}
+
+void MemoryMap::IndexFiles() {
+  files_.clear();
+  for (size_t i = 0; i < mappings_.size(); i++) {
+    if (mappings_[i].offset == 0 && !mappings_[i].path.empty()) {
+      files_.push_back(i);
+    }
+  }
+  // stable, so the files of the same name stay in address order
+  std::stable_sort(files_.begin(), files_.end(), [this](size_t a, size_t b) {
+    return strcmp(FileName(mappings_[a].path), FileName(mappings_[b].path)) < 0;
+  });
+}
+
+const Mapping *MemoryMap::Find(unsigned long addr) const {
+  auto it = std::upper_bound(
+      mappings_.begin(), mappings_.end(), addr,
+      [](unsigned long a, const Mapping &m) { return a < m.start; });
+  if (it == mappings_.begin()) {
+    return nullptr;
+  }
+  --it;
+  return addr < it->end ? &*it : nullptr;
+}
+
+bool MemoryMap::Readable(unsigned long addr, size_t len) const {
+  const Mapping *m = Find(addr);
+  if (m == nullptr) {
+    return false;
+  }
+  // the range may run on into the following mappings
+  const Mapping *last = mappings_.data() + mappings_.size();
+  for (;;) {
+    if (!m->readable) {
+      return false;
+    } else if (len <= m->end - addr) {
+      return true;
+    }
+    len -= m->end - addr;
+    addr = m->end;
+    if (++m == last || m->start != addr) {
+      return false;
+    }
+  }
+}
+
+unsigned long MemoryMap::LoadBase(const std::string &name, std::string *path,
+                                  bool prefix) const {
+  const bool full_path = name.find('/') != std::string::npos;
+  const char *file = FileName(name);
+  const size_t len = strlen(file);
+  auto it = std::lower_bound(
+      files_.begin(), files_.end(), file, [this](size_t i, const char *f) {
+        return strcmp(FileName(mappings_[i].path), f) < 0;
+      });
+  for (; it != files_.end(); ++it) {
+    const Mapping &m = mappings_[*it];
+    const char *other = FileName(m.path);
+    if (prefix ? strncmp(other, file, len) != 0 : strcmp(other, file) != 0) {
+      break;
+    } else if (full_path && m.path != name) {
+      continue;
+    }
+    if (path != nullptr) {
+      *path = m.path;
+    }
+    return m.start;
+  }
+  return 0;
+}
+}  // namespace pystack
@@ -0,0 +1,90 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace pystack {
+
+// One line of /proc/PID/maps
+struct Mapping {
+  unsigned long start;
+  unsigned long end;
+  unsigned long offset;  // of the start of the mapping in the file
+  bool readable;
+  bool executable;
+  std::string path;  // empty for anonymous mappings
+};
+
+// An index of the memory mappings of a process.
+class MemoryMap {
+ public:
+  // Read the mappings of the process.
+  explicit MemoryMap(pid_t pid);
+
+  // Mappings that don't change, e.g. the files mapped in a core dump.
+  explicit MemoryMap(std::vector<Mapping> mappings);
+
+  // Read the mappings again, e.g. to find a library that was loaded with
+  // dlopen(). The mappings are only parsed again if they changed, and the
+  // return value says whether they did. Fixed mappings never change.
+  bool Refresh();
+
+  // The mapping that contains addr, or null.
+  const Mapping *Find(unsigned long addr) const;
+
+  // Check that len bytes at addr are all in readable mappings.
+  bool Readable(unsigned long addr, size_t len) const;
+
+  // The load address of a file, which is the start of its mapping at file
+  // offset 0. A name with a slash is the file's full path, and otherwise its
+  // file name, or with prefix set the start of its file name. If more than one
+  // file matches, it's the first one mapped. If path isn't null it's set to the
+  // full path of the file. Returns 0 if there's no such file.
+  unsigned long LoadBase(const std::string &name, std::string *path,
+                         bool prefix = false) const;
+
+  inline const std::vector<Mapping> &mappings() const { return mappings_; }
+
+  // How many times the mappings have changed. Pointers from Find() are only
+  // valid until the next change.
+  inline size_t generation() const { return generation_; }
+
+  // How many times the mappings were read, and how long that took in total,
+  // in nanoseconds.
+  inline size_t refreshes() const { return refreshes_; }
+  inline uint64_t refresh_ns() const { return refresh_ns_; }
+  inline uint64_t max_refresh_ns() const { return max_refresh_ns_; }
+
+ private:
+  pid_t pid_;  // 0 if the mappings are fixed
+  size_t refreshes_;
+  uint64_t refresh_ns_;
+  uint64_t max_refresh_ns_;
+  size_t generation_;
+  std::string text_;  // the contents of maps when it was last parsed
+  std::vector<Mapping> mappings_;  // sorted by address
+  // the mappings at file offset 0, sorted by file name and then by address
+  std::vector<size_t> files_;
+
+  bool Parse();
+  void IndexFiles();
+};
+}  // namespace pystack
@@ -0,0 +1,184 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./memory.h"
+
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include "./exc.h"
+#include "./ptrace.h"
+#include "./ticker.h"
+
+namespace pystack {
+namespace {
+// How much of a string to read per system call.
+const size_t kStringChunk = 256;
+
+// The kernel refuses to process more than this many iovecs in one call.
+#ifdef IOV_MAX
+const size_t kMaxIov = IOV_MAX;
+#else
+const size_t kMaxIov = 1024;
+#endif
+
+size_t PageSize() {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+void ThrowReadError(pid_t pid, unsigned long addr, int err) {
+  std::ostringstream ss;
+  ss << "Failed to read memory of PID " << pid << " at "
+     << reinterpret_cast<void *>(addr) << ": " << strerror(err);
+  if (err == EFAULT) {
+    throw InvalidDataException(ss.str());
+  }
+  throw FatalException(ss.str());
+}
+}  // namespace
+
+size_t MemoryReader::ClampToPage(unsigned long addr, size_t len) {
+  const size_t room = PageSize() - (addr & (PageSize() - 1));
+  return std::min(len, room);
+}
+
+void MemoryReader::Read(unsigned long addr, void *buf, size_t len) {
+  const Span span{addr, buf, len};
+  ReadV(&span, 1);
+}
+
+long MemoryReader::ReadWord(unsigned long addr) {
+  long val;
+  Read(addr, &val, sizeof(val));
+  return val;
+}
+
+std::string MemoryReader::ReadString(unsigned long addr, size_t max_len) {
+  const unsigned long start = addr;
+  std::string out;
+  char buf[kStringChunk];
+  while (out.size() <= max_len) {
+    const size_t len = ClampToPage(addr, sizeof(buf));
+    Read(addr, buf, len);
+    const char *nul = static_cast<const char *>(memchr(buf, '\0', len));
+    if (nul != nullptr) {
+      out.append(buf, nul - buf);
+      if (out.size() <= max_len) {
+        return out;
+      }
+      break;
+    }
+    out.append(buf, len);
+    addr += len;
+  }
+  std::ostringstream ss;
+  ss << "String at " << reinterpret_cast<void *>(start)
+     << " is longer than " << max_len << " bytes";
+  throw InvalidDataException(ss.str());
+}
+
+void RemoteMemory::CheckMapped(const Span *spans, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (spans[i].len == 0 || map_->Readable(spans[i].addr, spans[i].len)) {
+      continue;
+    }
+    // the process may have mapped more memory since we last looked
+    if (may_refresh_) {
+      may_refresh_ = false;
+      const uint64_t now = MonotonicNanos();
+      if (now >= next_refresh_) {
+        next_refresh_ = now + refresh_interval_;
+        if (map_->Refresh() && map_->Readable(spans[i].addr, spans[i].len)) {
+          continue;
+        }
+      }
+    }
+    rejected_++;
+    ThrowReadError(pid_, spans[i].addr, EFAULT);
+  }
+}
+
+void RemoteMemory::ReadV(const Span *spans, size_t n) {
+  if (map_ != nullptr) {
+    CheckMapped(spans, n);
+  }
+  if (use_ptrace_) {
+    PeekV(spans, n);
+    return;
+  }
+
+  while (n) {
+    const size_t batch = std::min(n, kMaxIov);
+    local_.resize(batch);
+    remote_.resize(batch);
+    size_t want = 0;
+    for (size_t i = 0; i < batch; i++) {
+      local_[i].iov_base = spans[i].buf;
+      local_[i].iov_len = spans[i].len;
+      remote_[i].iov_base = reinterpret_cast<void *>(spans[i].addr);
+      remote_[i].iov_len = spans[i].len;
+      want += spans[i].len;
+    }
+
+    syscalls_++;
+    const ssize_t got = process_vm_readv(pid_, local_.data(), batch,
+                                         remote_.data(), batch, 0);
+    if (got == -1) {
+      if (ptrace_fallback_ && (errno == ENOSYS || errno == EPERM)) {
+        // process_vm_readv is unavailable, so use PTRACE_PEEKDATA from now on
+        use_ptrace_ = true;
+        PeekV(spans, n);
+        return;
+      }
+      ThrowReadError(pid_, spans[0].addr, errno);
+    }
+    bytes_ += got;
+    if (static_cast<size_t>(got) != want) {
+      // the transfer stops at the first span that couldn't be read
+      size_t done = got;
+      size_t i = 0;
+      while (done >= spans[i].len) {
+        done -= spans[i++].len;
+      }
+      ThrowReadError(pid_, spans[i].addr + done, EFAULT);
+    }
+    spans += batch;
+    n -= batch;
+  }
+}
+
+void RemoteMemory::PeekV(const Span *spans, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint8_t *out = static_cast<uint8_t *>(spans[i].buf);
+    size_t off = 0;
+    while (off < spans[i].len) {
+      syscalls_++;
+      const long val = PtracePeek(pid_, spans[i].addr + off);
+      const size_t len = std::min(sizeof(val), spans[i].len - off);
+      memmove(out + off, &val, len);
+      off += len;
+      bytes_ += len;
+    }
+  }
+}
+}  // namespace pystack
@@ -0,0 +1,127 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./maps.h"
+
+namespace pystack {
+
+// One piece of a scatter/gather read: copy len bytes at the remote address addr
+// into the local buffer buf.
+struct Span {
+  unsigned long addr;
+  void *buf;
+  size_t len;
+};
+
+// Something that the memory of a Python process can be read from. Reading an
+// address that isn't available throws InvalidDataException.
+class MemoryReader {
+ public:
+  virtual ~MemoryReader() {}
+
+  // Read len bytes at addr into buf.
+  void Read(unsigned long addr, void *buf, size_t len);
+
+  // Read all of the spans.
+  virtual void ReadV(const Span *spans, size_t n) = 0;
+
+  // Read the long word at addr.
+  long ReadWord(unsigned long addr);
+
+  // Read a null-terminated string of at most max_len bytes.
+  std::string ReadString(unsigned long addr, size_t max_len);
+
+  // Clamp a read of len bytes at addr so it doesn't cross into the next page.
+  // If addr is readable then so is the clamped range, which lets callers read
+  // speculatively past the end of an object of unknown size.
+  static size_t ClampToPage(unsigned long addr, size_t len);
+};
+
+// Reader for the memory of another process.
+//
+// Reads are done with process_vm_readv(2), which can copy any number of
+// disjoint remote ranges in a single system call. If process_vm_readv isn't
+// available (e.g. an old kernel, or a seccomp policy that blocks it) the reader
+// transparently falls back to reading one word at a time with PTRACE_PEEKDATA.
+// That only works if the process is ptrace-stopped, so the fallback can be
+// disabled for readers of processes that keep running.
+//
+// If the reader has a MemoryMap, reads outside of the process's mappings are
+// rejected without a system call. Reading the mappings again to see if they've
+// changed is expensive, so it's only done for the first such read after each
+// AllowRefresh(), and at most once per refresh_interval nanoseconds.
+class RemoteMemory : public MemoryReader {
+ public:
+  explicit RemoteMemory(pid_t pid, bool ptrace_fallback = true,
+                        MemoryMap *map = nullptr,
+                        uint64_t refresh_interval = 0)
+      : pid_(pid),
+        ptrace_fallback_(ptrace_fallback),
+        use_ptrace_(false),
+        map_(map),
+        may_refresh_(true),
+        refresh_interval_(refresh_interval),
+        next_refresh_(0),
+        syscalls_(0),
+        bytes_(0),
+        rejected_(0) {}
+
+  inline pid_t pid() const { return pid_; }
+
+  // Unless we've fallen back to ptrace this is a single system call.
+  void ReadV(const Span *spans, size_t n) override;
+
+  // Let the next read outside of the mappings refresh them, e.g. once per
+  // sample.
+  inline void AllowRefresh() { may_refresh_ = true; }
+
+  // The number of system calls made by the reader so far.
+  inline size_t syscalls() const { return syscalls_; }
+
+  // The number of bytes read so far.
+  inline size_t bytes() const { return bytes_; }
+
+  // The number of reads rejected by the memory map.
+  inline size_t rejected() const { return rejected_; }
+
+ private:
+  pid_t pid_;
+  bool ptrace_fallback_;
+  bool use_ptrace_;
+  MemoryMap *map_;
+  bool may_refresh_;
+  uint64_t refresh_interval_;
+  uint64_t next_refresh_;  // when the mappings may be refreshed again
+  size_t syscalls_;
+  size_t bytes_;
+  size_t rejected_;
+  std::vector<iovec> local_;  // reused by every read
+  std::vector<iovec> remote_;
+
+  void CheckMapped(const Span *spans, size_t n);
+  void PeekV(const Span *spans, size_t n);
+};
+}  // namespace pystack
@@ -0,0 +1,311 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./proc.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "./exc.h"
+
+namespace pystack {
+namespace {
+// Read the parent PID from /proc/PID/stat, or return 0 if the process is gone.
+pid_t ParentOf(const char *pid) {
+  std::ostringstream ss;
+  ss << "/proc/" << pid << "/stat";
+  std::ifstream fp(ss.str());
+  std::string stat;
+  if (!std::getline(fp, stat)) {
+    return 0;
+  }
+  // The format is "pid (comm) state ppid ...", and comm can contain anything,
+  // including spaces and parentheses.
+  const size_t pos = stat.rfind(')');
+  if (pos == std::string::npos || pos + 4 >= stat.size()) {
+    return 0;
+  }
+  return std::strtol(stat.c_str() + pos + 4, nullptr, 10);
+}
+
+// Big enough for /proc/PID/task/TID/stat, which is the longest file we read
+const size_t kTaskFileSize = 1024;
+
+struct SyscallEntry {
+  long nr;
+  const char *name;
+};
+
+// The system calls that threads usually block in. The numbers depend on the
+// architecture, and only x86-64 is listed.
+const SyscallEntry kSyscalls[] = {
+#if defined(__x86_64__)
+    {SYS_read, "read"},
+    {SYS_write, "write"},
+    {SYS_poll, "poll"},
+    {SYS_select, "select"},
+    {SYS_pause, "pause"},
+    {SYS_nanosleep, "nanosleep"},
+    {SYS_connect, "connect"},
+    {SYS_accept, "accept"},
+    {SYS_sendto, "sendto"},
+    {SYS_recvfrom, "recvfrom"},
+    {SYS_sendmsg, "sendmsg"},
+    {SYS_recvmsg, "recvmsg"},
+    {SYS_wait4, "wait4"},
+    {SYS_msgrcv, "msgrcv"},
+    {SYS_flock, "flock"},
+    {SYS_fsync, "fsync"},
+    {SYS_fdatasync, "fdatasync"},
+    {SYS_futex, "futex"},
+    {SYS_semtimedop, "semtimedop"},
+    {SYS_clock_nanosleep, "clock_nanosleep"},
+    {SYS_epoll_wait, "epoll_wait"},
+    {SYS_waitid, "waitid"},
+    {SYS_openat, "openat"},
+    {SYS_pselect6, "pselect6"},
+    {SYS_ppoll, "ppoll"},
+    {SYS_epoll_pwait, "epoll_pwait"},
+    {SYS_accept4, "accept4"},
+    {SYS_recvmmsg, "recvmmsg"},
+    {SYS_sendmmsg, "sendmmsg"},
+#endif
+    {-1, "sleeping"},
+};
+
+// Parse the state and the CPU time of a thread from its stat file. The format
+// is "pid (comm) state ppid ...", and comm can contain anything, including
+// spaces and parentheses. The CPU time is utime and stime, the 14th and 15th
+// fields, in clock ticks.
+bool ParseStat(const char *stat, char *state, uint64_t *ticks) {
+  const char *end = strrchr(stat, ')');
+  if (end == nullptr || end[1] != ' ' || end[2] == '\0') {
+    return false;
+  }
+  *state = end[2];
+  char *pos = const_cast<char *>(end + 3);
+  for (int field = 4; field < 14; field++) {
+    std::strtoull(pos, &pos, 10);
+  }
+  const uint64_t utime = std::strtoull(pos, &pos, 10);
+  *ticks = utime + std::strtoull(pos, &pos, 10);
+  return true;
+}
+}  // namespace
+
+std::vector<pid_t> ListChildren(pid_t parent) {
+  DIR *dir = opendir("/proc");
+  if (dir == nullptr) {
+    std::ostringstream ss;
+    ss << "Failed to list processes: " << strerror(errno);
+    throw FatalException(ss.str());
+  }
+  std::vector<pid_t> children;
+  while (const dirent *ent = readdir(dir)) {
+    if (isdigit(ent->d_name[0]) && ParentOf(ent->d_name) == parent) {
+      children.push_back(std::strtol(ent->d_name, nullptr, 10));
+    }
+  }
+  closedir(dir);
+  return children;
+}
+
+std::vector<pid_t> ListThreads(pid_t pid) {
+  std::ostringstream path;
+  path << "/proc/" << pid << "/task";
+  DIR *dir = opendir(path.str().c_str());
+  if (dir == nullptr) {
+    std::ostringstream ss;
+    ss << "Failed to list the threads of process " << pid << ": "
+       << strerror(errno);
+    throw FatalException(ss.str());
+  }
+  std::vector<pid_t> tids;
+  while (const dirent *ent = readdir(dir)) {
+    if (isdigit(ent->d_name[0])) {
+      tids.push_back(std::strtol(ent->d_name, nullptr, 10));
+    }
+  }
+  closedir(dir);
+  return tids;
+}
+
+std::string SyscallName(long nr) {
+  for (const auto &entry : kSyscalls) {
+    if (entry.nr == nr) {
+      return entry.name;
+    }
+  }
+  std::ostringstream ss;
+  ss << "syscall-" << nr;
+  return ss.str();
+}
+
+SchedReader::SchedReader(pid_t pid)
+    : pid_(pid), has_syscall_(true), has_schedstat_(true) {}
+
+SchedReader::~SchedReader() {
+  for (const auto &t : tasks_) {
+    Close(t.second);
+  }
+}
+
+void SchedReader::Close(const Task &task) {
+  for (int fd : {task.syscall, task.schedstat, task.stat}) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+}
+
+SchedReader::Task *SchedReader::Get(pid_t tid) {
+  Task *task = &tasks_[tid];
+  task->seen = true;
+  return task;
+}
+
+void SchedReader::Forget(pid_t tid) {
+  auto it = tasks_.find(tid);
+  if (it != tasks_.end()) {
+    Close(it->second);
+    tasks_.erase(it);
+  }
+}
+
+bool SchedReader::ReadFile(pid_t tid, const char *name, int *fd, char *buf,
+                           size_t size) {
+  if (*fd == -1) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/%s", pid_, tid, name);
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd == -1) {
+      return false;
+    }
+  }
+  ssize_t n;
+  do {
+    n = pread(*fd, buf, size - 1, 0);
+  } while (n == -1 && errno == EINTR);
+  if (n <= 0) {
+    return false;
+  }
+  buf[n] = '\0';
+  return true;
+}
+
+bool SchedReader::ReadState(pid_t tid, ThreadState *state, long *syscall) {
+  Task *task = Get(tid);
+  char buf[kTaskFileSize];
+  *syscall = -1;
+  // The syscall file is "running" for a thread that's on a CPU, or the number
+  // of the system call that it's in, which is -1 if it's in user space.
+  if (has_syscall_ &&
+      ReadFile(tid, "syscall", &task->syscall, buf, sizeof(buf))) {
+    if (strncmp(buf, "running", 7) == 0) {
+      *state = ThreadState::kRunning;
+      task->last_syscall = -1;
+      return true;
+    }
+    long nr = std::strtol(buf, nullptr, 10);
+#if defined(SYS_restart_syscall)
+    if (nr == SYS_restart_syscall) {
+      // A sleep or a wait that was interrupted, which stopping the thread does,
+      // continues in restart_syscall. It's still the call that we last saw the
+      // thread in, or just sleeping if we didn't see it.
+      nr = task->last_syscall;
+      *state = ThreadState::kIdle;
+      *syscall = nr;
+      return true;
+    }
+#endif
+    *state = nr < 0 ? ThreadState::kRunning : ThreadState::kIdle;
+    *syscall = nr < 0 ? -1 : nr;
+    task->last_syscall = *syscall;
+    return true;
+  }
+  uint64_t ticks;
+  char code;
+  if (!ReadFile(tid, "stat", &task->stat, buf, sizeof(buf)) ||
+      !ParseStat(buf, &code, &ticks)) {
+    Forget(tid);
+    return false;
+  }
+  // the thread is there, so it's the syscall file that's missing (it needs
+  // CONFIG_HAVE_ARCH_TRACEHOOK)
+  has_syscall_ = false;
+  switch (code) {
+    case 'R':
+      *state = ThreadState::kRunning;
+      break;
+    case 'S':
+    case 'D':
+      *state = ThreadState::kIdle;
+      break;
+    default:
+      // stopped, maybe by us, which hides what it was doing
+      *state = ThreadState::kUnknown;
+  }
+  return true;
+}
+
+bool SchedReader::ReadCpu(pid_t tid, uint64_t *ns) {
+  Task *task = Get(tid);
+  char buf[kTaskFileSize];
+  uint64_t cpu_ns;
+  // schedstat is "cpu_ns wait_ns timeslices", and needs CONFIG_SCHED_INFO.
+  // Otherwise stat has the CPU time in clock ticks.
+  if (has_schedstat_ &&
+      ReadFile(tid, "schedstat", &task->schedstat, buf, sizeof(buf))) {
+    cpu_ns = std::strtoull(buf, nullptr, 10);
+  } else {
+    uint64_t ticks;
+    char code;
+    if (!ReadFile(tid, "stat", &task->stat, buf, sizeof(buf)) ||
+        !ParseStat(buf, &code, &ticks)) {
+      Forget(tid);
+      return false;
+    }
+    has_schedstat_ = false;
+    cpu_ns = ticks * (1000000000 / sysconf(_SC_CLK_TCK));
+  }
+  *ns = task->has_cpu && cpu_ns > task->cpu_ns ? cpu_ns - task->cpu_ns : 0;
+  task->cpu_ns = cpu_ns;
+  task->has_cpu = true;
+  return true;
+}
+
+void SchedReader::Sweep() {
+  for (auto it = tasks_.begin(); it != tasks_.end();) {
+    if (it->second.seen) {
+      it->second.seen = false;
+      ++it;
+    } else {
+      Close(it->second);
+      it = tasks_.erase(it);
+    }
+  }
+}
+}  // namespace pystack
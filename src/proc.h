@@ -0,0 +1,91 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./frame.h"
+
+namespace pystack {
+// The PIDs of the processes whose parent is the given PID, as seen in /proc.
+std::vector<pid_t> ListChildren(pid_t parent);
+
+// The kernel thread ids of the threads of a process, from /proc/PID/task
+std::vector<pid_t> ListThreads(pid_t pid);
+
+// The name of a system call, like "epoll_wait", or "syscall-N" if we don't
+// know it. -1 means no system call, and is "sleeping".
+std::string SyscallName(long nr);
+
+// Reads what the threads of a process are doing from /proc/PID/task/TID: their
+// state, the system call that they're blocked in, and their CPU time. The files
+// are kept open and reread with pread into a buffer on the stack, so reading a
+// thread that's been seen before doesn't allocate.
+class SchedReader {
+ public:
+  explicit SchedReader(pid_t pid);
+  ~SchedReader();
+
+  SchedReader(const SchedReader &other) = delete;
+  SchedReader &operator=(const SchedReader &other) = delete;
+
+  // Find out whether a thread is running, and which system call it's blocked
+  // in if it isn't (-1 if /proc doesn't say). A thread that's stopped by
+  // ptrace is classified by what it was doing when it stopped, and one that's
+  // in a restarted call by the call that was interrupted. Returns false if the
+  // process has no such thread.
+  bool ReadState(pid_t tid, ThreadState *state, long *syscall);
+
+  // Get the CPU time that a thread has used since the last call for it, in
+  // nanoseconds, or 0 the first time. Returns false if the process has no such
+  // thread.
+  bool ReadCpu(pid_t tid, uint64_t *ns);
+
+  // Close the files of the threads that weren't read since the last call
+  void Sweep();
+
+ private:
+  struct Task {
+    // the files, opened when they're first needed
+    int syscall = -1;
+    int schedstat = -1;
+    int stat = -1;
+    uint64_t cpu_ns = 0;  // the CPU time at the last ReadCpu
+    long last_syscall = -1;  // the system call at the last ReadState
+    bool has_cpu = false;
+    bool seen = false;
+  };
+
+  pid_t pid_;
+  // not every kernel has these files, and we stop trying once one is missing
+  bool has_syscall_;
+  bool has_schedstat_;
+  std::unordered_map<pid_t, Task> tasks_;
+
+  Task *Get(pid_t tid);
+  void Forget(pid_t tid);
+  static void Close(const Task &task);
+
+  // Read a file of a thread from the start, opening it if it isn't open yet.
+  // Returns false if it can't be read.
+  bool ReadFile(pid_t tid, const char *name, int *fd, char *buf, size_t size);
+};
+}  // namespace pystack
@@ -15,32 +15,296 @@
 
 #include "./ptrace.h"
 
+#include <cstdlib>
 #include <cstring>
 #include <sstream>
 #include <stdexcept>
 #include <utility>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
 #include <sys/wait.h>
 
 #include "./exc.h"
 
 namespace pystack {
+namespace {
+void ThrowPtraceError(const char *what, pid_t pid) {
+  std::ostringstream ss;
+  ss << "Failed to " << what << " PID " << pid << ": " << strerror(errno);
+  throw FatalException(ss.str());
+}
+
+// Wait for a state change of a traced thread. Returns false if the thread has
+// exited.
+bool WaitPid(pid_t pid, int *status) {
+  while (waitpid(pid, status, __WALL) == -1) {
+    if (errno == ECHILD) {
+      return false;
+    } else if (errno != EINTR) {
+      ThrowPtraceError("wait on", pid);
+    }
+  }
+  return !WIFEXITED(*status) && !WIFSIGNALED(*status);
+}
+
+// Call fn with each thread of a process, given its open /proc/PID/task. This
+// is done with getdents64 into a buffer on the stack, since opendir allocates.
+template <typename F>
+void ForEachThread(int task_fd, pid_t pid, F fn) {
+  if (lseek(task_fd, 0, SEEK_SET) == -1) {
+    ThrowPtraceError("list threads of", pid);
+  }
+  alignas(dirent64) char buf[4096];
+  for (;;) {
+    const long n = syscall(SYS_getdents64, task_fd, buf, sizeof(buf));
+    if (n == -1) {
+      ThrowPtraceError("list threads of", pid);
+    } else if (n == 0) {
+      return;
+    }
+    for (long off = 0; off < n;) {
+      const dirent64 *ent = reinterpret_cast<const dirent64 *>(buf + off);
+      if (ent->d_name[0] != '.') {
+        fn(static_cast<pid_t>(std::strtol(ent->d_name, nullptr, 10)));
+      }
+      off += ent->d_reclen;
+    }
+  }
+}
+
+// How long to sleep between checks on an exiting leader
+const useconds_t kLeaderPollMicros = 50;
+
+void ThrowExited(pid_t pid) {
+  std::ostringstream ss;
+  ss << "PID " << pid << " exited";
+  throw FatalException(ss.str());
+}
+}  // namespace
+
+SeizedProcess::SeizedProcess(pid_t pid) : pid_(pid) {
+  std::ostringstream task;
+  task << "/proc/" << pid << "/task";
+  task_fd_ = open(task.str().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (task_fd_ == -1) {
+    ThrowPtraceError("list threads of", pid);
+  }
+  if (ptrace(PTRACE_SEIZE, pid, 0, 0)) {
+    const int err = errno;
+    close(task_fd_);
+    errno = err;
+    ThrowPtraceError("seize", pid);
+  }
+  threads_[pid] = 0;
+  try {
+    SeizeNewThreads();
+  } catch (...) {
+    // the destructor won't run, so let go of what we have
+    for (const auto &t : threads_) {
+      ptrace(PTRACE_DETACH, t.first, 0, 0);
+    }
+    close(task_fd_);
+    throw;
+  }
+}
+
+SeizedProcess::~SeizedProcess() {
+  for (const auto &t : threads_) {
+    ptrace(PTRACE_DETACH, t.first, 0, t.second);
+  }
+  close(task_fd_);
+}
+
+void SeizedProcess::SeizeNewThreads() {
+  ForEachThread(task_fd_, pid_, [this](pid_t tid) {
+    if (threads_.count(tid) == 0) {
+      // the thread may have exited since we listed it
+      if (ptrace(PTRACE_SEIZE, tid, 0, 0) == 0) {
+        threads_[tid] = 0;
+      } else if (errno != ESRCH) {
+        ThrowPtraceError("seize", tid);
+      }
+    }
+  });
+}
+
+void SeizedProcess::Interrupt() {
+  SeizeNewThreads();
+  for (const auto &t : threads_) {
+    // A thread that exited gets reaped by the wait below
+    if (ptrace(PTRACE_INTERRUPT, t.first, 0, 0) && errno != ESRCH) {
+      ThrowPtraceError("interrupt", t.first);
+    }
+  }
+
+  // The leader goes last, since if the process is exiting its exit is only
+  // reported once the other threads have been reaped.
+  bool signalled = false;
+  for (auto it = threads_.begin(); it != threads_.end();) {
+    if (it->first == pid_ || WaitStopped(it, &signalled)) {
+      ++it;
+    } else {
+      it = threads_.erase(it);
+    }
+  }
+  if (!WaitStopped(threads_.find(pid_), &signalled)) {
+    ThrowExited(pid_);
+  }
+}
+
+bool SeizedProcess::WaitStopped(ThreadIter it, bool *signalled) {
+  const pid_t tid = it->first;
+  for (;;) {
+    int status;
+    if (!(tid == pid_ && *signalled ? WaitLeader(&status)
+                                    : WaitPid(tid, &status))) {
+      return false;
+    }
+    if (status >> 16 == PTRACE_EVENT_STOP) {
+      // This is either our interrupt, or the thread was already in a group
+      // stop (e.g. someone sent it SIGSTOP), which is just as good for us.
+      const int sig = WSTOPSIG(status);
+      it->second = sig == SIGTRAP ? 0 : sig;
+      return true;
+    }
+    // A signal arrived before our interrupt did. Deliver it and keep waiting,
+    // the interrupt stays pending until it has been reported.
+    if (ptrace(PTRACE_CONT, tid, 0, WSTOPSIG(status)) && errno != ESRCH) {
+      ThrowPtraceError("continue", tid);
+    }
+    *signalled = true;
+  }
+}
+
+bool SeizedProcess::WaitLeader(int *status) {
+  for (;;) {
+    const pid_t ret = waitpid(pid_, status, __WALL | WNOHANG);
+    if (ret == pid_) {
+      return !WIFEXITED(*status) && !WIFSIGNALED(*status);
+    } else if (ret == -1 && errno == ECHILD) {
+      return false;
+    } else if (ret == -1 && errno != EINTR) {
+      ThrowPtraceError("wait on", pid_);
+    }
+    // the other threads are stopped, so all that can happen to them is exiting
+    for (auto it = threads_.begin(); it != threads_.end();) {
+      int other;
+      const pid_t tid = it->first;
+      const pid_t reaped =
+          tid == pid_ ? 0 : waitpid(tid, &other, __WALL | WNOHANG);
+      if ((reaped == -1 && errno == ECHILD) ||
+          (reaped == tid && (WIFEXITED(other) || WIFSIGNALED(other)))) {
+        it = threads_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    usleep(kLeaderPollMicros);
+  }
+}
+
+void SeizedProcess::Poll() {
+  // the leader goes last, as in Interrupt()
+  for (auto it = threads_.begin(); it != threads_.end();) {
+    if (it->first == pid_ || PollThread(it)) {
+      ++it;
+    } else {
+      it = threads_.erase(it);
+    }
+  }
+  if (!PollThread(threads_.find(pid_))) {
+    ThrowExited(pid_);
+  }
+}
+
+bool SeizedProcess::PollThread(ThreadIter it) {
+  const pid_t tid = it->first;
+  for (;;) {
+    int status;
+    const pid_t ret = waitpid(tid, &status, __WALL | WNOHANG);
+    if (ret == 0) {
+      return true;
+    } else if (ret == -1) {
+      if (errno == ECHILD) {
+        return false;
+      } else if (errno != EINTR) {
+        ThrowPtraceError("wait on", tid);
+      }
+      continue;
+    } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      return false;
+    }
+    int sig = WSTOPSIG(status);
+    bool listen = false;
+    if (status >> 16 == PTRACE_EVENT_STOP) {
+      // A group stop, which should last until someone sends SIGCONT, so just
+      // listen for events. The end of one is reported with SIGTRAP.
+      it->second = sig == SIGTRAP ? 0 : sig;
+      listen = it->second != 0;
+      sig = 0;
+    }
+    if (ptrace(listen ? PTRACE_LISTEN : PTRACE_CONT, tid, 0, sig) &&
+        errno != ESRCH) {
+      ThrowPtraceError("continue", tid);
+    }
+  }
+}
+
+void SeizedProcess::Cont() {
+  for (const auto &t : threads_) {
+    // A thread in a group stop should stay stopped, so just listen for events.
+    if (ptrace(t.second ? PTRACE_LISTEN : PTRACE_CONT, t.first, 0, 0) &&
+        errno != ESRCH) {
+      ThrowPtraceError("continue", t.first);
+    }
+  }
+}
+
+void SeizedProcess::Detach() {
+  for (const auto &t : threads_) {
+    // Pass along the group stop signal, so stopped threads stay stopped.
+    if (ptrace(PTRACE_DETACH, t.first, 0, t.second) && errno != ESRCH) {
+      ThrowPtraceError("detach", t.first);
+    }
+  }
+  threads_.clear();
+}
+
+void SeizedProcess::GetRegisters(std::vector<NativeRegs> *regs) const {
+#if defined(__x86_64__)
+  regs->clear();
+  for (const auto &t : threads_) {
+    user_regs_struct r;
+    if (ptrace(PTRACE_GETREGS, t.first, 0, &r)) {
+      if (errno == ESRCH) {
+        continue;
+      }
+      ThrowPtraceError("get the registers of", t.first);
+    }
+    regs->push_back({t.first, r.rip, r.rsp, r.rbp, r.fs_base});
+  }
+#else
+  throw FatalException("Native stacks are only supported on x86-64");
+#endif
+}
+
 void PtraceAttach(pid_t pid) {
   if (ptrace(PTRACE_ATTACH, pid, 0, 0)) {
-    std::ostringstream ss;
-    ss << "Failed to attach to PID " << pid << ": " << strerror(errno);
-    throw FatalException(ss.str());
+    ThrowPtraceError("attach to", pid);
   }
-  if (wait(nullptr) == -1) {
-    std::ostringstream ss;
-    ss << "Failed to wait on PID " << pid << ": " << strerror(errno);
-    throw FatalException(ss.str());
+  int status;
+  if (!WaitPid(pid, &status)) {
+    ThrowExited(pid);
   }
 }
 
-void PtraceDetach(pid_t pid) {
-  if (ptrace(PTRACE_DETACH, pid, 0, 0)) {
+void PtraceDetach(pid_t pid, int sig) {
+  if (ptrace(PTRACE_DETACH, pid, 0, sig)) {
     std::ostringstream ss;
     ss << "Failed to detach PID " << pid << ": " << strerror(errno);
     throw FatalException(ss.str());
@@ -59,24 +323,6 @@ long PtracePeek(pid_t pid, unsigned long addr) {
   return data;
 }
 
-std::string PtracePeekString(pid_t pid, unsigned long addr) {
-  std::ostringstream dump;
-  unsigned long off = 0;
-  while (true) {
-    const long val = PtracePeek(pid, addr + off);
-
-    // XXX: this can be micro-optimized, c.f.
-    // https://graphics.stanford.edu/~seander/bithacks.html#ZeroInWord
-    const std::string chunk(reinterpret_cast<const char *>(&val), sizeof(val));
-    dump << chunk.c_str();
-    if (chunk.find_first_of('\0') != std::string::npos) {
-      break;
-    }
-    off += sizeof(val);
-  }
-  return dump.str();
-}
-
 std::unique_ptr<uint8_t[]> PtracePeekBytes(pid_t pid, unsigned long addr,
                                            size_t nbytes) {
   // align the buffer to a word size
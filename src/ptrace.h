@@ -18,23 +18,81 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <map>
 #include <memory>
-#include <string>
+#include <vector>
+
+#include "./unwind.h"
 
 namespace pystack {
 // attach to a process
 void PtraceAttach(pid_t pid);
 
-// detach a process
-void PtraceDetach(pid_t pid);
+// detach a process, optionally delivering a signal (e.g. to leave it stopped)
+void PtraceDetach(pid_t pid, int sig = 0);
 
 // read the long word at an address
 long PtracePeek(pid_t pid, unsigned long addr);
 
-// peek a null-terminated string
-std::string PtracePeekString(pid_t pid, unsigned long addr);
-
 // peek some number of bytes
 std::unique_ptr<uint8_t[]> PtracePeekBytes(pid_t pid, unsigned long addr,
                                            size_t nbytes);
+
+// A process that we stay attached to with PTRACE_SEIZE. Seizing doesn't stop
+// the process; instead all of its threads are stopped together by Interrupt()
+// and restarted by Cont(). Threads that start later are picked up by the next
+// Interrupt(), which lists the threads from /proc/PID/task (kept open, and read
+// without allocating any memory).
+class SeizedProcess {
+ public:
+  explicit SeizedProcess(pid_t pid);
+  ~SeizedProcess();
+
+  SeizedProcess(const SeizedProcess &other) = delete;
+  SeizedProcess &operator=(const SeizedProcess &other) = delete;
+
+  // Stop every thread, and wait until they have all stopped.
+  void Interrupt();
+
+  // Restart the threads stopped by Interrupt().
+  void Cont();
+
+  // Handle what happened to the threads since Cont(), without stopping them.
+  // While we're attached, the signals sent to the process wait for us to pass
+  // them on, so this needs calling every so often if there's a while between
+  // Interrupt() calls. Throws FatalException if the process has exited.
+  void Poll();
+
+  // Detach from the process. Threads that were in a group stop (e.g. from a
+  // SIGSTOP sent by someone else) are left stopped.
+  void Detach();
+
+  // Get the registers of the stopped threads, for unwinding their native
+  // stacks. Threads that exited since they were stopped are left out. Throws
+  // FatalException on architectures other than x86-64.
+  void GetRegisters(std::vector<NativeRegs> *regs) const;
+
+  inline size_t threads() const { return threads_.size(); }
+
+ private:
+  pid_t pid_;
+  int task_fd_;
+  std::map<pid_t, int> threads_;  // thread id -> group stop signal, or 0
+  typedef std::map<pid_t, int>::iterator ThreadIter;
+
+  void SeizeNewThreads();
+
+  // Wait for a thread to stop after PTRACE_INTERRUPT, delivering the signals
+  // that arrive first. Returns false if the thread exited.
+  bool WaitStopped(ThreadIter it, bool *signalled);
+
+  // Wait for the leader once we've delivered a signal, which may be killing
+  // the process. The leader's exit is only reported once the other threads
+  // have been reaped, so they're reaped while we wait. Returns false if the
+  // leader exited.
+  bool WaitLeader(int *status);
+
+  // Handle the events of a running thread. Returns false if it exited.
+  bool PollThread(ThreadIter it);
+};
 }  // namespace pystack
@@ -15,22 +15,21 @@
 
 #include "./pyframe.h"
 
+#include <limits.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <algorithm>
+#include <array>
 #include <cstddef>
+#include <cstring>
 #include <fstream>
-#include <limits>
 #include <sstream>
 #include <string>
 
-// only needed for the struct offsets
-#include <Python.h>
-#include <frameobject.h>
-
-#include "./aslr.h"
 #include "./exc.h"
-#include "./ptrace.h"
+#include "./pylayout.h"
 #include "./pystring.h"
+#include "./symcache.h"
 #include "./symbol.h"
 
 // why would this not be true idk
@@ -38,150 +37,774 @@ static_assert(sizeof(long) == sizeof(void *), "wat platform r u on");
 
 namespace pystack {
 namespace {
-// Extract the line number from the code object. Python uses a compressed table
+// How much of a string object to read, header and all, before we know how long
+// the string actually is. Most names and line number tables fit.
+const size_t kStringPrefetch = 256;
+
+// Limits past which we assume that the data we read is garbage. Python's
+// default recursion limit is 1000.
+const size_t kMaxDepth = 4096;
+const size_t kMaxThreads = 1 << 16;
+const size_t kMaxFilename = 4096;
+const size_t kMaxName = 1024;
+const long kMaxLineTable = 1 << 24;
+
+// These caches are simply dropped if they get this big
+const size_t kMaxCodeCache = 1 << 16;
+const size_t kMaxChains = 64;
+
+// The start of the file name of libpython, for a process that doesn't link
+// against it but may load it with dlopen()
+const char kLibPythonGuess[] = "libpython";
+
+// Copy a field out of a copy of a struct.
+template <typename T>
+inline T Field(const uint8_t *buf, size_t off) {
+  T val;
+  memcpy(&val, buf + off, sizeof(val));
+  return val;
+}
+
+constexpr size_t Max(size_t a, size_t b) { return a > b ? a : b; }
+
+// Decode the line number table of a code object. Python uses a compressed table
 // data structure to store line numbers. See:
 //
-// https://svn.python.org/projects/python/trunk/Objects/lnotab_notes.txt
+// https://github.com/python/cpython/blob/3.10/Objects/lnotab_notes.txt
 //
-// This is essentially an implementation of PyFrame_GetLineNumber /
-// PyCode_Addr2Line.
-size_t GetLine(pid_t pid, unsigned long frame, unsigned long f_code) {
-  const long f_trace = PtracePeek(pid, frame + offsetof(_frame, f_trace));
-  if (f_trace) {
-    return static_cast<size_t>(
-        PtracePeek(pid, frame + offsetof(_frame, f_lineno)) &
-        std::numeric_limits<decltype(_frame::f_lineno)>::max());
-  }
-
-  const int f_lasti = PtracePeek(pid, frame + offsetof(_frame, f_lasti)) &
-                      std::numeric_limits<int>::max();
-  const long co_lnotab =
-      PtracePeek(pid, f_code + offsetof(PyCodeObject, co_lnotab));
-
-  int size =
-      PtracePeek(pid, StringSize(co_lnotab)) & std::numeric_limits<int>::max();
-  int line = PtracePeek(pid, f_code + offsetof(PyCodeObject, co_firstlineno)) &
-             std::numeric_limits<int>::max();
-  const std::unique_ptr<uint8_t[]> tbl =
-      PtracePeekBytes(pid, StringData(co_lnotab), size);
-  size /= 2;  // since we increment twice in each loop iteration
-  const uint8_t *p = tbl.get();
+// The table is decoded into (f_lasti, line) pairs in increasing order of
+// f_lasti, so that CodeInfo::Line can binary search it.
+template <LineTable kind>
+std::vector<std::pair<int, int>> DecodeLineTable(const uint8_t *tbl,
+                                                 size_t size, int line) {
+  std::vector<std::pair<int, int>> lines;
+  lines.reserve(size / 2 + 1);
   int addr = 0;
-  while (--size >= 0) {
-    addr += *p++;
-    if (addr > f_lasti) {
-      break;
+  lines.push_back({addr, line});
+  for (size_t i = 0; i + 1 < size; i += 2) {
+    const int8_t delta = static_cast<int8_t>(tbl[i + 1]);
+    if (kind == LineTable::kLnotab) {
+      addr += tbl[i];
+      line += tbl[i + 1];
+      lines.push_back({addr, line});
+    } else if (kind == LineTable::kSignedLnotab) {
+      addr += tbl[i];
+      line += delta;
+      lines.push_back({addr, line});
+    } else {
+      // Each entry is the line of the next tbl[i] bytes of bytecode, and
+      // f_lasti counts 2 byte instructions. Empty ranges only move the line,
+      // and a range without a line (e.g. cleanup code) keeps the previous one.
+      if (delta != -128) {
+        line += delta;
+      }
+      if (tbl[i] != 0) {
+        if (delta != -128) {
+          lines.push_back({addr / 2, line});
+        }
+        addr += tbl[i];
+      }
     }
-    line += *p++;
   }
-  return static_cast<size_t>(line);
+  return lines;
 }
 
-// This method will fill the stack trace. Normally in the C API there are some
-// methods that you can use to extract the filename and line number from a frame
-// object. We implement the same logic here just using PTRACE_PEEKDATA. In
-// principle we could also execute code in the context of the process, but this
-// approach is harder to mess up.
-void FollowFrame(pid_t pid, unsigned long frame, std::vector<Frame> *stack) {
-  const long f_code = PtracePeek(pid, frame + offsetof(_frame, f_code));
-  const long co_filename =
-      PtracePeek(pid, f_code + offsetof(PyCodeObject, co_filename));
-  const std::string filename = PtracePeekString(pid, StringData(co_filename));
-  stack->push_back({filename, GetLine(pid, frame, f_code)});
+// Make sure the first len bytes of a span have been read. The span is expected
+// to have been clamped to a page boundary, so this only needs another read when
+// an object straddles two pages.
+void ReadRest(MemoryReader *mem, const Span &span, size_t len,
+              std::vector<uint8_t> *out) {
+  out->resize(len);
+  memcpy(out->data(), span.buf, std::min(len, span.len));
+  if (len > span.len) {
+    mem->Read(span.addr + span.len, out->data() + span.len, len - span.len);
+  }
+}
 
-  const long f_back = PtracePeek(pid, frame + offsetof(_frame, f_back));
-  if (f_back != 0) {
-    FollowFrame(pid, f_back, stack);
+// Sanity check a pointer to a heap object.
+void CheckPointer(unsigned long addr, const char *what) {
+  if (addr == 0 || addr % alignof(void *) != 0) {
+    std::ostringstream ss;
+    ss << "Implausible " << what << " pointer "
+       << reinterpret_cast<void *>(addr);
+    throw InvalidDataException(ss.str());
   }
 }
 
-// Locate _PyThreadState_Current within libpython
-unsigned long ThreadStateFromLibPython(pid_t pid,
-                                       const std::string &libpython) {
-  std::string elf_path;
-  const size_t offset = LocateLibPython(pid, libpython, &elf_path);
-  if (offset == 0) {
+// Check that an object has the same type as every other object of its kind.
+void CheckType(const uint8_t *obj, unsigned long *expected, const char *what) {
+  const unsigned long type = Field<unsigned long>(obj, kObjectType);
+  if (*expected == 0) {
+    CheckPointer(type, what);
+    *expected = type;
+  } else if (type != *expected) {
     std::ostringstream ss;
-    ss << "Failed to locate libpython named " << libpython;
-    FatalException(ss.str());
+    ss << "Inconsistent " << what << " pointer "
+       << reinterpret_cast<void *>(type);
+    throw InvalidDataException(ss.str());
   }
+}
 
-  ELF pyelf;
-  pyelf.Open(elf_path);
-  pyelf.Parse();
-  const unsigned long threadstate = pyelf.GetThreadState();
-  if (threadstate == 0) {
-    throw FatalException("Failed to locate _PyThreadState_Current");
+// The fields of a frame object that we need
+struct RawFrame {
+  unsigned long addr;
+  unsigned long f_back;
+  unsigned long f_code;
+  int f_lasti;
+  int f_lineno;
+  bool traced;
+};
+
+// The fields of a code object that we need
+struct RawCode {
+  unsigned long co_filename;
+  unsigned long co_name;
+  unsigned long co_lnotab;
+  int first_line;
+};
+
+// Check that a cached code object is still the one we cached. If the code
+// object was freed and something else was allocated at the same address, these
+// won't all match.
+bool SameCode(const CodeInfo &info, const RawCode &code) {
+  return info.co_filename == code.co_filename &&
+         info.co_name == code.co_name && info.co_lnotab == code.co_lnotab &&
+         info.first_line == code.first_line;
+}
+
+// The bits of PyASCIIObject's state
+const uint32_t kStrKindShift = 2;
+const uint32_t kStrKindMask = 7;
+const uint32_t kStrCompact = 1 << 5;
+const uint32_t kStrAscii = 1 << 6;
+const uint32_t kStrReady = 1 << 7;
+
+// Decode a str object, given a span that was read from its start, as UTF-8. In
+// Python 3 the characters are 1, 2 or 4 bytes each, depending on the widest of
+// them, and the length of the str says how many bytes to read. A Python 2 str
+// is just bytes, which are copied as they are.
+template <typename L>
+std::string ReadStr(MemoryReader *mem, const Span &span, size_t max_len) {
+  std::vector<uint8_t> buf;
+  ReadRest(mem, span, Max(L::kStrData, L::kCompactStrData + sizeof(long)),
+           &buf);
+  const long length = Field<long>(buf.data(), kVarObjectSize);
+  if (length < 0 || static_cast<size_t>(length) > max_len) {
+    std::ostringstream ss;
+    ss << "Implausible string length " << length;
+    throw InvalidDataException(ss.str());
+  }
+
+  size_t kind = 1;
+  size_t data = L::kStrData;
+  unsigned long remote = 0;
+  if (L::kUnicodeStr) {
+    const uint32_t state = Field<uint32_t>(buf.data(), L::kStrState);
+    kind = state >> kStrKindShift & kStrKindMask;
+    if (!(state & kStrReady) || (kind != 1 && kind != 2 && kind != 4)) {
+      std::ostringstream ss;
+      ss << "Implausible string state " << state;
+      throw InvalidDataException(ss.str());
+    }
+    if (!(state & kStrCompact)) {
+      remote = Field<unsigned long>(buf.data(), L::kCompactStrData);
+      CheckPointer(remote, "string data");
+    } else if (!(state & kStrAscii)) {
+      data = L::kCompactStrData;
+    }
   }
-  return threadstate + offset;
+
+  const size_t size = length * kind;
+  if (remote != 0) {
+    buf.resize(size);
+    mem->Read(remote, buf.data(), size);
+    data = 0;
+  } else {
+    ReadRest(mem, span, data + size, &buf);
+  }
+  std::string out;
+  if (L::kUnicodeStr) {
+    AppendUtf8(buf.data() + data, length, kind, &out);
+  } else {
+    out.assign(reinterpret_cast<const char *>(buf.data() + data), size);
+  }
+  return out;
 }
 
-}  // namespace
+// Read the filename, function name and line number table of a code object.
+// This takes one read for all three, plus more if they're unusually big.
+template <typename L>
+CodeInfo LoadCode(MemoryReader *mem, StringTable *strings,
+                  const RawCode &code) {
+  CodeInfo info;
+  info.co_filename = code.co_filename;
+  info.co_name = code.co_name;
+  info.co_lnotab = code.co_lnotab;
+  info.first_line = code.first_line;
+  CheckPointer(info.co_filename, "filename");
+  CheckPointer(info.co_name, "function name");
+  CheckPointer(info.co_lnotab, "line number table");
 
-std::ostream &operator<<(std::ostream &os, const Frame &frame) {
-  os << frame.file() << ':' << frame.line();
-  return os;
+  uint8_t file_buf[kStringPrefetch];
+  uint8_t name_buf[kStringPrefetch];
+  uint8_t tbl_buf[kStringPrefetch];
+  const Span spans[] = {
+      {info.co_filename, file_buf,
+       MemoryReader::ClampToPage(info.co_filename, kStringPrefetch)},
+      {info.co_name, name_buf,
+       MemoryReader::ClampToPage(info.co_name, kStringPrefetch)},
+      {info.co_lnotab, tbl_buf,
+       MemoryReader::ClampToPage(info.co_lnotab, kStringPrefetch)}};
+  mem->ReadV(spans, 3);
+  info.file = strings->Intern(ReadStr<L>(mem, spans[0], kMaxFilename));
+  info.name = strings->Intern(ReadStr<L>(mem, spans[1], kMaxName));
+
+  std::vector<uint8_t> tbl;
+  ReadRest(mem, spans[2], kVarObjectSize + sizeof(long), &tbl);
+  const long size = Field<long>(tbl.data(), kVarObjectSize);
+  if (size < 0 || size > kMaxLineTable) {
+    std::ostringstream ss;
+    ss << "Implausible line number table size " << size;
+    throw InvalidDataException(ss.str());
+  }
+  ReadRest(mem, spans[2], L::kBytesData + size, &tbl);
+  info.lines = DecodeLineTable<L::kLineTable>(tbl.data() + L::kBytesData, size,
+                                              info.first_line);
+  return info;
 }
 
-unsigned long ThreadStateAddr(pid_t pid) {
-  std::ostringstream ss;
-  ss << "/proc/" << pid << "/exe";
-  ELF target;
-  target.Open(ss.str());
-  target.Parse();
-
-  // There's two different cases here. The default way Python is compiled you
-  // get a "static" build which means that you get a big several-megabytes
-  // Python executable that has all of the symbols statically built in. For
-  // instance, this is how Python is built on Debian and Ubuntu. This is the
-  // easiest case to handle, since in this case there are no tricks, we just
-  // need to find the symbol in the ELF file.
-  //
-  // There's also a configure option called --enable-shared where you get a
-  // small several-kilobytes Python executable that links against a
-  // several-megabytes libpython2.7.so. This is how Python is built on Fedora.
-  // If that's the case we need to do some fiddly things to find the true symbol
-  // location.
-  //
-  // The code here attempts to detect if the executable links against
-  // libpython2.7.so, and if it does the libpython variable will be filled with
-  // the full soname. That determines where we need to look to find our symbol
-  // table.
-  std::string libpython;
-  for (const auto &lib : target.NeededLibs()) {
-    if (lib.find("libpython") != std::string::npos) {
-      libpython = lib;
+// Functions that each version added, newest first, which tell us which version
+// an interpreter is. Python 3.11 added Py_Version, and changed frames entirely.
+const struct {
+  const char *symbol;
+  uint32_t version;
+} kVersionMarkers[] = {
+    {"PyAIter_Check", Py310::kVersion},    {"Py_GenericAlias", Py39::kVersion},
+    {"PyVectorcall_Call", Py38::kVersion}, {"PyContext_New", Py37::kVersion},
+    {"PyAsyncGen_Type", Py36::kVersion},   {"PyString_Type", Py27::kVersion},
+};
+
+// From Python 3.7 the globals are members of _PyRuntime
+template <typename L>
+void RuntimeAddrs(unsigned long runtime, CachedSymbols *symbols) {
+  symbols->thread_state = runtime + L::kRuntimeThreadState;
+  symbols->interp_head = runtime + L::kRuntimeInterpHead;
+}
+
+// Look up our symbols in a parsed ELF file
+void LookupAddrs(ELF *elf, CachedSymbols *symbols) {
+  std::vector<const char *> names{"_PyThreadState_Current", "interp_head",
+                                  "_PyRuntime", "Py_Version"};
+  for (const auto &marker : kVersionMarkers) {
+    names.push_back(marker.symbol);
+  }
+  const std::vector<unsigned long> found = elf->LookupSymbols(names);
+  if (found[3] != 0) {
+    throw FatalException("Python 3.11 and later aren't supported");
+  }
+  symbols->layout = 0;
+  for (size_t i = 0; i < sizeof(kVersionMarkers) / sizeof(*kVersionMarkers);
+       i++) {
+    if (found[4 + i] != 0) {
+      symbols->layout = kVersionMarkers[i].version;
       break;
     }
   }
-  if (!libpython.empty()) {
-    return ThreadStateFromLibPython(pid, libpython);
+  symbols->thread_state = found[0];
+  symbols->interp_head = found[1];
+  if (found[2] != 0) {
+    switch (symbols->layout) {
+      case Py37::kVersion:
+        RuntimeAddrs<Py37>(found[2], symbols);
+        break;
+      case Py38::kVersion:
+        RuntimeAddrs<Py38>(found[2], symbols);
+        break;
+      case Py39::kVersion:
+        RuntimeAddrs<Py39>(found[2], symbols);
+        break;
+      case Py310::kVersion:
+        RuntimeAddrs<Py310>(found[2], symbols);
+        break;
+    }
+  }
+}
+
+// Find out where the interpreter is from the executable.
+//
+// There's two different cases here. The default way Python is compiled you get
+// a "static" build which means that you get a big several-megabytes Python
+// executable that has all of the symbols statically built in. For instance,
+// this is how Python is built on Debian and Ubuntu. This is the easiest case to
+// handle, since in this case there are no tricks, we just need to find the
+// symbol in the ELF file.
+//
+// There's also a configure option called --enable-shared where you get a small
+// several-kilobytes Python executable that links against a several-megabytes
+// libpython2.7.so (or libpython3.x.so). This is how Python is built on Fedora.
+// If that's the case we need to do some fiddly things to find the true symbol
+// location.
+//
+// The code here attempts to detect if the executable links against libpython,
+// and if it does the libpython field will be filled with the full soname. That
+// determines where we need to look to find our symbol table.
+CachedSymbols ExecutableSymbols(ELF *exe) {
+  CachedSymbols symbols{"", 0, 0, 0};
+  exe->Parse();
+  for (const auto &lib : exe->NeededLibs()) {
+    if (lib.find("libpython") != std::string::npos) {
+      symbols.libpython = lib;
+      return symbols;
+    }
   }
   // Appears to be statically linked, find the symbols in the binary
-  unsigned long threadstate = target.GetThreadState();
-  if (threadstate == 0) {
+  LookupAddrs(exe, &symbols);
+  if (symbols.thread_state == 0) {
     // A process like uwsgi may use dlopen() to load libpython... let's just
-    // guess that the DSO is called libpython2.7.so
-    //
-    // XXX: this won't work if the embedding language is Python 3
-    threadstate = ThreadStateFromLibPython(pid, "libpython2.7.so");
+    // guess that the DSO is called libpython-something
+    symbols.libpython = kLibPythonGuess;
+  }
+  return symbols;
+}
+
+CachedSymbols LibrarySymbols(ELF *lib) {
+  CachedSymbols symbols{"", 0, 0, 0};
+  lib->Parse();
+  LookupAddrs(lib, &symbols);
+  return symbols;
+}
+
+// Get what we need to know about an ELF file from the cache, or else find it
+// out with lookup and add it to the cache.
+CachedSymbols CachedLookup(ELF *elf, const SymbolCache *cache,
+                           CachedSymbols (*lookup)(ELF *)) {
+  std::string build_id;
+  if (cache != nullptr) {
+    build_id = elf->BuildId();
+    CachedSymbols symbols;
+    if (cache->Lookup(build_id, &symbols)) {
+      return symbols;
+    }
+  }
+  const CachedSymbols symbols = lookup(elf);
+  if (cache != nullptr) {
+    cache->Store(build_id, symbols);
+  }
+  return symbols;
+}
+}  // namespace
+
+namespace {
+// Locate the interpreter given the executable to read the symbols from, and the
+// name it's mapped under. where says which process it is, for errors.
+PyAddrs Locate(const std::string &exe_path, const std::string &exe_name,
+               const MemoryMap &maps, const SymbolCache *cache,
+               const std::string &where) {
+  ELF exe;
+  exe.Open(exe_path);
+  const CachedSymbols symbols = CachedLookup(&exe, cache, ExecutableSymbols);
+  if (symbols.libpython.empty()) {
+    // A position independent executable has its symbols relative to wherever
+    // it was loaded
+    unsigned long base = 0;
+    if (exe.type() == ET_DYN) {
+      base = exe_name.empty() ? 0 : maps.LoadBase(exe_name, nullptr);
+      if (base == 0) {
+        std::ostringstream err;
+        err << "Failed to find the load address of " << where;
+        throw FatalException(err.str());
+      }
+    }
+    return {symbols.thread_state + base,
+            symbols.interp_head ? symbols.interp_head + base : 0,
+            symbols.layout};
+  }
+
+  // Locate _PyThreadState_Current within libpython. The library may not have
+  // been loaded yet if the process embeds Python and uses dlopen().
+  std::string elf_path;
+  const unsigned long base = maps.LoadBase(
+      symbols.libpython, &elf_path, symbols.libpython == kLibPythonGuess);
+  if (base == 0) {
+    std::ostringstream err;
+    err << symbols.libpython << " isn't loaded in " << where;
+    throw NonFatalException(err.str());
+  }
+  ELF lib;
+  lib.Open(elf_path);
+  const CachedSymbols lib_symbols = CachedLookup(&lib, cache, LibrarySymbols);
+  if (lib_symbols.thread_state == 0) {
+    throw FatalException("Failed to locate _PyThreadState_Current");
+  }
+  return {lib_symbols.thread_state + base,
+          lib_symbols.interp_head ? lib_symbols.interp_head + base : 0,
+          lib_symbols.layout};
+}
+}  // namespace
+
+PyAddrs LocatePython(pid_t pid, const MemoryMap &maps,
+                     const SymbolCache *cache) {
+  std::ostringstream exe;
+  exe << "/proc/" << pid << "/exe";
+  char path[PATH_MAX];
+  const ssize_t len = readlink(exe.str().c_str(), path, sizeof(path) - 1);
+  std::ostringstream where;
+  where << "PID " << pid;
+  return Locate(exe.str(), len > 0 ? std::string(path, len) : "", maps, cache,
+                where.str());
+}
+
+PyAddrs LocatePython(const std::string &exe, const std::string &mapped_exe,
+                     const MemoryMap &maps, const SymbolCache *cache) {
+  return Locate(exe, mapped_exe, maps, cache, "the core file");
+}
+
+int CodeInfo::Line(int f_lasti) const {
+  auto it = std::upper_bound(
+      lines.begin(), lines.end(), f_lasti,
+      [](int lasti, const std::pair<int, int> &entry) {
+        return lasti < entry.first;
+      });
+  return it == lines.begin() ? first_line : std::prev(it)->second;
+}
+
+namespace {
+// A stack walker for the layout L. The structs are copied out of the process as
+// raw bytes, just as far as the last field we need, and the fields are picked
+// out at the offsets of the layout.
+template <typename L>
+class LayoutWalker : public StackWalker {
+ public:
+  LayoutWalker(MemoryReader *mem, StringTable *strings)
+      : StackWalker(mem, strings) {}
+
+  bool GetStack(unsigned long addr, std::vector<Frame> *stack) override;
+  void GetThreads(const PyAddrs &addrs, std::vector<Thread> *threads) override;
+
+ private:
+  typedef std::array<uint8_t, L::kFrameLineno + sizeof(int)> FrameData;
+  typedef std::array<uint8_t, Max(Max(Max(L::kCodeFilename, L::kCodeName),
+                                      L::kCodeLineTable) +
+                                      sizeof(long),
+                                  L::kCodeFirstLine + sizeof(int))>
+      CodeData;
+  typedef std::array<uint8_t, L::kThreadId + sizeof(long)> ThreadData;
+  typedef std::array<uint8_t, L::kInterpThreads + sizeof(long)> InterpData;
+
+  // Buffers for the walks, which keep their capacity from one to the next
+  std::vector<RawFrame> raw_;
+  std::vector<CodeData> codes_;
+  std::vector<FrameData> kept_;
+  std::vector<Span> spans_;
+
+  void WalkStack(unsigned long thread, unsigned long addr,
+                 std::vector<Frame> *stack);
+};
+
+template <typename L>
+RawFrame ParseFrame(unsigned long addr, const uint8_t *frame) {
+  return {addr,
+          Field<unsigned long>(frame, L::kFrameBack),
+          Field<unsigned long>(frame, L::kFrameCode),
+          Field<int>(frame, L::kFrameLasti),
+          Field<int>(frame, L::kFrameLineno),
+          Field<unsigned long>(frame, L::kFrameTrace) != 0};
+}
+
+template <typename L>
+RawCode ParseCode(const uint8_t *code) {
+  return {Field<unsigned long>(code, L::kCodeFilename),
+          Field<unsigned long>(code, L::kCodeName),
+          Field<unsigned long>(code, L::kCodeLineTable),
+          Field<int>(code, L::kCodeFirstLine)};
+}
+
+// Where a frame address goes in a chain's index, which has a power of 2 size
+inline size_t Slot(unsigned long addr, size_t size) {
+  return (addr * 0x9e3779b97f4a7c15 >> 32) & (size - 1);
+}
+}  // namespace
+
+size_t StackWalker::Find(const Chain &chain, unsigned long addr) {
+  if (chain.index.empty()) {
+    return chain.entries.size();
+  }
+  const size_t pos = chain.index[Slot(addr, chain.index.size())];
+  return pos < chain.entries.size() && chain.entries[pos].addr == addr
+             ? pos
+             : chain.entries.size();
+}
+
+void StackWalker::Index(Chain *chain, size_t pos) {
+  const size_t want = 4 * chain->entries.size();
+  if (chain->index.size() >= want) {
+    chain->index[Slot(chain->entries[pos].addr, chain->index.size())] = pos;
+    return;
+  }
+  // grow it, so that collisions stay rare, and index every entry again
+  size_t size = 64;
+  while (size < want) {
+    size *= 2;
+  }
+  chain->index.assign(size, 0);
+  for (size_t i = 0; i < chain->entries.size(); i++) {
+    chain->index[Slot(chain->entries[i].addr, size)] = i;
   }
-  return threadstate;
 }
 
-std::vector<Frame> GetStack(pid_t pid, unsigned long addr) {
+std::unique_ptr<StackWalker> StackWalker::Create(MemoryReader *mem,
+                                                 uint32_t version,
+                                                 StringTable *strings) {
+  switch (version) {
+    case Py27::kVersion:
+      return std::unique_ptr<StackWalker>(
+          new LayoutWalker<Py27>(mem, strings));
+    case Py36::kVersion:
+      return std::unique_ptr<StackWalker>(
+          new LayoutWalker<Py36>(mem, strings));
+    case Py37::kVersion:
+      return std::unique_ptr<StackWalker>(
+          new LayoutWalker<Py37>(mem, strings));
+    case Py38::kVersion:
+      return std::unique_ptr<StackWalker>(
+          new LayoutWalker<Py38>(mem, strings));
+    case Py39::kVersion:
+      return std::unique_ptr<StackWalker>(
+          new LayoutWalker<Py39>(mem, strings));
+    case Py310::kVersion:
+      return std::unique_ptr<StackWalker>(
+          new LayoutWalker<Py310>(mem, strings));
+  }
+  std::ostringstream ss;
+  ss << "Unsupported Python version";
+  if (version != 0) {
+    ss << " " << (version >> 8) << "." << (version & 0xff);
+  }
+  ss << " (Pystack reads 2.7 and 3.6 to 3.10)";
+  throw FatalException(ss.str());
+}
+
+// This method will fill the stack trace. Normally in the C API there are some
+// methods that you can use to extract the filename and line number from a frame
+// object. We implement the same logic here by copying the frame and code
+// objects out of the process. In principle we could also execute code in the
+// context of the process, but this approach is harder to mess up.
+//
+// The frames are read one at a time, since each one points to the next. Most of
+// the time the outer frames of a stack don't change from one sample to the
+// next, so as soon as we read a frame that was also in the thread's previous
+// stack, with the same code object and the same caller, we stop and reuse the
+// rest of the previous stack.
+//
+// Then the code objects of the new frames are read together with the reused
+// frames, which checks that the cached information about them is still valid
+// and updates the line numbers of the reused frames. Only code objects that we
+// haven't seen before need any more reads.
+template <typename L>
+void LayoutWalker<L>::WalkStack(unsigned long thread, unsigned long addr,
+                                std::vector<Frame> *stack) {
+  Chain &chain = chains_[thread];
+  chain.walk = walks_;
+
+  // every frame and code object should have the same type
+  unsigned long frame_type = 0;
+  unsigned long code_type = 0;
+  raw_.clear();
+  size_t keep = 0;  // how many of the outer frames of the chain to keep
+  // Brent's cycle detection: a frame is saved at each power of 2 depth, and a
+  // loop brings us back to it before the depth doubles again.
+  unsigned long saved = 0;
+  size_t next_save = 1;
+  for (unsigned long f = addr; f != 0;) {
+    if (raw_.size() == kMaxDepth) {
+      throw InvalidDataException("Stack is implausibly deep");
+    } else if (f == saved) {
+      throw InvalidDataException("Loop in the frame chain");
+    } else if (raw_.size() == next_save) {
+      saved = f;
+      next_save *= 2;
+    }
+
+    CheckPointer(f, "frame");
+    FrameData frame;
+    mem_->Read(f, frame.data(), frame.size());
+    CheckType(frame.data(), &frame_type, "frame type");
+    raw_.push_back(ParseFrame<L>(f, frame.data()));
+    CheckPointer(raw_.back().f_code, "code");
+
+    const size_t pos = Find(chain, f);
+    if (pos < chain.entries.size()) {
+      const ChainEntry &prev = chain.entries[pos];
+      if (prev.f_code == raw_.back().f_code &&
+          prev.f_back == raw_.back().f_back) {
+        keep = pos;
+        break;
+      }
+    }
+    f = raw_.back().f_back;
+  }
+  if (keep + raw_.size() > kMaxDepth) {
+    throw InvalidDataException("Stack is implausibly deep");
+  }
+
+  // Read the code objects of the new frames, and the frames we're reusing,
+  // since their line numbers may have changed.
+  codes_.resize(raw_.size());
+  kept_.resize(keep);
+  spans_.clear();
+  for (size_t i = 0; i < raw_.size(); i++) {
+    spans_.push_back({raw_[i].f_code, codes_[i].data(), codes_[i].size()});
+  }
+  for (size_t i = 0; i < keep; i++) {
+    spans_.push_back(
+        {chain.entries[i].addr, kept_[i].data(), kept_[i].size()});
+  }
+  mem_->ReadV(spans_.data(), spans_.size());
+
+  for (size_t i = 0; i < keep; i++) {
+    ChainEntry &entry = chain.entries[i];
+    CheckType(kept_[i].data(), &frame_type, "frame type");
+    const RawFrame frame = ParseFrame<L>(entry.addr, kept_[i].data());
+    auto it = code_.find(entry.f_code);
+    if (frame.f_code != entry.f_code || frame.f_back != entry.f_back ||
+        it == code_.end()) {
+      // the outer frames changed too, so start over without reusing any
+      chain.entries.clear();
+      return WalkStack(thread, addr, stack);
+    }
+    const int line =
+        frame.traced ? frame.f_lineno : it->second.Line(frame.f_lasti);
+    entry.frame.line = line;
+  }
+
+  // Drop the frames that returned since the last sample, and add the new ones
+  // (outermost first, since that's the order of the chain). The index doesn't
+  // need to forget the dropped frames, since Find checks what it finds.
+  chain.entries.resize(keep);
+  for (size_t i = raw_.size(); i-- > 0;) {
+    CheckType(codes_[i].data(), &code_type, "code type");
+    const RawCode code = ParseCode<L>(codes_[i].data());
+    auto it = code_.find(raw_[i].f_code);
+    if (it == code_.end()) {
+      if (code_.size() >= kMaxCodeCache) {
+        code_.clear();
+      }
+      it = code_.insert({raw_[i].f_code, LoadCode<L>(mem_, strings_, code)})
+               .first;
+    } else if (!SameCode(it->second, code)) {
+      it->second = LoadCode<L>(mem_, strings_, code);
+    }
+    const CodeInfo &info = it->second;
+    const int line =
+        raw_[i].traced ? raw_[i].f_lineno : info.Line(raw_[i].f_lasti);
+    chain.entries.push_back({raw_[i].addr, raw_[i].f_back, raw_[i].f_code,
+                             {info.file, info.name,
+                              static_cast<uint32_t>(info.first_line),
+                              static_cast<uint32_t>(line)}});
+    Index(&chain, chain.entries.size() - 1);
+  }
+  frames_ += chain.entries.size();
+  reused_frames_ += keep;
+
+  stack->clear();
+  for (auto it = chain.entries.rbegin(); it != chain.entries.rend(); ++it) {
+    stack->push_back(it->frame);
+  }
+}
+
+template <typename L>
+bool LayoutWalker<L>::GetStack(unsigned long addr, std::vector<Frame> *stack) {
   // dereference _PyThreadState_Current
-  const long state = PtracePeek(pid, addr);
+  const long state = mem_->ReadWord(addr);
   if (state == 0) {
-    throw NonFatalException("No active frame for the Python interpreter.");
+    stack->assign(1, released_);
+    return false;
   }
 
   // dereference the current frame
-  const long frame = PtracePeek(pid, state + offsetof(PyThreadState, frame));
+  const long frame = mem_->ReadWord(state + L::kThreadFrame);
 
-  // get the stack trace
-  std::vector<Frame> stack;
-  FollowFrame(pid, frame, &stack);
-  return stack;
+  // the GIL moves between threads, so remember the stacks of a few of them
+  if (chains_.size() > kMaxChains) {
+    chains_.clear();
+  }
+  WalkStack(state, frame, stack);
+  return true;
+}
+
+template <typename L>
+void LayoutWalker<L>::GetThreads(const PyAddrs &addrs,
+                                 std::vector<Thread> *threads) {
+  const unsigned long current = mem_->ReadWord(addrs.thread_state);
+
+  // interp_head is static, so it's only available if the symbol table wasn't
+  // stripped. Otherwise we can still find the interpreter from the thread that
+  // holds the GIL, if any.
+  unsigned long interp = 0;
+  if (addrs.interp_head != 0) {
+    interp = mem_->ReadWord(addrs.interp_head);
+  } else if (current != 0) {
+    interp = mem_->ReadWord(current + L::kThreadInterp);
+  } else {
+    throw NonFatalException(
+        "No interp_head symbol, and no thread holds the GIL.");
+  }
+
+  // the threads are filled in place, so that their stacks keep their capacity
+  size_t count = 0;
+  walks_++;
+  // Brent's cycle detection for both lists, as in WalkStack
+  unsigned long saved_interp = 0;
+  size_t interps = 0;
+  size_t next_interp = 1;
+  while (interp != 0) {
+    if (interp == saved_interp) {
+      throw InvalidDataException("Loop in the interpreter list");
+    } else if (++interps == next_interp) {
+      saved_interp = interp;
+      next_interp *= 2;
+    }
+    InterpData is;
+    mem_->Read(interp, is.data(), is.size());
+    unsigned long saved = 0;
+    size_t length = 0;
+    size_t next_save = 1;
+    for (unsigned long t = Field<unsigned long>(is.data(), L::kInterpThreads);
+         t != 0;) {
+      if (count == kMaxThreads) {
+        throw InvalidDataException("Implausibly many threads");
+      } else if (t == saved) {
+        throw InvalidDataException("Loop in the thread list");
+      } else if (++length == next_save) {
+        saved = t;
+        next_save *= 2;
+      }
+
+      ThreadData ts;
+      mem_->Read(t, ts.data(), ts.size());
+      if (count == threads->size()) {
+        threads->emplace_back();
+      }
+      Thread &thread = (*threads)[count++];
+      thread.id = Field<unsigned long>(ts.data(), L::kThreadId);
+      thread.gil = t == current;
+      thread.state = ThreadState::kUnknown;
+      thread.weight = 1;
+      WalkStack(t, Field<unsigned long>(ts.data(), L::kThreadFrame),
+                &thread.stack);
+      t = Field<unsigned long>(ts.data(), L::kThreadNext);
+    }
+    interp = Field<unsigned long>(is.data(), L::kInterpNext);
+  }
+  threads->resize(count);
+
+  // forget the stacks of threads that have exited
+  for (auto it = chains_.begin(); it != chains_.end();) {
+    if (it->second.walk != walks_) {
+      it = chains_.erase(it);
+    } else {
+      ++it;
+    }
+  }
 }
 }  // namespace pystack
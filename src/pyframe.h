@@ -17,31 +17,140 @@
 
 #include <sys/types.h>
 
-#include <iostream>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "./frame.h"
+#include "./maps.h"
+#include "./memory.h"
+#include "./symcache.h"
+
 namespace pystack {
 
-class Frame {
- public:
-  Frame() = delete;
-  Frame(const Frame &other) : file_(other.file_), line_(other.line_) {}
-  Frame(const std::string &file, size_t line) : file_(file), line_(line) {}
+// Addresses of the interpreter's global variables in the target process.
+struct PyAddrs {
+  unsigned long thread_state;  // _PyThreadState_Current
+  unsigned long interp_head;   // interp_head, or 0 if the symbol was stripped
+  uint32_t version;            // the interpreter's version, major << 8 | minor
+};
+
+// Locate _PyThreadState_Current and interp_head (or where they are in
+// _PyRuntime, from Python 3.7), and find out which version the interpreter is
+// from the symbols it has. If there's a cache, the
+// symbols of interpreter builds that are in it are used, rather than reading
+// their symbol tables again, and new ones are added to it. Throws
+// NonFatalException if the process uses a libpython that isn't loaded yet.
+PyAddrs LocatePython(pid_t pid, const MemoryMap &maps,
+                     const SymbolCache *cache = nullptr);
+
+// Locate them in a process that isn't running, from a core file: exe is a copy
+// of the executable, mapped_exe is its path in the process, and maps has the
+// files that the process had mapped.
+PyAddrs LocatePython(const std::string &exe, const std::string &mapped_exe,
+                     const MemoryMap &maps, const SymbolCache *cache = nullptr);
 
-  inline const std::string &file() const { return file_; }
-  inline size_t line() const { return line_; }
+// What we know about a code object
+struct CodeInfo {
+  uint32_t file;  // in the walker's StringTable
+  uint32_t name;  // likewise
+  int first_line;
 
- private:
-  std::string file_;
-  size_t line_;
+  // The decoded line number table, as (bytecode offset, line) pairs sorted by
+  // offset. Each line applies up to the offset of the next entry.
+  std::vector<std::pair<int, int>> lines;
+
+  // The pointers that the code object had when it was cached
+  unsigned long co_filename;
+  unsigned long co_name;
+  unsigned long co_lnotab;
+
+  // Get the line number of a bytecode offset
+  int Line(int f_lasti) const;
 };
 
-std::ostream &operator<<(std::ostream &os, const Frame &frame);
+// Reads Python stacks from a process. Information about code objects is cached
+// from one sample to the next, so a single walker should be used for the whole
+// session.
+//
+// The stacks are written into the caller's vectors, which keep their capacity
+// from one sample to the next, and the walker reuses its own buffers too. So
+// once the walker has seen the code and the threads of a process, walking it
+// again doesn't allocate any memory.
+class StackWalker {
+ public:
+  virtual ~StackWalker() {}
+
+  // Create a walker for the structure layout of an interpreter version, as in
+  // PyAddrs::version. The filenames of the frames are interned in strings.
+  // Throws FatalException if the version isn't supported.
+  static std::unique_ptr<StackWalker> Create(MemoryReader *mem,
+                                             uint32_t version,
+                                             StringTable *strings);
 
-// Locate _PyThreadState_Current
-unsigned long ThreadStateAddr(pid_t pid);
+  // Get the stack of the thread holding the GIL, given the address of
+  // _PyThreadState_Current. The stack will be in reverse order (most recent
+  // frame first). If no thread holds the GIL, which is what an idle
+  // interpreter looks like, the stack is just the <idle>:gil-released label,
+  // and this returns false.
+  virtual bool GetStack(unsigned long addr, std::vector<Frame> *stack) = 0;
 
-// Get the stack. The stack will be in reverse order (most recent frame first).
-std::vector<Frame> GetStack(pid_t pid, unsigned long addr);
+  // Get the stacks of every thread of every interpreter. Threads that aren't
+  // running Python code have an empty stack.
+  virtual void GetThreads(const PyAddrs &addrs,
+                          std::vector<Thread> *threads) = 0;
+
+  inline size_t cached_code() const { return code_.size(); }
+
+  // The number of frames returned so far, and how many of them were reused
+  // from the previous stack of the same thread rather than read again.
+  inline size_t frames() const { return frames_; }
+  inline size_t reused_frames() const { return reused_frames_; }
+
+ protected:
+  StackWalker(MemoryReader *mem, StringTable *strings)
+      : mem_(mem),
+        strings_(strings),
+        released_{strings->Intern(kIdleLabel), strings->Intern("gil-released"),
+                  kLabelLine, kLabelLine},
+        frames_(0),
+        reused_frames_(0),
+        walks_(0) {}
+
+  struct ChainEntry {
+    unsigned long addr;
+    unsigned long f_back;
+    unsigned long f_code;
+    Frame frame;
+  };
+
+  // The previous stack of a thread, outermost frame first, and an index of the
+  // frame addresses in it. The index is a direct-mapped hash table of positions
+  // in entries, which only grows with the stack. Its slots can be stale, or
+  // lose a frame to a collision, so hits are checked against the entries, and
+  // a miss just means that fewer frames are reused.
+  struct Chain {
+    std::vector<ChainEntry> entries;
+    std::vector<uint32_t> index;
+    uint64_t walk = 0;  // the value of walks_ when the stack was last read
+  };
+
+  // Find a frame in a chain. Returns entries.size() if it isn't there.
+  static size_t Find(const Chain &chain, unsigned long addr);
+
+  // Add entry pos of a chain to its index
+  static void Index(Chain *chain, size_t pos);
+
+  MemoryReader *mem_;
+  StringTable *strings_;
+  Frame released_;  // the label of samples where no thread holds the GIL
+  std::unordered_map<unsigned long, CodeInfo> code_;
+  std::unordered_map<unsigned long, Chain> chains_;  // by thread state
+  size_t frames_;
+  size_t reused_frames_;
+  uint64_t walks_;  // how many times GetThreads has been called
+};
 }  // namespace pystack
@@ -0,0 +1,302 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pystack {
+
+// How a code object maps bytecode offsets to line numbers
+enum class LineTable {
+  kLnotab,        // co_lnotab: (offset increment, line increment) byte pairs
+  kSignedLnotab,  // co_lnotab, with signed line increments (3.6 and later)
+  kLinetable,     // co_linetable (3.10): f_lasti counts instructions, and each
+                  // (length, line increment) pair is a range of bytecode
+};
+
+// Every object starts with its refcount and then ob_type, and every variable
+// size object has ob_size next, so those are the same in every version. The
+// length of a Python 3 str is in the same place as ob_size.
+const size_t kObjectType = 8;
+const size_t kVarObjectSize = 16;
+
+// The layouts of the interpreter's structs, one per supported version: the
+// offsets of the fields that pystack reads, in bytes. They were taken from the
+// headers of each version, as built for x86-64 Linux. The stack walker is a
+// template on these, so each version gets its own walker with the offsets
+// built in, and none of this needs the Python headers.
+struct Py27 {
+  static constexpr uint32_t kVersion = 0x0207;
+  static constexpr LineTable kLineTable = LineTable::kLnotab;
+
+  // The globals are variables of their own, rather than in _PyRuntime
+  static constexpr bool kRuntime = false;
+  static constexpr size_t kRuntimeThreadState = 0;
+  static constexpr size_t kRuntimeInterpHead = 0;
+
+  // PyFrameObject
+  static constexpr size_t kFrameBack = 24;
+  static constexpr size_t kFrameCode = 32;
+  static constexpr size_t kFrameTrace = 80;
+  static constexpr size_t kFrameLasti = 120;
+  static constexpr size_t kFrameLineno = 124;
+
+  // PyCodeObject
+  static constexpr size_t kCodeFirstLine = 96;
+  static constexpr size_t kCodeFilename = 80;
+  static constexpr size_t kCodeName = 88;
+  static constexpr size_t kCodeLineTable = 104;
+
+  // PyThreadState
+  static constexpr size_t kThreadNext = 0;
+  static constexpr size_t kThreadInterp = 8;
+  static constexpr size_t kThreadFrame = 16;
+  static constexpr size_t kThreadId = 144;
+
+  // PyInterpreterState
+  static constexpr size_t kInterpNext = 0;
+  static constexpr size_t kInterpThreads = 8;
+
+  // Where the characters start in a bytes object, and in a str, which is the
+  // same thing in 2.7
+  static constexpr size_t kBytesData = 36;
+  static constexpr bool kUnicodeStr = false;
+  static constexpr size_t kStrState = 0;
+  static constexpr size_t kStrData = 36;
+  static constexpr size_t kCompactStrData = 36;
+};
+
+struct Py36 {
+  static constexpr uint32_t kVersion = 0x0306;
+  static constexpr LineTable kLineTable = LineTable::kSignedLnotab;
+
+  // The globals are variables of their own, rather than in _PyRuntime
+  static constexpr bool kRuntime = false;
+  static constexpr size_t kRuntimeThreadState = 0;
+  static constexpr size_t kRuntimeInterpHead = 0;
+
+  // PyFrameObject
+  static constexpr size_t kFrameBack = 24;
+  static constexpr size_t kFrameCode = 32;
+  static constexpr size_t kFrameTrace = 80;
+  static constexpr size_t kFrameLasti = 120;
+  static constexpr size_t kFrameLineno = 124;
+
+  // PyCodeObject
+  static constexpr size_t kCodeFirstLine = 36;
+  static constexpr size_t kCodeFilename = 96;
+  static constexpr size_t kCodeName = 104;
+  static constexpr size_t kCodeLineTable = 112;
+
+  // PyThreadState
+  static constexpr size_t kThreadNext = 8;
+  static constexpr size_t kThreadInterp = 16;
+  static constexpr size_t kThreadFrame = 24;
+  static constexpr size_t kThreadId = 152;
+
+  // PyInterpreterState
+  static constexpr size_t kInterpNext = 0;
+  static constexpr size_t kInterpThreads = 8;
+
+  // Where the characters start in a bytes object
+  static constexpr size_t kBytesData = 32;
+
+  // PyASCIIObject and PyCompactUnicodeObject. The characters of an ASCII str
+  // start at kStrData and the others' at kCompactStrData, except for the rare
+  // strings that aren't compact, which have a pointer to them there instead.
+  static constexpr bool kUnicodeStr = true;
+  static constexpr size_t kStrState = 32;
+  static constexpr size_t kStrData = 48;
+  static constexpr size_t kCompactStrData = 72;
+};
+
+struct Py37 {
+  static constexpr uint32_t kVersion = 0x0307;
+  static constexpr LineTable kLineTable = LineTable::kSignedLnotab;
+
+  // Where the globals are in _PyRuntime
+  static constexpr bool kRuntime = true;
+  static constexpr size_t kRuntimeThreadState = 1480;
+  static constexpr size_t kRuntimeInterpHead = 24;
+
+  // PyFrameObject
+  static constexpr size_t kFrameBack = 24;
+  static constexpr size_t kFrameCode = 32;
+  static constexpr size_t kFrameTrace = 80;
+  static constexpr size_t kFrameLasti = 104;
+  static constexpr size_t kFrameLineno = 108;
+
+  // PyCodeObject
+  static constexpr size_t kCodeFirstLine = 36;
+  static constexpr size_t kCodeFilename = 96;
+  static constexpr size_t kCodeName = 104;
+  static constexpr size_t kCodeLineTable = 112;
+
+  // PyThreadState
+  static constexpr size_t kThreadNext = 8;
+  static constexpr size_t kThreadInterp = 16;
+  static constexpr size_t kThreadFrame = 24;
+  static constexpr size_t kThreadId = 176;
+
+  // PyInterpreterState
+  static constexpr size_t kInterpNext = 0;
+  static constexpr size_t kInterpThreads = 8;
+
+  // Where the characters start in a bytes object
+  static constexpr size_t kBytesData = 32;
+
+  // PyASCIIObject and PyCompactUnicodeObject. The characters of an ASCII str
+  // start at kStrData and the others' at kCompactStrData, except for the rare
+  // strings that aren't compact, which have a pointer to them there instead.
+  static constexpr bool kUnicodeStr = true;
+  static constexpr size_t kStrState = 32;
+  static constexpr size_t kStrData = 48;
+  static constexpr size_t kCompactStrData = 72;
+};
+
+struct Py38 {
+  static constexpr uint32_t kVersion = 0x0308;
+  static constexpr LineTable kLineTable = LineTable::kSignedLnotab;
+
+  // Where the globals are in _PyRuntime
+  static constexpr bool kRuntime = true;
+  static constexpr size_t kRuntimeThreadState = 1368;
+  static constexpr size_t kRuntimeInterpHead = 32;
+
+  // PyFrameObject
+  static constexpr size_t kFrameBack = 24;
+  static constexpr size_t kFrameCode = 32;
+  static constexpr size_t kFrameTrace = 80;
+  static constexpr size_t kFrameLasti = 104;
+  static constexpr size_t kFrameLineno = 108;
+
+  // PyCodeObject
+  static constexpr size_t kCodeFirstLine = 40;
+  static constexpr size_t kCodeFilename = 104;
+  static constexpr size_t kCodeName = 112;
+  static constexpr size_t kCodeLineTable = 120;
+
+  // PyThreadState
+  static constexpr size_t kThreadNext = 8;
+  static constexpr size_t kThreadInterp = 16;
+  static constexpr size_t kThreadFrame = 24;
+  static constexpr size_t kThreadId = 176;
+
+  // PyInterpreterState
+  static constexpr size_t kInterpNext = 0;
+  static constexpr size_t kInterpThreads = 8;
+
+  // Where the characters start in a bytes object
+  static constexpr size_t kBytesData = 32;
+
+  // PyASCIIObject and PyCompactUnicodeObject. The characters of an ASCII str
+  // start at kStrData and the others' at kCompactStrData, except for the rare
+  // strings that aren't compact, which have a pointer to them there instead.
+  static constexpr bool kUnicodeStr = true;
+  static constexpr size_t kStrState = 32;
+  static constexpr size_t kStrData = 48;
+  static constexpr size_t kCompactStrData = 72;
+};
+
+struct Py39 {
+  static constexpr uint32_t kVersion = 0x0309;
+  static constexpr LineTable kLineTable = LineTable::kSignedLnotab;
+
+  // Where the globals are in _PyRuntime
+  static constexpr bool kRuntime = true;
+  static constexpr size_t kRuntimeThreadState = 568;
+  static constexpr size_t kRuntimeInterpHead = 32;
+
+  // PyFrameObject
+  static constexpr size_t kFrameBack = 24;
+  static constexpr size_t kFrameCode = 32;
+  static constexpr size_t kFrameTrace = 80;
+  static constexpr size_t kFrameLasti = 104;
+  static constexpr size_t kFrameLineno = 108;
+
+  // PyCodeObject
+  static constexpr size_t kCodeFirstLine = 40;
+  static constexpr size_t kCodeFilename = 104;
+  static constexpr size_t kCodeName = 112;
+  static constexpr size_t kCodeLineTable = 120;
+
+  // PyThreadState
+  static constexpr size_t kThreadNext = 8;
+  static constexpr size_t kThreadInterp = 16;
+  static constexpr size_t kThreadFrame = 24;
+  static constexpr size_t kThreadId = 176;
+
+  // PyInterpreterState
+  static constexpr size_t kInterpNext = 0;
+  static constexpr size_t kInterpThreads = 8;
+
+  // Where the characters start in a bytes object
+  static constexpr size_t kBytesData = 32;
+
+  // PyASCIIObject and PyCompactUnicodeObject. The characters of an ASCII str
+  // start at kStrData and the others' at kCompactStrData, except for the rare
+  // strings that aren't compact, which have a pointer to them there instead.
+  static constexpr bool kUnicodeStr = true;
+  static constexpr size_t kStrState = 32;
+  static constexpr size_t kStrData = 48;
+  static constexpr size_t kCompactStrData = 72;
+};
+
+struct Py310 {
+  static constexpr uint32_t kVersion = 0x030a;
+  static constexpr LineTable kLineTable = LineTable::kLinetable;
+
+  // Where the globals are in _PyRuntime
+  static constexpr bool kRuntime = true;
+  static constexpr size_t kRuntimeThreadState = 568;
+  static constexpr size_t kRuntimeInterpHead = 32;
+
+  // PyFrameObject
+  static constexpr size_t kFrameBack = 24;
+  static constexpr size_t kFrameCode = 32;
+  static constexpr size_t kFrameTrace = 72;
+  static constexpr size_t kFrameLasti = 96;
+  static constexpr size_t kFrameLineno = 100;
+
+  // PyCodeObject
+  static constexpr size_t kCodeFirstLine = 40;
+  static constexpr size_t kCodeFilename = 104;
+  static constexpr size_t kCodeName = 112;
+  static constexpr size_t kCodeLineTable = 120;
+
+  // PyThreadState
+  static constexpr size_t kThreadNext = 8;
+  static constexpr size_t kThreadInterp = 16;
+  static constexpr size_t kThreadFrame = 24;
+  static constexpr size_t kThreadId = 176;
+
+  // PyInterpreterState
+  static constexpr size_t kInterpNext = 0;
+  static constexpr size_t kInterpThreads = 8;
+
+  // Where the characters start in a bytes object
+  static constexpr size_t kBytesData = 32;
+
+  // PyASCIIObject and PyCompactUnicodeObject. The characters of an ASCII str
+  // start at kStrData and the others' at kCompactStrData, except for the rare
+  // strings that aren't compact, which have a pointer to them there instead.
+  static constexpr bool kUnicodeStr = true;
+  static constexpr size_t kStrState = 32;
+  static constexpr size_t kStrData = 48;
+  static constexpr size_t kCompactStrData = 72;
+};
+}  // namespace pystack
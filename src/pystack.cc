@@ -15,42 +15,193 @@
 
 #include <getopt.h>
 
-#include <chrono>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <set>
+#include <string>
 #include <thread>
+#include <vector>
 
+#include "./aggregate.h"
 #include "./config.h"
+#include "./core.h"
 #include "./exc.h"
+#include "./proc.h"
 #include "./ptrace.h"
 #include "./pyframe.h"
+#include "./record.h"
+#include "./sampler.h"
+#include "./snapshot.h"
+#include "./stats.h"
+#include "./ticker.h"
+#include "./unwind.h"
 
 using namespace pystack;
 
 namespace {
-const char usage_str[] = "Usage: pystack [-h|--help] [-j|--json] PID\n";
+const char usage_str[] =
+    "Usage: pystack [-h|--help] [-r|--rate RATE] [-s|--seconds SECONDS] "
+    "[-t|--threads] [--mode=gil|wall|cpu] [-f|--folded] [--record FILE] "
+    "[--nonblocking] [--native] [--stats[=json]] [-j|--jobs JOBS] [--children] "
+    "[--no-cache] [--snapshot FILE] PID...\n"
+    "       pystack [-t|--threads] [-f|--folded] [--record FILE] "
+    "--replay FILE\n"
+    "       pystack [-t|--threads] [-f|--folded] [--record FILE] [--native] "
+    "--core CORE [--exe EXE]\n";
 
-void RunOnce(pid_t pid, unsigned long addr) {
-  std::vector<Frame> stack = GetStack(pid, addr);
+// The default number of sampling threads, if there are enough CPUs.
+const size_t kDefaultJobs = 4;
+
+// How often to look for new children with --children, in nanoseconds.
+const uint64_t kRescanInterval = 1000000000;
+
+uint64_t MonotonicMicros() { return MonotonicNanos() / 1000; }
+
+void PrintStack(const std::vector<Frame> &stack, const StringTable &strings) {
   for (auto it = stack.rbegin(); it != stack.rend(); it++) {
-    std::cout << *it << "\n";
+    WriteFrame(std::cout, strings, *it);
+    std::cout << "\n";
+  }
+}
+
+// Attach to the children of the parents that we haven't tried yet. Children
+// that can't be sampled (e.g. they aren't Python) are skipped and not tried
+// again.
+void AddChildren(Sampler *sampler, const std::vector<pid_t> &parents,
+                 std::set<pid_t> *known) {
+  std::set<pid_t> children;
+  for (pid_t parent : parents) {
+    for (pid_t pid : ListChildren(parent)) {
+      children.insert(pid);
+      if (known->count(pid)) {
+        continue;
+      }
+      try {
+        sampler->Add(pid);
+      } catch (const std::exception &exc) {
+        std::cerr << "Skipping PID " << pid << ": " << exc.what() << std::endl;
+      }
+    }
+  }
+  // forget the children that exited, in case their PIDs are reused
+  *known = std::move(children);
+}
+
+// Get the stacks of every thread, or just of the thread that holds the GIL.
+std::vector<Thread> Walk(StackWalker *walker, const PyAddrs &addrs,
+                         bool all_threads) {
+  // snapshots always have every thread, so that they can be replayed either way
+  std::vector<Thread> threads;
+  walker->GetThreads(addrs, &threads);
+  if (!all_threads) {
+    threads.resize(1);
+    threads[0].id = 0;
+    threads[0].gil = walker->GetStack(addrs.thread_state, &threads[0].stack);
+  }
+  return threads;
+}
+
+// Take one sample of a process, and write the memory that it read to a
+// snapshot file.
+std::vector<Thread> TakeSnapshot(pid_t pid, bool all_threads,
+                                 const SymbolCache *cache,
+                                 StringTable *strings,
+                                 const std::string &path) {
+  SeizedProcess proc(pid);
+  MemoryMap maps(pid);
+  const PyAddrs addrs = LocatePython(pid, maps, cache);
+  RemoteMemory remote(pid, true, &maps);
+  RecordingMemory mem(&remote);
+  std::unique_ptr<StackWalker> walker =
+      StackWalker::Create(&mem, addrs.version, strings);
+  std::vector<Thread> threads;
+  proc.Interrupt();
+  try {
+    threads = Walk(walker.get(), addrs, all_threads);
+  } catch (...) {
+    proc.Cont();
+    throw;
   }
-  std::cout << std::flush;
+  proc.Cont();
+  mem.Write(path, pid, addrs);
+  return threads;
+}
+
+// Get the native stacks of the threads in a core file, with their Python
+// frames merged in.
+std::vector<Thread> WalkNative(StackWalker *walker, CoreFile *core,
+                               const PyAddrs &addrs, bool all_threads,
+                               StringTable *strings) {
+  // the native stacks are found by thread id, which every thread has
+  std::vector<Thread> threads = Walk(walker, addrs, true);
+  if (!all_threads) {
+    auto gil = std::find_if(threads.begin(), threads.end(),
+                            [](const Thread &t) { return t.gil; });
+    if (gil == threads.end()) {
+      // there's nothing to unwind, and the sample is just the idle label
+      return Walk(walker, addrs, false);
+    }
+    threads = {*gil};
+  }
+  NativeModules modules(strings);
+  NativeUnwinder unwinder(core, &core->maps(), &modules, strings);
+  const std::vector<NativeRegs> regs = core->Registers();
+  for (auto &thread : threads) {
+    for (const auto &r : regs) {
+      if (r.tp == thread.id) {
+        unwinder.Merge(r, &thread.stack);
+        break;
+      }
+    }
+  }
+  return threads;
 }
 }  // namespace
 
 int main(int argc, char **argv) {
   double seconds = 0;
   double sample_rate = 0.01;
+  int all_threads = 0;
+  int folded = 0;
+  std::string record;
+  std::string snapshot;
+  std::string replay;
+  std::string core;
+  std::string exe;
+  std::string mode_name;
+  int nonblocking = 0;
+  int native = 0;
+  int print_stats = 0;
+  bool stats_json = false;
+  int children = 0;
+  int no_cache = 0;
+  size_t jobs = 0;
   for (;;) {
     static struct option long_options[] = {
+        {"children", no_argument, &children, 1},
+        {"core", required_argument, 0, 'C'},
+        {"exe", required_argument, 0, 'E'},
+        {"folded", no_argument, 0, 'f'},
         {"help", no_argument, 0, 'h'},
+        {"jobs", required_argument, 0, 'j'},
+        {"mode", required_argument, 0, 'M'},
+        {"native", no_argument, &native, 1},
+        {"no-cache", no_argument, &no_cache, 1},
+        {"nonblocking", no_argument, &nonblocking, 1},
         {"rate", required_argument, 0, 'r'},
+        {"record", required_argument, 0, 'R'},
+        {"replay", required_argument, 0, 'P'},
         {"seconds", required_argument, 0, 's'},
+        {"snapshot", required_argument, 0, 'N'},
+        {"stats", optional_argument, 0, 'S'},
+        {"threads", no_argument, 0, 't'},
         {"version", no_argument, 0, 'v'},
         {0, 0, 0, 0}};
     int option_index = 0;
-    int c = getopt_long(argc, argv, "hjr:s:v", long_options, &option_index);
+    int c = getopt_long(argc, argv, "fhj:r:s:tv", long_options, &option_index);
     if (c == -1) {
       break;
     }
@@ -61,16 +212,53 @@ int main(int argc, char **argv) {
           break;
         }
         break;
+      case 'f':
+        folded = 1;
+        break;
       case 'h':
         std::cout << usage_str;
         return 0;
         break;
+      case 'j':
+        jobs = std::stoul(optarg);
+        break;
       case 'r':
         sample_rate = std::stod(optarg);
         break;
+      case 'R':
+        record = optarg;
+        break;
+      case 'M':
+        mode_name = optarg;
+        break;
+      case 'P':
+        replay = optarg;
+        break;
+      case 'C':
+        core = optarg;
+        break;
+      case 'E':
+        exe = optarg;
+        break;
+      case 'N':
+        snapshot = optarg;
+        break;
+      case 'S':
+        print_stats = 1;
+        if (optarg != nullptr) {
+          if (strcmp(optarg, "json") != 0) {
+            std::cerr << "Unknown stats format: " << optarg << "\n";
+            return 1;
+          }
+          stats_json = true;
+        }
+        break;
       case 's':
         seconds = std::stod(optarg);
         break;
+      case 't':
+        all_threads = 1;
+        break;
       case 'v':
         std::cout << PACKAGE_STRING << "\n";
         return 0;
@@ -82,43 +270,172 @@ int main(int argc, char **argv) {
         abort();
     }
   }
-  if (optind != argc - 1) {
+  if ((optind == argc) == (replay.empty() && core.empty())) {
     std::cerr << usage_str;
     return 1;
   }
-  long pid = std::strtol(argv[argc - 1], nullptr, 10);
-  if (pid > std::numeric_limits<pid_t>::max() ||
-      pid < std::numeric_limits<pid_t>::min()) {
-    std::cerr << "PID " << pid << " is out of valid PID range.\n";
+  std::vector<pid_t> pids;
+  for (int i = optind; i < argc; i++) {
+    long pid = std::strtol(argv[i], nullptr, 10);
+    if (pid > std::numeric_limits<pid_t>::max() ||
+        pid < std::numeric_limits<pid_t>::min()) {
+      std::cerr << "PID " << pid << " is out of valid PID range.\n";
+      return 1;
+    }
+    pids.push_back(pid);
+  }
+  // -t is wall mode, unless the mode is one that samples every thread anyway
+  SampleMode mode = all_threads ? SampleMode::kWall : SampleMode::kGil;
+  if (mode_name == "gil") {
+    if (all_threads) {
+      std::cerr << "--threads samples every thread, so it can't be used with "
+                   "--mode=gil.\n";
+      return 1;
+    }
+  } else if (mode_name == "wall") {
+    mode = SampleMode::kWall;
+  } else if (mode_name == "cpu") {
+    mode = SampleMode::kCpu;
+  } else if (!mode_name.empty()) {
+    std::cerr << "Unknown mode: " << mode_name << "\n";
+    return 1;
+  }
+  all_threads = mode != SampleMode::kGil;
+  if (mode == SampleMode::kCpu &&
+      (seconds == 0 || !snapshot.empty() || !replay.empty() || !core.empty())) {
+    std::cerr << "--mode=cpu measures the CPU time used between samples of a "
+                 "running process, so it needs --seconds, and can't be used "
+                 "with --snapshot, --replay or --core.\n";
     return 1;
   }
+  if (native && (nonblocking || !snapshot.empty() || !replay.empty())) {
+    std::cerr << "--native needs the registers of stopped threads, so it "
+                 "can't be used with --nonblocking, --snapshot or --replay.\n";
+    return 1;
+  }
+  // Label the samples with their PID unless there's only one process
+  const bool many = children || pids.size() > 1;
+  if (jobs == 0) {
+    jobs = std::min<size_t>(kDefaultJobs, std::thread::hardware_concurrency());
+  }
+
+  Stats stats;
+  std::unique_ptr<Ticker> ticker;
+  // the frames' names, shared by every walker of the session
+  StringTable strings;
+  CallTree tree(&strings);
+  int status = 0;
   try {
-    PtraceAttach(pid);
-    const unsigned long addr = ThreadStateAddr(pid);
-    const std::chrono::microseconds interval{
-        static_cast<long>(sample_rate * 1000000)};
-    if (seconds) {
-      auto end =
-          std::chrono::system_clock::now() +
-          std::chrono::microseconds(static_cast<long>(seconds * 1000000));
-      for (;;) {
-        try {
-          RunOnce(pid, addr);
-        } catch (const NonFatalException &exc) {
-          // continue if we get a non-fatal exception
-          std::cerr << exc.what() << std::endl;
+    std::unique_ptr<Recorder> recorder;
+    if (!record.empty()) {
+      recorder.reset(new Recorder(record, &strings));
+      recorder->Begin(pids.empty() ? 0 : pids[0], MonotonicMicros());
+    }
+    bool first = true;  // the first process of this tick
+    auto callback = [&](uint64_t timestamp, pid_t pid,
+                        const std::vector<Thread> &threads) {
+      for (const auto &thread : threads) {
+        if (thread.weight == 0) {
+          continue;
         }
-        auto now = std::chrono::system_clock::now();
-        if (now + interval >= end) {
-          break;
+        if (folded) {
+          tree.Add(thread.stack, thread.weight);
+        }
+        if (recorder) {
+          recorder->Add(timestamp, pid, thread.id, thread.stack, thread.weight);
+        }
+      }
+      if (folded || recorder) {
+        return;
+      }
+      if (many) {
+        std::cout << (first ? "" : "\n") << "Process " << pid << "\n";
+      }
+      first = false;
+      bool first_thread = true;
+      for (const auto &thread : threads) {
+        if (thread.weight == 0) {
+          continue;
+        }
+        if (all_threads) {
+          std::cout << (first_thread ? "" : "\n") << "Thread " << thread.id
+                    << (thread.gil ? " (holds the GIL)" : "") << "\n";
         }
-        PtraceDetach(pid);
-        std::this_thread::sleep_for(interval);
-        std::cout << "\n";
-        PtraceAttach(pid);
+        first_thread = false;
+        PrintStack(thread.stack, strings);
       }
+      std::cout << std::flush;
+    };
+
+    std::unique_ptr<SymbolCache> cache;
+    if (!no_cache) {
+      cache.reset(new SymbolCache(SymbolCache::DefaultDir()));
+    }
+    if (!replay.empty()) {
+      SnapshotMemory mem(replay);
+      std::unique_ptr<StackWalker> walker =
+          StackWalker::Create(&mem, mem.addrs().version, &strings);
+      callback(MonotonicMicros(), mem.pid(),
+               Walk(walker.get(), mem.addrs(), all_threads));
+    } else if (!core.empty()) {
+      CoreFile mem(core);
+      const std::string mapped_exe = mem.Executable();
+      const PyAddrs addrs = LocatePython(exe.empty() ? mapped_exe : exe,
+                                         mapped_exe, mem.maps(), cache.get());
+      std::unique_ptr<StackWalker> walker =
+          StackWalker::Create(&mem, addrs.version, &strings);
+      callback(MonotonicMicros(), mem.pid(),
+               native ? WalkNative(walker.get(), &mem, addrs, all_threads,
+                                   &strings)
+                      : Walk(walker.get(), addrs, all_threads));
+    } else if (!snapshot.empty()) {
+      callback(MonotonicMicros(), pids[0],
+               TakeSnapshot(pids[0], all_threads, cache.get(), &strings,
+                            snapshot));
     } else {
-      RunOnce(pid, addr);
+      // Stay attached for the whole session, and only stop the processes while
+      // a sample is being taken.
+      Sampler sampler(jobs, mode, nonblocking, native, seconds > 0,
+                      cache.get(), &strings, callback);
+      std::set<pid_t> known;
+      if (children) {
+        AddChildren(&sampler, pids, &known);
+      } else {
+        for (pid_t pid : pids) {
+          sampler.Add(pid);
+        }
+      }
+      if (seconds) {
+        ticker.reset(
+            new Ticker(static_cast<uint64_t>(sample_rate * 1000000000)));
+        const uint64_t end =
+            MonotonicNanos() + static_cast<uint64_t>(seconds * 1000000000);
+        uint64_t rescan = MonotonicNanos() + kRescanInterval;
+        for (;;) {
+          first = true;
+          sampler.Tick(MonotonicMicros());
+          if (!children && sampler.size() == 0) {
+            break;
+          }
+          if (!ticker->Advance(end)) {
+            break;
+          }
+          ticker->Sleep();
+          if (children && MonotonicNanos() >= rescan) {
+            AddChildren(&sampler, pids, &known);
+            rescan = MonotonicNanos() + kRescanInterval;
+          }
+          if (!folded && !recorder) {
+            std::cout << "\n";
+          }
+        }
+      } else {
+        sampler.Tick(MonotonicMicros());
+      }
+      stats = sampler.stats();
+      if (!children && sampler.failures()) {
+        status = 1;
+      }
     }
   } catch (const FatalException &exc) {
     std::cerr << exc.what() << std::endl;
@@ -130,5 +447,19 @@ int main(int argc, char **argv) {
     std::cerr << exc.what() << std::endl;
     return 1;
   }
-  return 0;
+  if (folded) {
+    tree.WriteFolded(std::cout);
+  }
+  if (stats.unclassified && !print_stats) {
+    std::cerr << stats.unclassified << " thread samples weren't classified, "
+              << "because their kernel thread ids couldn't be found\n";
+  }
+  if (print_stats) {
+    if (stats_json) {
+      WriteStatsJson(std::cerr, stats, ticker.get());
+    } else {
+      WriteStats(std::cerr, stats, ticker.get());
+    }
+  }
+  return status;
 }
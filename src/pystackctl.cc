@@ -0,0 +1,98 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+// pystackctl sends a request to pystackd, and prints the response.
+
+#include <getopt.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include "./config.h"
+#include "./exc.h"
+#include "./socket.h"
+
+using namespace pystack;
+
+namespace {
+const char usage_str[] =
+    "Usage: pystackctl [-h|--help] [--socket PATH] COMMAND [ARG...]\n"
+    "Run \"pystackctl help\" for the commands.\n";
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string path = DefaultSocketPath();
+  for (;;) {
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"socket", required_argument, 0, 'S'},
+        {"version", no_argument, 0, 'v'},
+        {0, 0, 0, 0}};
+    int option_index = 0;
+    // stop at the command, so that its arguments aren't taken as options
+    int c = getopt_long(argc, argv, "+hv", long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+    switch (c) {
+      case 'h':
+        std::cout << usage_str;
+        return 0;
+      case 'S':
+        path = optarg;
+        break;
+      case 'v':
+        std::cout << PACKAGE_STRING << "\n";
+        return 0;
+      default:
+        std::cerr << usage_str;
+        return 1;
+    }
+  }
+  if (optind == argc) {
+    std::cerr << usage_str;
+    return 1;
+  }
+  std::string request;
+  for (int i = optind; i < argc; i++) {
+    request += (i == optind ? "" : " ") + std::string(argv[i]);
+  }
+  request += "\n";
+
+  std::string response;
+  try {
+    const int fd = ConnectUnix(path);
+    WriteAll(fd, request);
+    shutdown(fd, SHUT_WR);
+    response = ReadUntil(fd, std::numeric_limits<size_t>::max(), false);
+    close(fd);
+  } catch (const FatalException &exc) {
+    std::cerr << exc.what() << std::endl;
+    return 1;
+  }
+  if (response.compare(0, 3, "OK\n") == 0) {
+    std::cout << response.substr(3);
+    return 0;
+  }
+  const std::string error = "ERROR ";
+  std::cerr << (response.compare(0, error.size(), error) == 0
+                    ? response.substr(error.size())
+                    : "Bad response from pystackd\n");
+  return 1;
+}
@@ -0,0 +1,123 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+// pystackd stays attached to a set of Python processes, and answers requests
+// for their stacks and profiles over a UNIX socket; see pystackctl. It runs in
+// the foreground, so that a service manager can look after it.
+
+#include <getopt.h>
+#include <signal.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include "./config.h"
+#include "./daemon.h"
+#include "./exc.h"
+#include "./socket.h"
+#include "./symcache.h"
+
+using namespace pystack;
+
+namespace {
+const char usage_str[] =
+    "Usage: pystackd [-h|--help] [--socket PATH] [--mode=gil|wall|cpu] "
+    "[--native] [--no-cache] [PID...]\n";
+
+volatile sig_atomic_t stop = 0;
+
+void HandleSignal(int) { stop = 1; }
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string path = DefaultSocketPath();
+  std::string mode = "wall";
+  int native = 0;
+  int no_cache = 0;
+  for (;;) {
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"mode", required_argument, 0, 'M'},
+        {"native", no_argument, &native, 1},
+        {"no-cache", no_argument, &no_cache, 1},
+        {"socket", required_argument, 0, 'S'},
+        {"version", no_argument, 0, 'v'},
+        {0, 0, 0, 0}};
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "hv", long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+    switch (c) {
+      case 0:
+        break;
+      case 'h':
+        std::cout << usage_str;
+        return 0;
+      case 'M':
+        mode = optarg;
+        break;
+      case 'S':
+        path = optarg;
+        break;
+      case 'v':
+        std::cout << PACKAGE_STRING << "\n";
+        return 0;
+      case '?':
+        std::cerr << usage_str;
+        return 1;
+      default:
+        abort();
+    }
+  }
+
+  // Without SA_RESTART, a signal interrupts waiting for a connection
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = HandleSignal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  try {
+    std::unique_ptr<SymbolCache> cache;
+    if (!no_cache) {
+      cache.reset(new SymbolCache(SymbolCache::DefaultDir()));
+    }
+    Daemon daemon(path, cache.get());
+    for (int i = optind; i < argc; i++) {
+      // the same as a client's add request
+      std::string request = std::string("add ") + argv[i] + " " + mode;
+      if (native) {
+        request += " native";
+      }
+      const std::string response = daemon.Handle(request);
+      if (response.compare(0, 3, "OK\n") != 0) {
+        std::cerr << response.substr(strlen("ERROR "));
+        return 1;
+      }
+    }
+    std::cerr << "Listening on " << path << std::endl;
+    daemon.Serve(&stop);
+  } catch (const std::exception &exc) {
+    std::cerr << exc.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -15,32 +15,106 @@
 
 #include "./pystring.h"
 
-#include <cstddef>
-#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 
-#include <Python.h>
+namespace pystack {
+namespace {
+// For each kind, the bits of a word of characters that are only set if some
+// of them aren't ASCII.
+const uint64_t kNonAscii[] = {0, 0x8080808080808080, 0xff80ff80ff80ff80, 0,
+                              0xffffff80ffffff80};
 
-#include "./config.h"
+const uint32_t kReplacement = 0xfffd;
 
-namespace pystack {
-#if PY_MAJOR_VERSION == 2
-unsigned long StringSize(unsigned long addr) {
-  return addr + offsetof(PyStringObject, ob_size);
+void AppendCodePoint(uint32_t c, std::string *out) {
+  if (c >= 0xdc80 && c <= 0xdcff) {
+    out->push_back(static_cast<char>(c - 0xdc00));
+    return;
+  }
+  if ((c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff) {
+    c = kReplacement;
+  }
+  char buf[4];
+  size_t len;
+  if (c < 0x80) {
+    buf[0] = c;
+    len = 1;
+  } else if (c < 0x800) {
+    buf[0] = 0xc0 | c >> 6;
+    buf[1] = 0x80 | (c & 0x3f);
+    len = 2;
+  } else if (c < 0x10000) {
+    buf[0] = 0xe0 | c >> 12;
+    buf[1] = 0x80 | (c >> 6 & 0x3f);
+    buf[2] = 0x80 | (c & 0x3f);
+    len = 3;
+  } else {
+    buf[0] = 0xf0 | c >> 18;
+    buf[1] = 0x80 | (c >> 12 & 0x3f);
+    buf[2] = 0x80 | (c >> 6 & 0x3f);
+    buf[3] = 0x80 | (c & 0x3f);
+    len = 4;
+  }
+  out->append(buf, len);
 }
 
-unsigned long StringData(unsigned long addr) {
-  return addr + offsetof(PyStringObject, ob_sval);
-}
-#elif PY_MAJOR_VERSION == 3
-unsigned long StringSize(unsigned long addr) {
-  return addr + offsetof(PyVarObject, ob_size);
+// Transcode characters of type T. Nearly all of the characters in file and
+// function names are ASCII, so they're checked a word at a time, and a word of
+// ASCII characters is narrowed to bytes without looking at them one by one.
+// Only the other characters are encoded individually.
+template <typename T>
+void Transcode(const uint8_t *data, size_t length, std::string *out) {
+  const size_t per_word = sizeof(uint64_t) / sizeof(T);
+  const uint64_t mask = kNonAscii[sizeof(T)];
+  size_t i = 0;
+  while (i < length) {
+    for (; i + per_word <= length; i += per_word) {
+      uint64_t word;
+      memcpy(&word, data + i * sizeof(T), sizeof(word));
+      if (word & mask) {
+        break;
+      }
+      if (sizeof(T) == 1) {
+        out->append(reinterpret_cast<const char *>(data + i), per_word);
+      } else {
+        char ascii[sizeof(uint64_t)];
+        for (size_t j = 0; j < per_word; j++) {
+          ascii[j] = static_cast<char>(word >> (j * 8 * sizeof(T)));
+        }
+        out->append(ascii, per_word);
+      }
+    }
+    // the rest of a word that had a non-ASCII character in it, or the tail
+    const size_t end = std::min(i + per_word, length);
+    for (; i < end; i++) {
+      T c;
+      memcpy(&c, data + i * sizeof(T), sizeof(c));
+      if (c < 0x80) {
+        out->push_back(static_cast<char>(c));
+      } else {
+        AppendCodePoint(c, out);
+      }
+    }
+  }
 }
+}  // namespace
 
-unsigned long StringData(unsigned long addr) {
-  // this works only if the filename is all ascii *fingers crossed*
-  return addr + sizeof(PyASCIIObject);
+void AppendUtf8(const void *data, size_t length, size_t kind,
+                std::string *out) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  out->reserve(out->size() + length);
+  switch (kind) {
+    case 1:
+      Transcode<uint8_t>(bytes, length, out);
+      break;
+    case 2:
+      Transcode<uint16_t>(bytes, length, out);
+      break;
+    default:
+      Transcode<uint32_t>(bytes, length, out);
+      break;
+  }
 }
-#else
-static_assert(false, "Unknown Python version.");
-#endif
 }  // namespace pystack
@@ -15,8 +15,18 @@
 
 #pragma once
 
-// This abstracts the string representation for py2/py3
+#include <cstddef>
+#include <string>
+
 namespace pystack {
-unsigned long StringSize(unsigned long addr);
-unsigned long StringData(unsigned long addr);
+
+// Append the characters of a Python 3 str to out as UTF-8. The str has length
+// characters of kind bytes each: 1 for Latin-1, 2 for UCS-2 and 4 for UCS-4.
+//
+// Python decodes file names that aren't valid UTF-8 with the surrogateescape
+// error handler, which turns each undecodable byte into a lone surrogate in
+// U+DC80..U+DCFF, so those are turned back into the bytes of the original name.
+// Other code points that UTF-8 can't encode become U+FFFD.
+void AppendUtf8(const void *data, size_t length, size_t kind,
+                std::string *out);
 }  // namespace pystack
@@ -0,0 +1,346 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./record.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "./exc.h"
+
+namespace pystack {
+namespace {
+const char kBlockMagic[] = "PSK1";
+const size_t kMagicSize = sizeof(kBlockMagic) - 1;
+
+// Write a block once it's this big, or once it's this old
+const size_t kBlockSize = 16 << 10;
+const uint64_t kBlockAge = 1000000;
+
+void ThrowFileError(const char *what, const std::string &path) {
+  std::ostringstream ss;
+  ss << "Failed to " << what << " " << path << ": " << strerror(errno);
+  throw FatalException(ss.str());
+}
+
+void ThrowCorrupt(const char *what) {
+  std::ostringstream ss;
+  ss << "Corrupt recording: " << what;
+  throw FatalException(ss.str());
+}
+}  // namespace
+
+void PutVarint(std::string *out, uint64_t val) {
+  while (val >= 0x80) {
+    out->push_back(static_cast<char>(val | 0x80));
+    val >>= 7;
+  }
+  out->push_back(static_cast<char>(val));
+}
+
+Recorder::Recorder(const std::string &path, const StringTable *strings)
+    : path_(path),
+      strings_(strings),
+      bytes_(0),
+      pid_(0),
+      last_timestamp_(0),
+      last_flush_(0) {
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    ThrowFileError("open", path);
+  }
+}
+
+Recorder::~Recorder() {
+  try {
+    Flush();
+  } catch (const FatalException &exc) {
+    // nothing sensible to do in a destructor
+  }
+  close(fd_);
+}
+
+void Recorder::Begin(pid_t pid, uint64_t timestamp) {
+  Flush();
+  names_.clear();
+  frames_.clear();
+  last_timestamp_ = last_flush_ = timestamp;
+  pid_ = pid;
+
+  const auto now = std::chrono::system_clock::now().time_since_epoch();
+  PutVarint(&block_, kSession);
+  PutVarint(&block_, pid);
+  PutVarint(&block_,
+            std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+}
+
+uint64_t Recorder::InternString(uint32_t str) {
+  auto it = names_.find(str);
+  if (it != names_.end()) {
+    return it->second;
+  }
+  const std::string &bytes = strings_->Get(str);
+  const uint64_t id = names_.size();
+  names_.insert({str, id});
+  PutVarint(&block_, kString);
+  PutVarint(&block_, id);
+  PutVarint(&block_, bytes.size());
+  block_ += bytes;
+  return id;
+}
+
+uint64_t Recorder::InternFrame(const Frame &frame) {
+  auto it = frames_.find(frame);
+  if (it != frames_.end()) {
+    return it->second;
+  }
+  const uint64_t file = InternString(frame.file);
+  const uint64_t name = InternString(frame.name);
+  const uint64_t id = frames_.size();
+  frames_.insert({frame, id});
+  PutVarint(&block_, kFunctionFrame);
+  PutVarint(&block_, id);
+  PutVarint(&block_, file);
+  PutVarint(&block_, name);
+  PutVarint(&block_, frame.first_line);
+  PutVarint(&block_, frame.line);
+  return id;
+}
+
+void Recorder::Add(uint64_t timestamp, pid_t pid, unsigned long thread,
+                   const std::vector<Frame> &stack, uint64_t weight) {
+  if (pid != pid_) {
+    PutVarint(&block_, kProcess);
+    PutVarint(&block_, pid);
+    pid_ = pid;
+  }
+
+  // Frames need to be defined before the sample that uses them
+  ids_.clear();
+  for (const auto &frame : stack) {
+    ids_.push_back(InternFrame(frame));
+  }
+
+  PutVarint(&block_, weight == 1 ? kSample : kWeightedSample);
+  PutVarint(&block_, timestamp - last_timestamp_);
+  PutVarint(&block_, thread);
+  if (weight != 1) {
+    PutVarint(&block_, weight);
+  }
+  PutVarint(&block_, ids_.size());
+  for (uint64_t id : ids_) {
+    PutVarint(&block_, id);
+  }
+  last_timestamp_ = timestamp;
+
+  if (block_.size() >= kBlockSize || timestamp - last_flush_ >= kBlockAge) {
+    Flush();
+    last_flush_ = timestamp;
+  }
+}
+
+void Recorder::Flush() {
+  if (block_.empty()) {
+    return;
+  }
+  // short enough not to allocate
+  std::string header(kBlockMagic, kMagicSize);
+  PutVarint(&header, block_.size());
+
+  // the whole block goes out in one write, so it's either there or it isn't
+  iovec iov[] = {{&header[0], header.size()}, {&block_[0], block_.size()}};
+  iovec *next = iov;
+  int left = 2;
+  while (left > 0) {
+    const ssize_t n = writev(fd_, next, left);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      block_.clear();
+      ThrowFileError("write to", path_);
+    }
+    bytes_ += n;
+    size_t done = n;
+    while (left > 0 && done >= next->iov_len) {
+      done -= next->iov_len;
+      next++;
+      left--;
+    }
+    if (left > 0) {
+      next->iov_base = static_cast<char *>(next->iov_base) + done;
+      next->iov_len -= done;
+    }
+  }
+  block_.clear();
+}
+
+RecordReader::RecordReader(const std::string &path)
+    : block_end_(0),
+      pos_(0),
+      truncated_(false),
+      pid_(0),
+      timestamp_(0),
+      unknown_(table_.Intern("??")) {
+  std::ifstream fp(path, std::ios::binary);
+  if (!fp) {
+    ThrowFileError("open", path);
+  }
+  std::ostringstream ss;
+  ss << fp.rdbuf();
+  data_ = ss.str();
+}
+
+bool RecordReader::NextBlock() {
+  pos_ = block_end_;
+  if (pos_ == data_.size()) {
+    return false;
+  }
+  const size_t left = data_.size() - pos_;
+  if (left < kMagicSize) {
+    // the recorder died while writing the header of the last block
+    if (data_.compare(pos_, left, kBlockMagic, left) != 0) {
+      ThrowCorrupt("bad block header");
+    }
+    truncated_ = true;
+    return false;
+  } else if (data_.compare(pos_, kMagicSize, kBlockMagic) != 0) {
+    ThrowCorrupt("bad block header");
+  }
+  pos_ += kMagicSize;
+  block_end_ = data_.size();  // so that ReadVarint can't run off the end
+  uint64_t len;
+  try {
+    len = ReadVarint();
+  } catch (const FatalException &exc) {
+    truncated_ = true;
+    return false;
+  }
+  if (len > data_.size() - pos_) {
+    truncated_ = true;
+    return false;
+  }
+  block_end_ = pos_ + len;
+  return true;
+}
+
+uint64_t RecordReader::ReadVarint() {
+  uint64_t val = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos_ == block_end_) {
+      ThrowCorrupt("truncated record");
+    }
+    const uint8_t byte = data_[pos_++];
+    val |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return val;
+    }
+  }
+  ThrowCorrupt("varint too long");
+  return 0;
+}
+
+std::string RecordReader::ReadBytes(size_t len) {
+  if (len > block_end_ - pos_) {
+    ThrowCorrupt("truncated string");
+  }
+  std::string out = data_.substr(pos_, len);
+  pos_ += len;
+  return out;
+}
+
+bool RecordReader::Next(RecordedSample *sample) {
+  for (;;) {
+    if (pos_ == block_end_ && !NextBlock()) {
+      return false;
+    }
+    const uint64_t tag = ReadVarint();
+    switch (tag) {
+      case kSession:
+        pid_ = ReadVarint();
+        timestamp_ = ReadVarint();
+        strings_.clear();
+        frames_.clear();
+        break;
+      case kProcess:
+        pid_ = ReadVarint();
+        break;
+      case kString: {
+        if (ReadVarint() != strings_.size()) {
+          ThrowCorrupt("string out of order");
+        }
+        const uint64_t len = ReadVarint();
+        strings_.push_back(table_.Intern(ReadBytes(len)));
+        break;
+      }
+      case kFrame: {
+        if (ReadVarint() != frames_.size()) {
+          ThrowCorrupt("frame out of order");
+        }
+        const uint64_t file = ReadVarint();
+        const uint64_t line = ReadVarint();
+        if (file >= strings_.size()) {
+          ThrowCorrupt("undefined string");
+        }
+        frames_.push_back({strings_[file], unknown_, 0,
+                           static_cast<uint32_t>(line)});
+        break;
+      }
+      case kFunctionFrame: {
+        if (ReadVarint() != frames_.size()) {
+          ThrowCorrupt("frame out of order");
+        }
+        const uint64_t file = ReadVarint();
+        const uint64_t name = ReadVarint();
+        const uint64_t first_line = ReadVarint();
+        const uint64_t line = ReadVarint();
+        if (file >= strings_.size() || name >= strings_.size()) {
+          ThrowCorrupt("undefined string");
+        }
+        frames_.push_back({strings_[file], strings_[name],
+                           static_cast<uint32_t>(first_line),
+                           static_cast<uint32_t>(line)});
+        break;
+      }
+      case kSample:
+      case kWeightedSample: {
+        timestamp_ += ReadVarint();
+        sample->pid = pid_;
+        sample->timestamp = timestamp_;
+        sample->thread = ReadVarint();
+        sample->weight = tag == kWeightedSample ? ReadVarint() : 1;
+        const uint64_t depth = ReadVarint();
+        sample->stack.clear();
+        for (uint64_t i = 0; i < depth; i++) {
+          const uint64_t id = ReadVarint();
+          if (id >= frames_.size()) {
+            ThrowCorrupt("undefined frame");
+          }
+          sample->stack.push_back(frames_[id]);
+        }
+        return true;
+      }
+      default:
+        ThrowCorrupt("unknown record");
+    }
+  }
+}
+}  // namespace pystack
@@ -0,0 +1,146 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./frame.h"
+
+// The recording format is a sequence of blocks, each of which is:
+//
+//   "PSK1" | varint payload length | payload
+//
+// A payload is a sequence of records, each starting with a varint tag. All
+// integers are unsigned LEB128 varints.
+//
+//   kSession  pid, wall clock start time in microseconds since the epoch
+//   kString   string id, length, bytes
+//   kFrame    frame id, file string id, line (written by older versions,
+//             and read as a frame of an unknown function)
+//   kSample   microseconds since the previous sample, thread id, depth,
+//             depth frame ids (most recent frame first)
+//   kProcess  pid of the following samples, when sampling several processes
+//   kFunctionFrame  frame id, file string id, function name string id, first
+//                   line of the function, line
+//   kWeightedSample  like kSample, with the sample's weight after the thread
+//                    id, for samples that don't count for 1
+//
+// A session record starts a new recording and resets the string and frame ids,
+// so recordings can be appended to an existing file. Strings and frames are
+// defined once, before the first sample that uses them. Blocks are written as
+// they fill up, so if the recorder dies only the last block is lost, and a
+// reader stops at the first incomplete block.
+namespace pystack {
+
+enum RecordTag : uint8_t {
+  kSession = 0,
+  kString = 1,
+  kFrame = 2,
+  kSample = 3,
+  kProcess = 4,
+  kFunctionFrame = 5,
+  kWeightedSample = 6,
+};
+
+class Recorder {
+ public:
+  // Open a file for appending. The names in the frames are in strings.
+  Recorder(const std::string &path, const StringTable *strings);
+  ~Recorder();
+
+  Recorder(const Recorder &other) = delete;
+  Recorder &operator=(const Recorder &other) = delete;
+
+  // Start a new session. Timestamps are in microseconds, from a monotonic
+  // clock.
+  void Begin(pid_t pid, uint64_t timestamp);
+
+  // Add a stack, in GetStack order. All the threads of a sample should be
+  // added with the same timestamp, and timestamps must not go backwards.
+  void Add(uint64_t timestamp, pid_t pid, unsigned long thread,
+           const std::vector<Frame> &stack, uint64_t weight = 1);
+
+  // Write out the current block
+  void Flush();
+
+  // Bytes written to the file so far
+  inline uint64_t bytes() const { return bytes_; }
+
+ private:
+  int fd_;
+  std::string path_;
+  const StringTable *strings_;
+  std::string block_;
+  uint64_t bytes_;
+  pid_t pid_;  // of the last sample
+  uint64_t last_timestamp_;
+  uint64_t last_flush_;
+  std::unordered_map<uint32_t, uint64_t> names_;  // by StringTable id
+  std::unordered_map<Frame, uint64_t, FrameHash> frames_;
+  std::vector<uint64_t> ids_;  // of the frames of a sample
+
+  uint64_t InternString(uint32_t str);
+  uint64_t InternFrame(const Frame &frame);
+};
+
+// A sample from a recording. The names in the frames are in the reader's
+// StringTable.
+struct RecordedSample {
+  pid_t pid;
+  uint64_t timestamp;  // microseconds since the epoch
+  unsigned long thread;
+  uint64_t weight;  // as in Thread
+  std::vector<Frame> stack;
+};
+
+class RecordReader {
+ public:
+  explicit RecordReader(const std::string &path);
+
+  // Read the next sample. Returns false at the end of the recording.
+  bool Next(RecordedSample *sample);
+
+  // True if the recording ended with an incomplete block
+  inline bool truncated() const { return truncated_; }
+
+  inline const StringTable &strings() const { return table_; }
+
+ private:
+  std::string data_;
+  size_t block_end_;
+  size_t pos_;
+  bool truncated_;
+
+  pid_t pid_;
+  uint64_t timestamp_;
+  StringTable table_;
+  std::vector<uint32_t> strings_;  // the table's ids of the session's strings
+  std::vector<Frame> frames_;
+  uint32_t unknown_;  // the name of functions in old recordings
+
+  bool NextBlock();
+  uint64_t ReadVarint();
+  std::string ReadBytes(size_t len);
+};
+
+// Helpers for the varint encoding
+void PutVarint(std::string *out, uint64_t val);
+}  // namespace pystack
@@ -0,0 +1,583 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./sampler.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <thread>
+
+#include "./exc.h"
+#include "./ticker.h"
+
+namespace pystack {
+namespace {
+// How many times to retry a sample that changed while we were reading it in
+// non-blocking mode before giving up on it.
+const size_t kMaxRetries = 3;
+
+// How often to look for a libpython that hasn't been loaded yet, in nanoseconds
+const uint64_t kLocateInterval = 1000000000;
+
+// How often a non-blocking target may read its mappings again, to check a read
+// outside of them, in nanoseconds. A stopped process can check once per sample,
+// but a running one can make a walk follow any number of torn pointers.
+const uint64_t kMapsInterval = 100000000;
+
+#if defined(__x86_64__)
+// Where glibc's struct pthread keeps the kernel thread id, on x86-64. A
+// thread's id in Python is its pthread_t, which points to the struct. This is
+// only used in non-blocking mode, where we can't read the thread pointers, and
+// only once it's been checked against /proc/PID/task.
+const unsigned long kPthreadTid = 0x2d0;
+#endif
+
+// Restarts a stopped process when it goes out of scope, and records how long
+// it was stopped for.
+class ContGuard {
+ public:
+  ContGuard(SeizedProcess *proc, Stats *stats, uint64_t start)
+      : proc_(proc), stats_(stats), start_(start) {}
+  ~ContGuard() {
+    if (proc_ == nullptr) {
+      return;
+    }
+    try {
+      proc_->Cont();
+    } catch (const FatalException &exc) {
+      // the next Interrupt() will fail too, and report the error
+    }
+    stats_->stopped.Add(MonotonicNanos() - start_);
+  }
+
+ private:
+  SeizedProcess *proc_;
+  Stats *stats_;
+  uint64_t start_;
+};
+
+SeizedProcess *Seize(pid_t pid, Stats *stats) {
+  ScopedTimer timer(stats, kPhaseAttach);
+  return new SeizedProcess(pid);
+}
+}  // namespace
+
+Target::Target(pid_t pid, SampleMode mode, bool nonblocking, bool wait,
+               const SymbolCache *cache, StringTable *strings,
+               NativeModules *modules)
+    : pid_(pid),
+      mode_(mode),
+      cache_(cache),
+      strings_(strings),
+      wait_(wait),
+      proc_(nonblocking ? nullptr : Seize(pid, &stats_)),
+      maps_(pid),
+      mem_(pid, !nonblocking, &maps_, nonblocking ? kMapsInterval : 0),
+      unwinder_(modules ? new NativeUnwinder(&mem_, &maps_, modules, strings)
+                        : nullptr),
+      sched_(pid),
+      pthread_checked_(false),
+      pthread_tids_(false),
+      idle_(strings->Intern(kIdleLabel)),
+      addrs_{0, 0, 0},
+      located_(false),
+      next_locate_(0),
+      retries_(nonblocking ? kMaxRetries : 0) {
+  if (unwinder_ && nonblocking) {
+    throw FatalException("Native stacks can't be read in non-blocking mode.");
+  }
+  Locate();
+}
+
+bool Target::Locate() {
+  ScopedTimer timer(&stats_, kPhaseElf);
+  try {
+    addrs_ = LocatePython(pid_, maps_, cache_);
+    walker_ = StackWalker::Create(&mem_, addrs_.version, strings_);
+    located_ = true;
+  } catch (const NonFatalException &exc) {
+    if (!wait_) {
+      throw FatalException(exc.what());
+    }
+    next_locate_ = MonotonicNanos() + kLocateInterval;
+  }
+  return located_;
+}
+
+void Target::Poll() {
+  if (proc_) {
+    proc_->Poll();
+  }
+}
+
+bool Target::Sample() {
+  if (!located_) {
+    const uint64_t now = MonotonicNanos();
+    if (now < next_locate_) {
+      return false;
+    }
+    // read the mappings at most once an interval, whether or not they changed
+    next_locate_ = now + kLocateInterval;
+    if (!maps_.Refresh() || !Locate()) {
+      return false;
+    }
+  }
+  mem_.AllowRefresh();
+  const uint64_t start = MonotonicNanos();
+  if (proc_) {
+    ScopedTimer timer(&stats_, kPhaseStop);
+    proc_->Interrupt();
+  }
+  ContGuard guard(proc_.get(), &stats_, start);
+
+  const size_t syscalls = mem_.syscalls();
+  const size_t bytes = mem_.bytes();
+  {
+    ScopedTimer timer(&stats_, kPhaseWalk);
+    for (size_t attempt = 0;; attempt++) {
+      try {
+        Walk();
+        break;
+      } catch (const InvalidDataException &exc) {
+        if (attempt == retries_) {
+          if (retries_ == 0) {
+            throw;
+          }
+          stats_.discarded++;
+          return false;
+        }
+        stats_.retries++;
+      }
+    }
+  }
+  if (unwinder_) {
+    MergeNative();
+  }
+  Classify();
+  const size_t used = mem_.syscalls() - syscalls;
+  const size_t read = mem_.bytes() - bytes;
+  stats_.samples++;
+  stats_.syscalls += used;
+  stats_.max_syscalls = std::max(stats_.max_syscalls, used);
+  stats_.bytes += read;
+  stats_.max_bytes = std::max(stats_.max_bytes, read);
+  return true;
+}
+
+void Target::Walk() {
+  if (mode_ != SampleMode::kGil) {
+    walker_->GetThreads(addrs_, &threads_);
+    return;
+  }
+  threads_.resize(1);
+  Thread &gil = threads_[0];
+  gil.id = 0;
+  gil.state = ThreadState::kUnknown;
+  gil.weight = 1;
+  if (unwinder_) {
+    // The native stack is found by the thread's id, which GetStack() doesn't
+    // know. Copying the stack keeps the capacity of gil.stack.
+    walker_->GetThreads(addrs_, &all_threads_);
+    for (const auto &thread : all_threads_) {
+      if (thread.gil) {
+        gil.id = thread.id;
+        gil.gil = true;
+        gil.stack.assign(thread.stack.begin(), thread.stack.end());
+        return;
+      }
+    }
+  }
+  gil.gil = walker_->GetStack(addrs_.thread_state, &gil.stack);
+  if (!gil.gil) {
+    gil.state = ThreadState::kIdle;
+  }
+}
+
+void Target::MergeNative() {
+  ScopedTimer timer(&stats_, kPhaseNative);
+  proc_->GetRegisters(&regs_);
+  // the thread id is pthread_self(), which is the thread pointer
+  for (auto &thread : threads_) {
+    for (const auto &regs : regs_) {
+      if (regs.tp == thread.id) {
+        unwinder_->Merge(regs, &thread.stack);
+        break;
+      }
+    }
+  }
+}
+
+void Target::Classify() {
+  if (mode_ == SampleMode::kGil) {
+    return;
+  }
+  ScopedTimer timer(&stats_, kPhaseSched);
+  bool mapped = false;
+  for (auto &thread : threads_) {
+    if (mode_ == SampleMode::kCpu) {
+      thread.weight = 0;  // unless we find out that it ran
+    }
+    auto it = tids_.find(thread.id);
+    if (it != tids_.end() && it->second > 0 && Classify(it->second, &thread)) {
+      continue;
+    } else if (!mapped && (it == tids_.end() || it->second > 0)) {
+      // a new thread, or one that reuses the pthread_t of a thread that
+      // exited. A thread we couldn't find waits for the next new thread.
+      MapTids();
+      mapped = true;
+      const pid_t tid = tids_[thread.id];
+      if (tid > 0 && Classify(tid, &thread)) {
+        continue;
+      }
+    }
+    stats_.unclassified++;
+  }
+  sched_.Sweep();
+}
+
+bool Target::Classify(pid_t tid, Thread *thread) {
+  if (mode_ == SampleMode::kCpu) {
+    uint64_t ns;
+    if (!sched_.ReadCpu(tid, &ns)) {
+      return false;
+    }
+    thread->weight = ns / 1000;
+    return true;
+  }
+  long syscall;
+  if (!sched_.ReadState(tid, &thread->state, &syscall)) {
+    return false;
+  }
+  if (thread->state == ThreadState::kIdle) {
+    auto it = idle_names_.find(syscall);
+    if (it == idle_names_.end()) {
+      it = idle_names_
+               .insert({syscall, strings_->Intern(SyscallName(syscall))})
+               .first;
+    }
+    thread->stack.insert(thread->stack.begin(),
+                         {idle_, it->second, kLabelLine, kLabelLine});
+  }
+  return true;
+}
+
+void Target::MapTids() {
+  tids_.clear();
+#if defined(__x86_64__)
+  if (proc_) {
+    // the thread id is pthread_self(), which is the thread pointer
+    proc_->GetRegisters(&regs_);
+    for (const auto &regs : regs_) {
+      tids_[regs.tp] = regs.tid;
+    }
+  } else if (CheckPthreadTids()) {
+    for (const auto &thread : threads_) {
+      try {
+        tids_[thread.id] =
+            static_cast<pid_t>(mem_.ReadWord(thread.id + kPthreadTid));
+      } catch (const InvalidDataException &exc) {
+        // the thread exited, and glibc freed its stack
+      }
+    }
+  }
+#endif
+  // remember the threads that we couldn't find, so that they don't make us
+  // look again on every sample
+  for (const auto &thread : threads_) {
+    tids_.insert({thread.id, 0});
+  }
+}
+
+bool Target::CheckPthreadTids() {
+#if defined(__x86_64__)
+  if (pthread_checked_) {
+    return pthread_tids_;
+  }
+  std::vector<pid_t> tids;
+  for (const auto &thread : threads_) {
+    try {
+      tids.push_back(
+          static_cast<pid_t>(mem_.ReadWord(thread.id + kPthreadTid)));
+    } catch (const InvalidDataException &exc) {
+      // not glibc, or a thread that exited: check again with the next thread
+      return false;
+    }
+  }
+  if (tids.empty()) {
+    return false;
+  }
+  pthread_checked_ = true;
+  // every thread should have its own id, which the kernel knows about
+  std::vector<pid_t> known = ListThreads(pid_);
+  std::sort(tids.begin(), tids.end());
+  std::sort(known.begin(), known.end());
+  if (tids.front() <= 0 ||
+      std::adjacent_find(tids.begin(), tids.end()) != tids.end() ||
+      !std::includes(known.begin(), known.end(), tids.begin(), tids.end())) {
+    return false;
+  }
+  pthread_tids_ = true;
+#endif
+  return pthread_tids_;
+}
+
+Stats Target::stats() const {
+  Stats stats = stats_;
+  PhaseTimer &maps = stats.phases[kPhaseMaps];
+  maps.count = maps_.refreshes();
+  maps.total_ns = maps_.refresh_ns();
+  maps.max_ns = maps_.max_refresh_ns();
+  stats.rejected = mem_.rejected();
+  if (walker_) {
+    stats.frames = walker_->frames();
+    stats.reused_frames = walker_->reused_frames();
+  }
+  return stats;
+}
+
+void Target::Detach() {
+  if (proc_) {
+    proc_->Detach();
+  }
+}
+
+// A thread that owns some targets, and runs the jobs posted to it one at a
+// time. Sampling the targets at each tick isn't a job, since posting one
+// allocates.
+class Worker {
+ public:
+  explicit Worker(Sampler *sampler)
+      : sampler_(sampler),
+        done_(false),
+        ticking_(false),
+        tick_(0),
+        thread_(&Worker::Run, this) {}
+
+  ~Worker() {
+    // detaching has to be done by this thread too
+    Post([this]() { targets.clear(); }).wait();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+  }
+
+  std::future<void> Post(const std::function<void()> &fn) {
+    std::packaged_task<void()> task(fn);
+    std::future<void> result = task.get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(task));
+    }
+    cond_.notify_one();
+    return result;
+  }
+
+  // Start sampling the targets
+  void StartTick(uint64_t timestamp) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ticking_ = true;
+      tick_ = timestamp;
+    }
+    cond_.notify_one();
+  }
+
+  // Wait for the targets to be sampled. Returns what the sampling threw, if
+  // anything.
+  std::exception_ptr WaitTick() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    tick_done_.wait(lock, [this]() { return !ticking_; });
+    std::exception_ptr error = error_;
+    error_ = nullptr;
+    return error;
+  }
+
+  // Only used by the jobs, which run on this thread.
+  std::vector<std::unique_ptr<Target>> targets;
+
+ private:
+  Sampler *sampler_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::condition_variable tick_done_;
+  std::deque<std::packaged_task<void()>> queue_;
+  bool done_;
+  bool ticking_;
+  uint64_t tick_;
+  std::exception_ptr error_;
+  std::thread thread_;
+
+  void Run() {
+    for (;;) {
+      std::packaged_task<void()> task;
+      uint64_t timestamp = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock,
+                   [this]() { return done_ || ticking_ || !queue_.empty(); });
+        if (!queue_.empty()) {
+          task = std::move(queue_.front());
+          queue_.pop_front();
+        } else if (ticking_) {
+          timestamp = tick_;
+        } else {
+          return;
+        }
+      }
+      if (task.valid()) {
+        task();
+        continue;
+      }
+      std::exception_ptr error;
+      try {
+        sampler_->SampleTargets(this, timestamp);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = error;
+        ticking_ = false;
+      }
+      tick_done_.notify_one();
+    }
+  }
+};
+
+Sampler::Sampler(size_t jobs, SampleMode mode, bool nonblocking, bool native,
+                 bool wait, const SymbolCache *cache, StringTable *strings,
+                 const Callback &callback)
+    : jobs_(std::max<size_t>(jobs, 1)),
+      mode_(mode),
+      nonblocking_(nonblocking),
+      wait_(wait),
+      cache_(cache),
+      strings_(strings),
+      modules_(native ? new NativeModules(strings) : nullptr),
+      callback_(callback),
+      failures_(0) {}
+
+Sampler::~Sampler() {}
+
+void Sampler::Add(pid_t pid) {
+  // Start a new thread for the process if we can, otherwise give it to the
+  // thread with the fewest processes.
+  Worker *worker = nullptr;
+  if (workers_.size() < jobs_) {
+    workers_.emplace_back(new Worker(this));
+    worker = workers_.back().get();
+  } else {
+    for (const auto &w : workers_) {
+      if (worker == nullptr || w->targets.size() < worker->targets.size()) {
+        worker = w.get();
+      }
+    }
+  }
+  const SampleMode mode = mode_;
+  const bool nonblocking = nonblocking_;
+  const bool wait = wait_;
+  const SymbolCache *cache = cache_;
+  StringTable *strings = strings_;
+  NativeModules *modules = modules_.get();
+  bool located = true;
+  worker
+      ->Post([worker, pid, mode, nonblocking, wait, cache, strings, modules,
+              &located]() {
+        worker->targets.emplace_back(new Target(pid, mode, nonblocking, wait,
+                                                cache, strings, modules));
+        located = worker->targets.back()->located();
+      })
+      .get();
+  if (!located) {
+    std::cerr << "Waiting for PID " << pid << " to load libpython" << std::endl;
+  }
+}
+
+void Sampler::SampleTargets(Worker *worker, uint64_t timestamp) {
+  auto &targets = worker->targets;
+  for (auto it = targets.begin(); it != targets.end();) {
+    Target *target = it->get();
+    try {
+      if (target->Sample()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ScopedTimer timer(target->mutable_stats(), kPhaseOutput);
+        callback_(timestamp, target->pid(), target->threads());
+      }
+    } catch (const NonFatalException &exc) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::cerr << exc.what() << std::endl;
+    } catch (const FatalException &exc) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::cerr << exc.what() << std::endl;
+        failures_++;
+        dropped_.Merge(target->stats());
+      }
+      it = targets.erase(it);
+      continue;
+    }
+    ++it;
+  }
+}
+
+void Sampler::Tick(uint64_t timestamp) {
+  for (const auto &w : workers_) {
+    w->StartTick(timestamp);
+  }
+  std::exception_ptr error;
+  for (const auto &w : workers_) {
+    std::exception_ptr e = w->WaitTick();
+    if (e && !error) {
+      error = e;
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  // stop the threads that have nothing left to do
+  workers_.erase(
+      std::remove_if(workers_.begin(), workers_.end(),
+                     [](const std::unique_ptr<Worker> &w) {
+                       return w->targets.empty();
+                     }),
+      workers_.end());
+}
+
+size_t Sampler::size() const {
+  size_t n = 0;
+  for (const auto &w : workers_) {
+    n += w->targets.size();
+  }
+  return n;
+}
+
+Stats Sampler::stats() const {
+  Stats stats = dropped_;
+  for (const auto &w : workers_) {
+    for (const auto &t : w->targets) {
+      stats.Merge(t->stats());
+    }
+  }
+  return stats;
+}
+}  // namespace pystack
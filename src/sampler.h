@@ -0,0 +1,212 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "./frame.h"
+#include "./maps.h"
+#include "./memory.h"
+#include "./proc.h"
+#include "./ptrace.h"
+#include "./pyframe.h"
+#include "./stats.h"
+#include "./unwind.h"
+
+namespace pystack {
+
+// What a sample is of, and what it counts for
+enum class SampleMode {
+  // The thread that holds the GIL. If none does, the sample is the
+  // <idle>:gil-released label.
+  kGil,
+  // Every thread, each counting once. The stacks of threads that are blocked
+  // end with an <idle> label, like <idle>:epoll_wait.
+  kWall,
+  // Every thread that used the CPU since the last sample, weighted by the
+  // microseconds that it used. The first sample of a thread counts for
+  // nothing, since it's just where its CPU time is measured from.
+  kCpu,
+};
+
+// A process being sampled, along with everything that only needs to be set up
+// once: the attachment, the addresses of the interpreter's globals, and the
+// stack walker's caches.
+//
+// ptrace requests can only be made by the thread that attached to the process,
+// so a Target must only ever be used by the thread that created it.
+class Target {
+ public:
+  // Attach to the process and find the interpreter, using the symbol cache if
+  // there is one. In non-blocking mode the process isn't stopped at all, and
+  // samples that change while we read them are retried.
+  //
+  // If wait is set and the process hasn't loaded libpython yet, the Target is
+  // created anyway, and keeps looking for it as the process maps more files.
+  //
+  // The names of the frames are interned in strings. With modules, the
+  // samples are the threads' native stacks with their Python frames merged in,
+  // which needs the process to be stopped.
+  Target(pid_t pid, SampleMode mode, bool nonblocking, bool wait,
+         const SymbolCache *cache, StringTable *strings,
+         NativeModules *modules = nullptr);
+
+  Target(const Target &other) = delete;
+  Target &operator=(const Target &other) = delete;
+
+  // Take a sample of the threads that the mode is about. Returns false if
+  // there's no sample, because the sample kept changing while we read it, or
+  // because the interpreter hasn't been found yet.
+  bool Sample();
+
+  // Pass on the signals sent to the process since the last sample, which
+  // otherwise wait for the next one. Throws FatalException if it has exited.
+  void Poll();
+
+  // The last sample. Its buffers are reused by the next one, so sampling a
+  // process whose threads and code we've already seen doesn't allocate.
+  inline const std::vector<Thread> &threads() const { return threads_; }
+
+  // Detach from the process. This also happens when the Target is destroyed.
+  void Detach();
+
+  inline pid_t pid() const { return pid_; }
+  inline bool located() const { return located_; }
+  inline Stats *mutable_stats() { return &stats_; }
+
+  // The counters for this process
+  Stats stats() const;
+
+ private:
+  pid_t pid_;
+  SampleMode mode_;
+  const SymbolCache *cache_;
+  StringTable *strings_;
+  bool wait_;
+  Stats stats_;
+  std::unique_ptr<SeizedProcess> proc_;
+  MemoryMap maps_;
+  RemoteMemory mem_;
+  std::unique_ptr<StackWalker> walker_;  // once the interpreter is located
+  std::unique_ptr<NativeUnwinder> unwinder_;  // for native stacks
+  std::vector<Thread> threads_;
+  std::vector<Thread> all_threads_;  // to find the thread holding the GIL
+  std::vector<NativeRegs> regs_;
+  SchedReader sched_;
+  // The kernel thread ids by thread id, or 0 for the threads we couldn't find
+  std::unordered_map<unsigned long, pid_t> tids_;
+  bool pthread_checked_;  // whether we've checked the pthread_t offset
+  bool pthread_tids_;     // whether it gives the threads' kernel ids
+  uint32_t idle_;  // the file of the <idle> labels
+  std::unordered_map<long, uint32_t> idle_names_;  // by system call
+  PyAddrs addrs_;
+  bool located_;
+  uint64_t next_locate_;  // when to look for the interpreter again
+  size_t retries_;
+
+  // Find the interpreter. Returns false if we're waiting for it to be loaded.
+  bool Locate();
+
+  // Walk the Python stacks, for Sample()
+  void Walk();
+
+  // Replace the Python stacks with the merged native ones
+  void MergeNative();
+
+  // Find out what the threads were doing, for the modes that need it
+  void Classify();
+
+  // Classify a thread, given its kernel thread id. Returns false if the
+  // process has no such thread.
+  bool Classify(pid_t tid, Thread *thread);
+
+  // Find the kernel thread ids of the threads of the last sample
+  void MapTids();
+
+  // Check that glibc's struct pthread gives the kernel thread ids of the
+  // threads of the last sample, the first time we need to know.
+  bool CheckPthreadTids();
+};
+
+class Worker;
+
+// Samples any number of processes with a small pool of threads. Each process
+// is owned by one of the threads, which does all of its setup and sampling.
+class Sampler {
+ public:
+  // Called with each sample. Calls are serialized, so the callback doesn't
+  // need to do any locking of its own.
+  typedef std::function<void(uint64_t timestamp, pid_t pid,
+                             const std::vector<Thread> &threads)>
+      Callback;
+
+  // With wait set, processes that haven't loaded libpython yet are kept, and
+  // sampled once they do. The frames of the samples have their names in
+  // strings. With native set the samples are native stacks, with the Python
+  // frames merged in, and the libraries' unwind tables are shared by all of
+  // the processes.
+  Sampler(size_t jobs, SampleMode mode, bool nonblocking, bool native,
+          bool wait, const SymbolCache *cache, StringTable *strings,
+          const Callback &callback);
+  ~Sampler();
+
+  Sampler(const Sampler &other) = delete;
+  Sampler &operator=(const Sampler &other) = delete;
+
+  // Attach to a process. Throws if the process can't be sampled.
+  void Add(pid_t pid);
+
+  // Sample every process once, and wait for all the samples. Processes that
+  // exit or can't be read any more are dropped.
+  void Tick(uint64_t timestamp);
+
+  // The number of processes being sampled.
+  size_t size() const;
+
+  // The number of processes that were dropped because of an error.
+  inline size_t failures() const { return failures_; }
+
+  // The counters of all the processes, including the dropped ones.
+  Stats stats() const;
+
+ private:
+  size_t jobs_;
+  SampleMode mode_;
+  bool nonblocking_;
+  bool wait_;
+  const SymbolCache *cache_;
+  StringTable *strings_;
+  std::unique_ptr<NativeModules> modules_;  // if native
+  Callback callback_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::mutex mutex_;  // serializes the callback and error messages
+  size_t failures_;
+  Stats dropped_;  // the counters of the processes that were dropped
+
+  // Sample the targets of a worker, on its thread
+  void SampleTargets(Worker *worker, uint64_t timestamp);
+
+  friend class Worker;
+};
+}  // namespace pystack
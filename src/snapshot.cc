@@ -0,0 +1,212 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "./exc.h"
+
+namespace pystack {
+namespace {
+const char kMagic[8] = {'P', 'S', 'N', 'A', 'P', 'S', 'H', '1'};
+
+struct Header {
+  char magic[8];
+  uint32_t layout;
+  uint32_t page_size;
+  uint64_t pid;
+  uint64_t thread_state;
+  uint64_t interp_head;
+  uint64_t num_pages;
+};
+
+size_t PageSize() {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+// The pages start at a page-aligned offset after the header and the index
+size_t DataOffset(size_t num_pages, size_t page_size) {
+  const size_t end = sizeof(Header) + num_pages * sizeof(uint64_t);
+  return (end + page_size - 1) / page_size * page_size;
+}
+
+void ThrowBadSnapshot(const std::string &path, const char *why) {
+  std::ostringstream ss;
+  ss << "Bad snapshot " << path << ": " << why;
+  throw FatalException(ss.str());
+}
+}  // namespace
+
+void RecordingMemory::ReadV(const Span *spans, size_t n) {
+  mem_->ReadV(spans, n);
+  const unsigned long mask = ~static_cast<unsigned long>(PageSize() - 1);
+  for (size_t i = 0; i < n; i++) {
+    if (spans[i].len == 0) {
+      continue;
+    }
+    const unsigned long last = (spans[i].addr + spans[i].len - 1) & mask;
+    for (unsigned long page = spans[i].addr & mask; page <= last;
+         page += PageSize()) {
+      if (pages_.find(page) == pages_.end()) {
+        CopyPage(page);
+      }
+    }
+  }
+}
+
+void RecordingMemory::CopyPage(unsigned long page) {
+  std::vector<char> buf(PageSize());
+  // the whole page is mapped if any of it is, so this only fails if the process
+  // unmapped it since the read
+  mem_->Read(page, buf.data(), buf.size());
+  pages_[page] = std::move(buf);
+}
+
+void RecordingMemory::Write(const std::string &path, pid_t pid,
+                            const PyAddrs &addrs) const {
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.layout = addrs.version;
+  header.page_size = PageSize();
+  header.pid = pid;
+  header.thread_state = addrs.thread_state;
+  header.interp_head = addrs.interp_head;
+  header.num_pages = pages_.size();
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (const auto &kv : pages_) {
+    const uint64_t addr = kv.first;
+    out.write(reinterpret_cast<const char *>(&addr), sizeof(addr));
+  }
+  const size_t offset = DataOffset(pages_.size(), PageSize());
+  const std::vector<char> padding(
+      offset - sizeof(header) - pages_.size() * sizeof(uint64_t));
+  out.write(padding.data(), padding.size());
+  for (const auto &kv : pages_) {
+    out.write(kv.second.data(), kv.second.size());
+  }
+  out.close();
+  if (!out) {
+    std::ostringstream ss;
+    ss << "Failed to write snapshot " << path;
+    throw FatalException(ss.str());
+  }
+}
+
+SnapshotMemory::SnapshotMemory(const std::string &path)
+    : addr_(nullptr), length_(0) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    std::ostringstream ss;
+    ss << "Failed to open snapshot " << path << ": " << strerror(errno);
+    throw FatalException(ss.str());
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    std::ostringstream ss;
+    ss << "Failed to stat snapshot " << path << ": " << strerror(errno);
+    throw FatalException(ss.str());
+  }
+  length_ = st.st_size;
+  if (length_ < sizeof(Header)) {
+    close(fd);
+    ThrowBadSnapshot(path, "too short");
+  }
+  addr_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr_ == MAP_FAILED) {
+    addr_ = nullptr;
+    std::ostringstream ss;
+    ss << "Failed to mmap snapshot " << path << ": " << strerror(errno);
+    throw FatalException(ss.str());
+  }
+
+  // copy the header, so that it's still there for the error messages
+  Header header;
+  memcpy(&header, addr_, sizeof(header));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    munmap(addr_, length_);
+    ThrowBadSnapshot(path, "not a snapshot");
+  }
+  page_size_ = header.page_size;
+  num_pages_ = header.num_pages;
+  const size_t max_pages = length_ / sizeof(uint64_t);
+  if (page_size_ == 0 || (page_size_ & (page_size_ - 1)) != 0 ||
+      num_pages_ > max_pages ||
+      DataOffset(num_pages_, page_size_) + num_pages_ * page_size_ > length_) {
+    munmap(addr_, length_);
+    ThrowBadSnapshot(path, "truncated");
+  }
+  pid_ = header.pid;
+  addrs_.thread_state = header.thread_state;
+  addrs_.interp_head = header.interp_head;
+  addrs_.version = header.layout;
+  index_ = reinterpret_cast<const uint64_t *>(static_cast<const char *>(addr_) +
+                                              sizeof(Header));
+  data_ = static_cast<const char *>(addr_) + DataOffset(num_pages_, page_size_);
+}
+
+SnapshotMemory::~SnapshotMemory() {
+  if (addr_ != nullptr) {
+    munmap(addr_, length_);
+  }
+}
+
+const char *SnapshotMemory::FindPage(unsigned long page) const {
+  const uint64_t *end = index_ + num_pages_;
+  const uint64_t *it = std::lower_bound(index_, end, page);
+  if (it == end || *it != page) {
+    return nullptr;
+  }
+  return data_ + (it - index_) * page_size_;
+}
+
+void SnapshotMemory::ReadV(const Span *spans, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    char *out = static_cast<char *>(spans[i].buf);
+    unsigned long addr = spans[i].addr;
+    size_t left = spans[i].len;
+    while (left) {
+      const size_t off = addr & (page_size_ - 1);
+      const size_t len = std::min(left, page_size_ - off);
+      const char *page = FindPage(addr - off);
+      if (page == nullptr) {
+        std::ostringstream ss;
+        ss << "Address " << reinterpret_cast<void *>(addr)
+           << " isn't in the snapshot";
+        throw InvalidDataException(ss.str());
+      }
+      memcpy(out, page + off, len);
+      out += len;
+      addr += len;
+      left -= len;
+    }
+  }
+}
+}  // namespace pystack
@@ -0,0 +1,85 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "./memory.h"
+#include "./pyframe.h"
+
+namespace pystack {
+
+// A snapshot is a file with the pages of a process's memory that were touched
+// while walking its stacks, along with the addresses of the interpreter's
+// globals. The same walk can then be replayed from the file, without the
+// process, e.g. to benchmark the walker or to look at a bug report.
+
+// Passes reads through to another reader, and keeps a copy of every page that
+// they touch.
+class RecordingMemory : public MemoryReader {
+ public:
+  explicit RecordingMemory(MemoryReader *mem) : mem_(mem) {}
+
+  void ReadV(const Span *spans, size_t n) override;
+
+  // Write the pages that have been read so far to a snapshot file.
+  void Write(const std::string &path, pid_t pid, const PyAddrs &addrs) const;
+
+  inline size_t pages() const { return pages_.size(); }
+
+ private:
+  MemoryReader *mem_;
+  std::map<unsigned long, std::vector<char>> pages_;
+
+  void CopyPage(unsigned long page);
+};
+
+// Serves reads from a snapshot file, which is mmap'ed. Reading memory that
+// wasn't captured throws InvalidDataException, just like reading unmapped
+// memory in a live process would.
+class SnapshotMemory : public MemoryReader {
+ public:
+  explicit SnapshotMemory(const std::string &path);
+  ~SnapshotMemory();
+
+  SnapshotMemory(const SnapshotMemory &other) = delete;
+  SnapshotMemory &operator=(const SnapshotMemory &other) = delete;
+
+  void ReadV(const Span *spans, size_t n) override;
+
+  // The process the snapshot was taken from
+  inline pid_t pid() const { return pid_; }
+  inline const PyAddrs &addrs() const { return addrs_; }
+  inline size_t pages() const { return num_pages_; }
+
+ private:
+  void *addr_;
+  size_t length_;
+  pid_t pid_;
+  PyAddrs addrs_;
+  size_t page_size_;
+  size_t num_pages_;
+  const uint64_t *index_;  // page addresses, sorted
+  const char *data_;       // the pages, in the same order
+
+  const char *FindPage(unsigned long page) const;
+};
+}  // namespace pystack
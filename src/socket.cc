@@ -0,0 +1,151 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./socket.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "./exc.h"
+
+namespace pystack {
+namespace {
+void ThrowSocketError(const char *what, const std::string &path) {
+  std::ostringstream ss;
+  ss << "Failed to " << what << " " << path << ": " << strerror(errno);
+  throw FatalException(ss.str());
+}
+
+sockaddr_un SocketAddress(const std::string &path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::ostringstream ss;
+    ss << "Socket path is too long: " << path;
+    throw FatalException(ss.str());
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size());
+  return addr;
+}
+
+int Socket(const std::string &path) {
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    ThrowSocketError("create a socket for", path);
+  }
+  return fd;
+}
+}  // namespace
+
+std::string DefaultSocketPath() {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir != nullptr && *dir == '/') {
+    return std::string(dir) + "/pystackd.sock";
+  }
+  std::ostringstream ss;
+  ss << "/tmp/pystackd-" << geteuid() << ".sock";
+  return ss.str();
+}
+
+int ListenUnix(const std::string &path) {
+  const sockaddr_un addr = SocketAddress(path);
+  const int fd = Socket(path);
+  const sockaddr *sa = reinterpret_cast<const sockaddr *>(&addr);
+  // the umask makes the socket 0600 from the start, rather than after a chmod
+  const mode_t mask = umask(077);
+  int err = bind(fd, sa, sizeof(addr));
+  if (err == -1 && errno == EADDRINUSE) {
+    // the file is left over from a daemon that died, unless one answers
+    const int probe = Socket(path);
+    const bool live = connect(probe, sa, sizeof(addr)) == 0;
+    close(probe);
+    if (live) {
+      umask(mask);
+      close(fd);
+      std::ostringstream ss;
+      ss << "Another pystackd is listening on " << path;
+      throw FatalException(ss.str());
+    }
+    unlink(path.c_str());
+    err = bind(fd, sa, sizeof(addr));
+  }
+  umask(mask);
+  if (err == -1 || listen(fd, SOMAXCONN) == -1) {
+    const int saved = errno;
+    close(fd);
+    errno = saved;
+    ThrowSocketError("listen on", path);
+  }
+  return fd;
+}
+
+int ConnectUnix(const std::string &path) {
+  const sockaddr_un addr = SocketAddress(path);
+  const int fd = Socket(path);
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) ==
+      -1) {
+    const int saved = errno;
+    close(fd);
+    errno = saved;
+    ThrowSocketError("connect to", path);
+  }
+  return fd;
+}
+
+void WriteAll(int fd, const std::string &data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    const ssize_t n =
+        send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ThrowSocketError("write to", "the socket");
+    }
+    done += n;
+  }
+}
+
+std::string ReadUntil(int fd, size_t max, bool line) {
+  std::string data;
+  char buf[4096];
+  while (data.size() < max) {
+    const ssize_t n = read(fd, buf, std::min(sizeof(buf), max - data.size()));
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ThrowSocketError("read from", "the socket");
+    } else if (n == 0) {
+      break;
+    }
+    data.append(buf, n);
+    if (line && memchr(buf, '\n', n) != nullptr) {
+      break;
+    }
+  }
+  return data;
+}
+}  // namespace pystack
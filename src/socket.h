@@ -0,0 +1,40 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <string>
+
+namespace pystack {
+
+// The socket that pystackd listens on by default:
+// $XDG_RUNTIME_DIR/pystackd.sock, or /tmp/pystackd-UID.sock.
+std::string DefaultSocketPath();
+
+// Listen on a UNIX socket. Only our user can connect to it. A socket file that
+// nothing is listening on any more is replaced, but if another daemon is using
+// the path this throws FatalException.
+int ListenUnix(const std::string &path);
+
+// Connect to a UNIX socket. Throws FatalException if nothing is listening.
+int ConnectUnix(const std::string &path);
+
+// Write all of data, retrying short writes. Throws FatalException on errors.
+void WriteAll(int fd, const std::string &data);
+
+// Read up to max bytes, stopping at EOF or after the first newline if line is
+// set. Throws FatalException on errors, including a read timing out.
+std::string ReadUntil(int fd, size_t max, bool line);
+}  // namespace pystack
@@ -0,0 +1,147 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./stats.h"
+
+#include <algorithm>
+
+namespace pystack {
+namespace {
+const char *const kPhaseNames[kNumPhases] = {
+    "attach", "elf", "maps", "stop", "walk", "native", "sched", "output"};
+
+double Micros(uint64_t ns) { return ns / 1e3; }
+
+double PerSample(size_t total, const Stats &stats) {
+  return stats.samples ? static_cast<double>(total) / stats.samples : 0;
+}
+}  // namespace
+
+void PhaseTimer::Add(uint64_t ns) {
+  count++;
+  total_ns += ns;
+  max_ns = std::max(max_ns, ns);
+}
+
+void Stats::Merge(const Stats &other) {
+  samples += other.samples;
+  syscalls += other.syscalls;
+  max_syscalls = std::max(max_syscalls, other.max_syscalls);
+  bytes += other.bytes;
+  max_bytes = std::max(max_bytes, other.max_bytes);
+  retries += other.retries;
+  discarded += other.discarded;
+  rejected += other.rejected;
+  unclassified += other.unclassified;
+  frames += other.frames;
+  reused_frames += other.reused_frames;
+  for (int i = 0; i < kNumPhases; i++) {
+    phases[i].count += other.phases[i].count;
+    phases[i].total_ns += other.phases[i].total_ns;
+    phases[i].max_ns = std::max(phases[i].max_ns, other.phases[i].max_ns);
+  }
+  stopped.Merge(other.stopped);
+}
+
+void WriteStats(std::ostream &os, const Stats &stats, const Ticker *ticker) {
+  if (ticker != nullptr) {
+    const Histogram &jitter = ticker->jitter();
+    os << "ticks: " << ticker->ticks() << ", missed: " << ticker->missed()
+       << ", rate: " << ticker->rate() << "/s (target "
+       << (ticker->period() ? 1e9 / ticker->period() : 0) << "/s)\n"
+       << "jitter (us): p50 " << Micros(jitter.Percentile(0.5)) << " p90 "
+       << Micros(jitter.Percentile(0.9)) << " p99 "
+       << Micros(jitter.Percentile(0.99)) << " max " << Micros(jitter.max())
+       << "\n";
+  }
+  if (stats.samples == 0) {
+    return;
+  }
+  os << "samples: " << stats.samples << ", syscalls/sample: avg "
+     << PerSample(stats.syscalls, stats) << " max " << stats.max_syscalls
+     << ", bytes/sample: avg " << PerSample(stats.bytes, stats) << " max "
+     << stats.max_bytes << "\n";
+  if (stats.frames) {
+    os << "frames: " << stats.frames << ", reused from the previous "
+       << "sample: " << stats.reused_frames << " ("
+       << 100.0 * stats.reused_frames / stats.frames << "%)\n";
+  }
+  if (stats.retries || stats.discarded || stats.rejected) {
+    os << "retried reads: " << stats.retries
+       << ", discarded samples: " << stats.discarded
+       << ", reads outside the memory map: " << stats.rejected << "\n";
+  }
+  if (stats.unclassified) {
+    os << "thread samples without a kernel thread id, so not classified: "
+       << stats.unclassified << "\n";
+  }
+  if (stats.stopped.count()) {
+    os << "stopped (us): p50 " << Micros(stats.stopped.Percentile(0.5))
+       << " p99 " << Micros(stats.stopped.Percentile(0.99)) << " p999 "
+       << Micros(stats.stopped.Percentile(0.999)) << " max "
+       << Micros(stats.stopped.max()) << "\n";
+  }
+  for (int i = 0; i < kNumPhases; i++) {
+    const PhaseTimer &t = stats.phases[i];
+    if (t.count) {
+      os << kPhaseNames[i] << " (us): count " << t.count << " avg "
+         << Micros(t.total_ns) / t.count << " max " << Micros(t.max_ns)
+         << "\n";
+    }
+  }
+}
+
+void WriteStatsJson(std::ostream &os, const Stats &stats,
+                    const Ticker *ticker) {
+  os << "{\"samples\": " << stats.samples
+     << ", \"syscalls\": {\"total\": " << stats.syscalls
+     << ", \"per_sample\": " << PerSample(stats.syscalls, stats)
+     << ", \"max\": " << stats.max_syscalls
+     << "}, \"bytes\": {\"total\": " << stats.bytes
+     << ", \"per_sample\": " << PerSample(stats.bytes, stats)
+     << ", \"max\": " << stats.max_bytes
+     << "}, \"retries\": " << stats.retries
+     << ", \"discarded\": " << stats.discarded
+     << ", \"rejected\": " << stats.rejected
+     << ", \"unclassified\": " << stats.unclassified
+     << ", \"frames\": " << stats.frames
+     << ", \"reused_frames\": " << stats.reused_frames << ", \"phases\": {";
+  for (int i = 0; i < kNumPhases; i++) {
+    const PhaseTimer &t = stats.phases[i];
+    os << (i ? ", " : "") << "\"" << kPhaseNames[i]
+       << "\": {\"count\": " << t.count
+       << ", \"total_us\": " << Micros(t.total_ns)
+       << ", \"max_us\": " << Micros(t.max_ns) << "}";
+  }
+  const Histogram &h = stats.stopped;
+  os << "}, \"stopped_us\": {\"count\": " << h.count()
+     << ", \"p50\": " << Micros(h.Percentile(0.5))
+     << ", \"p99\": " << Micros(h.Percentile(0.99))
+     << ", \"p999\": " << Micros(h.Percentile(0.999))
+     << ", \"max\": " << Micros(h.max()) << "}";
+  if (ticker != nullptr) {
+    const Histogram &j = ticker->jitter();
+    os << ", \"ticks\": " << ticker->ticks()
+       << ", \"missed\": " << ticker->missed()
+       << ", \"rate\": " << ticker->rate() << ", \"target_rate\": "
+       << (ticker->period() ? 1e9 / ticker->period() : 0)
+       << ", \"jitter_us\": {\"p50\": " << Micros(j.Percentile(0.5))
+       << ", \"p90\": " << Micros(j.Percentile(0.9))
+       << ", \"p99\": " << Micros(j.Percentile(0.99))
+       << ", \"max\": " << Micros(j.max()) << "}";
+  }
+  os << "}\n";
+}
+}  // namespace pystack
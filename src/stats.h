@@ -0,0 +1,88 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+#include "./histogram.h"
+#include "./ticker.h"
+
+namespace pystack {
+
+// The things that pystack spends time on
+enum Phase {
+  kPhaseAttach,  // seizing the process
+  kPhaseElf,     // finding the interpreter's symbols
+  kPhaseMaps,    // reading /proc/PID/maps
+  kPhaseStop,    // waiting for the process to stop
+  kPhaseWalk,    // reading the stacks
+  kPhaseNative,  // unwinding the native stacks
+  kPhaseSched,   // reading what the threads are doing from /proc
+  kPhaseOutput,  // printing, aggregating or recording the samples
+  kNumPhases,
+};
+
+struct PhaseTimer {
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+
+  void Add(uint64_t ns);
+};
+
+// Counters for the --stats option.
+struct Stats {
+  size_t samples = 0;
+  size_t syscalls = 0;
+  size_t max_syscalls = 0;
+  size_t bytes = 0;
+  size_t max_bytes = 0;
+  size_t retries = 0;
+  size_t discarded = 0;
+  size_t rejected = 0;
+  size_t unclassified = 0;  // threads whose kernel thread id wasn't found
+  size_t frames = 0;
+  size_t reused_frames = 0;
+  PhaseTimer phases[kNumPhases];
+
+  // How long the process was stopped for each sample, from the interrupt to
+  // when it was continued, in nanoseconds
+  Histogram stopped;
+
+  void Merge(const Stats &other);
+};
+
+// Adds the time until it goes out of scope to a phase
+class ScopedTimer {
+ public:
+  ScopedTimer(Stats *stats, Phase phase)
+      : timer_(&stats->phases[phase]), start_(MonotonicNanos()) {}
+  ~ScopedTimer() { timer_->Add(MonotonicNanos() - start_); }
+
+ private:
+  PhaseTimer *timer_;
+  uint64_t start_;
+};
+
+// Write the stats for people to read. The ticker is null if only one sample was
+// taken.
+void WriteStats(std::ostream &os, const Stats &stats, const Ticker *ticker);
+
+// Write the stats as a JSON object
+void WriteStatsJson(std::ostream &os, const Stats &stats, const Ticker *ticker);
+}  // namespace pystack
@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <sstream>
@@ -74,31 +75,49 @@ void ELF::Parse() {
       case SHT_STRTAB:
         if (strcmp(strtab(s->sh_name), ".dynstr") == 0) {
           dynstr_ = i;
+        } else if (strcmp(strtab(s->sh_name), ".strtab") == 0) {
+          strtab_ = i;
         }
         break;
       case SHT_DYNSYM:
         dynsym_ = i;
         break;
+      case SHT_SYMTAB:
+        symtab_ = i;
+        break;
       case SHT_DYNAMIC:
         dynamic_ = i;
         break;
+      case SHT_GNU_HASH:
+        gnu_hash_ = i;
+        break;
+      case SHT_HASH:
+        hash_ = i;
+        break;
     }
   }
-  if (dynamic_ == -1) {
-    throw FatalException("Failed to find section .dynamic");
-  } else if (dynstr_ == -1) {
-    throw FatalException("Failed to find section .dynstr");
-  } else if (dynsym_ == -1) {
-    throw FatalException("Failed to find section .dynsym");
+  // a static executable has no dynamic sections, but it can still be read
+  // if it has a full symbol table
+  if (dynstr_ == -1) {
+    dynamic_ = dynsym_ = -1;
+  }
+  if (strtab_ == -1) {
+    symtab_ = -1;
+  }
+  if (dynsym_ == -1 && symtab_ == -1) {
+    throw FatalException("Failed to find section .dynsym or .symtab");
   }
 }
 
 std::vector<std::string> ELF::NeededLibs() {
   // Get all of the strings
   std::vector<std::string> needed;
+  if (dynamic_ == -1) {
+    return needed;  // statically linked
+  }
   const Elf64_Shdr *s = shdr(dynamic_);
   const Elf64_Shdr *d = shdr(dynstr_);
-  for (uint16_t i = 0; i < s->sh_size / s->sh_entsize; i++) {
+  for (size_t i = 0; i < s->sh_size / s->sh_entsize; i++) {
     const Elf64_Dyn *dyn = reinterpret_cast<const Elf64_Dyn *>(
         p() + s->sh_offset + i * s->sh_entsize);
     if (dyn->d_tag == DT_NEEDED) {
@@ -109,18 +128,280 @@ std::vector<std::string> ELF::NeededLibs() {
   return needed;
 }
 
-unsigned long ELF::GetThreadState() {
+std::vector<Elf64_Phdr> ELF::Segments() const {
+  const Elf64_Ehdr *h = hdr();
+  std::vector<Elf64_Phdr> segments;
+  for (size_t i = 0; i < h->e_phnum; i++) {
+    segments.push_back(*static_cast<const Elf64_Phdr *>(
+        At(h->e_phoff + i * h->e_phentsize, sizeof(Elf64_Phdr))));
+  }
+  return segments;
+}
+
+std::vector<ElfNote> ELF::Notes() const {
+  std::vector<ElfNote> notes;
+  for (const auto &ph : Segments()) {
+    if (ph.p_type != PT_NOTE) {
+      continue;
+    }
+    // Each note is a header, the name and then the description, with the name
+    // and description padded to 4 bytes.
+    const unsigned long end = ph.p_offset + ph.p_filesz;
+    At(ph.p_offset, ph.p_filesz);
+    for (unsigned long off = ph.p_offset; off + sizeof(Elf64_Nhdr) <= end;) {
+      const Elf64_Nhdr *note = reinterpret_cast<const Elf64_Nhdr *>(p() + off);
+      const unsigned long name = off + sizeof(Elf64_Nhdr);
+      const unsigned long desc = name + ((note->n_namesz + 3) & ~3UL);
+      off = desc + ((note->n_descsz + 3) & ~3UL);
+      if (off > end) {
+        break;
+      }
+      const char *name_ptr = reinterpret_cast<const char *>(p() + name);
+      notes.push_back({note->n_type,
+                       std::string(name_ptr, strnlen(name_ptr, note->n_namesz)),
+                       reinterpret_cast<const void *>(p() + desc),
+                       note->n_descsz});
+    }
+  }
+  return notes;
+}
+
+std::string ELF::BuildId() const {
+  static const char hex[] = "0123456789abcdef";
+  for (const auto &note : Notes()) {
+    if (note.type == NT_GNU_BUILD_ID && note.name == "GNU") {
+      const uint8_t *id = static_cast<const uint8_t *>(note.desc);
+      std::string out;
+      for (size_t j = 0; j < note.size; j++) {
+        out += hex[id[j] >> 4];
+        out += hex[id[j] & 0xf];
+      }
+      return out;
+    }
+  }
+  return "";
+}
+
+const Elf64_Shdr *ELF::FindSection(const char *name) const {
+  const Elf64_Ehdr *h = hdr();
+  if (h->e_shoff == 0 || h->e_shstrndx == SHN_UNDEF) {
+    return nullptr;
+  }
+  At(h->e_shoff, h->e_shnum * sizeof(Elf64_Shdr));
+  const Elf64_Shdr *names = shdr(h->e_shstrndx);
+  for (uint16_t i = 1; i < h->e_shnum; i++) {
+    const Elf64_Shdr *s = shdr(i);
+    if (s->sh_name < names->sh_size && strcmp(strtab(s->sh_name), name) == 0) {
+      return s;
+    }
+  }
+  return nullptr;
+}
+
+std::vector<ElfSymbol> ELF::Functions() const {
+  std::vector<ElfSymbol> functions;
+  const Elf64_Ehdr *h = hdr();
+  if (h->e_shoff == 0) {
+    return functions;
+  }
+  At(h->e_shoff, h->e_shnum * sizeof(Elf64_Shdr));
+  for (uint16_t i = 1; i < h->e_shnum; i++) {
+    const Elf64_Shdr *s = shdr(i);
+    if ((s->sh_type != SHT_SYMTAB && s->sh_type != SHT_DYNSYM) ||
+        s->sh_entsize != sizeof(Elf64_Sym) || s->sh_link >= h->e_shnum) {
+      continue;
+    }
+    const Elf64_Shdr *d = shdr(s->sh_link);
+    At(s->sh_offset, s->sh_size);
+    At(d->sh_offset, d->sh_size);
+    for (size_t j = 0; j < s->sh_size / s->sh_entsize; j++) {
+      const Elf64_Sym *sym = reinterpret_cast<const Elf64_Sym *>(
+          p() + s->sh_offset + j * s->sh_entsize);
+      if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC ||
+          sym->st_shndx == SHN_UNDEF || sym->st_value == 0 ||
+          sym->st_name >= d->sh_size) {
+        continue;
+      }
+      functions.push_back(
+          {static_cast<unsigned long>(sym->st_value),
+           static_cast<unsigned long>(sym->st_size),
+           reinterpret_cast<const char *>(p() + d->sh_offset + sym->st_name)});
+    }
+  }
+  std::sort(functions.begin(), functions.end(),
+            [](const ElfSymbol &a, const ElfSymbol &b) {
+              return a.addr < b.addr;
+            });
+  return functions;
+}
+
+unsigned long ELF::LookupSymbol(const char *name) {
+  return LookupSymbols({name})[0];
+}
+
+std::vector<unsigned long> ELF::LookupSymbols(
+    const std::vector<const char *> &names) {
+  std::vector<unsigned long> addrs;
+  addrs.reserve(names.size());
+  bool missing = false;
+  for (const char *name : names) {
+    addrs.push_back(LookupDynamic(name));
+    missing = missing || addrs.back() == 0;
+  }
+  if (missing && symtab_ != -1) {
+    SearchSymbols(symtab_, strtab_, names, &addrs);
+  }
+  return addrs;
+}
+
+unsigned long ELF::LookupDynamic(const char *name) {
+  if (dynsym_ == -1) {
+    return 0;
+  } else if (gnu_hash_ != -1) {
+    return LookupGnuHash(name);
+  } else if (hash_ != -1) {
+    return LookupHash(name);
+  }
+  std::vector<unsigned long> addrs{0};
+  SearchSymbols(dynsym_, dynstr_, {name}, &addrs);
+  return addrs[0];
+}
+
+// The GNU hash section is a header, a bloom filter of every symbol's hash,
+// buckets with the index of the first symbol of each bucket, and then the
+// hashes of the symbols, starting at the first hashed symbol. Symbols are
+// sorted by bucket, and the low bit of a hash marks the last one of a bucket.
+unsigned long ELF::LookupGnuHash(const char *name) {
+  uint32_t h = 5381;
+  for (const unsigned char *c = reinterpret_cast<const unsigned char *>(name);
+       *c; c++) {
+    h = h * 33 + *c;
+  }
+
+  const Elf64_Shdr *s = shdr(gnu_hash_);
+  const uint32_t *header =
+      static_cast<const uint32_t *>(At(s->sh_offset, 4 * sizeof(uint32_t)));
+  const uint32_t nbuckets = header[0];
+  const uint32_t symoffset = header[1];
+  const uint32_t bloom_size = header[2];
+  const uint32_t bloom_shift = header[3];
+  if (nbuckets == 0 || bloom_size == 0) {
+    return 0;
+  }
+  const unsigned long bloom_offset = s->sh_offset + 4 * sizeof(uint32_t);
+  const uint64_t *bloom = static_cast<const uint64_t *>(
+      At(bloom_offset, bloom_size * sizeof(uint64_t)));
+  const uint64_t word = bloom[(h / 64) % bloom_size];
+  const uint64_t mask =
+      (uint64_t(1) << (h % 64)) | (uint64_t(1) << ((h >> bloom_shift) % 64));
+  if ((word & mask) != mask) {
+    return 0;
+  }
+
+  const unsigned long buckets_offset =
+      bloom_offset + bloom_size * sizeof(uint64_t);
+  const uint32_t *buckets = static_cast<const uint32_t *>(
+      At(buckets_offset, nbuckets * sizeof(uint32_t)));
+  const unsigned long chain_offset =
+      buckets_offset + nbuckets * sizeof(uint32_t);
+  for (uint32_t idx = buckets[h % nbuckets]; idx >= symoffset; idx++) {
+    const uint32_t hash = *static_cast<const uint32_t *>(
+        At(chain_offset + (idx - symoffset) * sizeof(uint32_t),
+           sizeof(uint32_t)));
+    if ((hash | 1) == (h | 1)) {
+      const unsigned long addr = MatchDynamic(idx, name);
+      if (addr != 0) {
+        return addr;
+      }
+    }
+    if (hash & 1) {
+      break;
+    }
+  }
+  return 0;
+}
+
+// The SysV hash section is nbucket, nchain, the buckets, and then the chains.
+// Each bucket and chain entry is the index of a symbol, or 0 at the end.
+unsigned long ELF::LookupHash(const char *name) {
+  uint32_t h = 0;
+  for (const unsigned char *c = reinterpret_cast<const unsigned char *>(name);
+       *c; c++) {
+    h = (h << 4) + *c;
+    const uint32_t g = h & 0xf0000000;
+    h ^= g >> 24;
+    h &= ~g;
+  }
+
+  const Elf64_Shdr *s = shdr(hash_);
+  const uint32_t *header =
+      static_cast<const uint32_t *>(At(s->sh_offset, 2 * sizeof(uint32_t)));
+  const uint32_t nbucket = header[0];
+  const uint32_t nchain = header[1];
+  if (nbucket == 0) {
+    return 0;
+  }
+  const uint32_t *table = static_cast<const uint32_t *>(
+      At(s->sh_offset, (2 + nbucket + nchain) * sizeof(uint32_t)));
+  const uint32_t *chains = table + 2 + nbucket;
+  // every symbol is in one chain, so a longer walk means a loop
+  uint32_t steps = 0;
+  for (uint32_t idx = table[2 + h % nbucket]; idx != STN_UNDEF && idx < nchain;
+       idx = chains[idx]) {
+    const unsigned long addr = MatchDynamic(idx, name);
+    if (addr != 0) {
+      return addr;
+    }
+    if (++steps > nchain) {
+      break;
+    }
+  }
+  return 0;
+}
+
+unsigned long ELF::MatchDynamic(size_t idx, const char *name) {
   const Elf64_Shdr *s = shdr(dynsym_);
-  const Elf64_Shdr *d = shdr(dynstr_);
-  for (uint16_t i = 0; i < s->sh_size / s->sh_entsize; i++) {
+  if (idx >= s->sh_size / s->sh_entsize) {
+    return 0;
+  }
+  const Elf64_Sym *sym = static_cast<const Elf64_Sym *>(
+      At(s->sh_offset + idx * s->sh_entsize, sizeof(Elf64_Sym)));
+  if (sym->st_shndx == SHN_UNDEF || strcmp(dynstr(sym->st_name), name) != 0) {
+    return 0;
+  }
+  return static_cast<unsigned long>(sym->st_value);
+}
+
+void ELF::SearchSymbols(int symbols, int strings,
+                        const std::vector<const char *> &names,
+                        std::vector<unsigned long> *addrs) {
+  size_t missing = std::count(addrs->begin(), addrs->end(), 0);
+  const Elf64_Shdr *s = shdr(symbols);
+  const Elf64_Shdr *d = shdr(strings);
+  At(s->sh_offset, s->sh_size);
+  for (size_t i = 0; missing && i < s->sh_size / s->sh_entsize; i++) {
     const Elf64_Sym *sym = reinterpret_cast<const Elf64_Sym *>(
         p() + s->sh_offset + i * s->sh_entsize);
-    const char *name =
+    if (sym->st_shndx == SHN_UNDEF || sym->st_name >= d->sh_size) {
+      continue;
+    }
+    const char *sym_name =
         reinterpret_cast<const char *>(p() + d->sh_offset + sym->st_name);
-    if (strcmp(name, "_PyThreadState_Current") == 0) {
-      return static_cast<unsigned long>(sym->st_value);
+    for (size_t j = 0; j < names.size(); j++) {
+      if ((*addrs)[j] == 0 && strcmp(sym_name, names[j]) == 0) {
+        (*addrs)[j] = static_cast<unsigned long>(sym->st_value);
+        missing--;
+      }
     }
   }
-  return 0;
+}
+
+const void *ELF::At(unsigned long offset, size_t len) const {
+  if (offset > length_ || len > length_ - offset) {
+    std::ostringstream ss;
+    ss << "ELF data at offset " << offset << " is past the end of the file";
+    throw FatalException(ss.str());
+  }
+  return reinterpret_cast<const void *>(p() + offset);
 }
 }  // namespace pystack
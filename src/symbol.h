@@ -17,6 +17,7 @@
 
 #include <elf.h>
 
+#include <cstdint>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -26,6 +27,21 @@
 
 namespace pystack {
 
+// An ELF note, which points into the file's mapping
+struct ElfNote {
+  uint32_t type;
+  std::string name;  // the owner, e.g. "GNU" or "CORE"
+  const void *desc;
+  size_t size;  // of desc
+};
+
+// A function in an ELF symbol table. The name points into the file's mapping.
+struct ElfSymbol {
+  unsigned long addr;
+  unsigned long size;
+  const char *name;
+};
+
 // Representation of a 64-bit ELF file.
 //
 // TODO: support 32-bit ELF files. One easiest way to do this would be to have
@@ -35,7 +51,16 @@ namespace pystack {
 // should use.
 class ELF {
  public:
-  ELF() : addr_(nullptr), length_(0), dynamic_(-1), dynstr_(-1), dynsym_(-1) {}
+  ELF()
+      : addr_(nullptr),
+        length_(0),
+        dynamic_(-1),
+        dynstr_(-1),
+        dynsym_(-1),
+        strtab_(-1),
+        symtab_(-1),
+        gnu_hash_(-1),
+        hash_(-1) {}
   ~ELF() { Close(); }
 
   // Open a file
@@ -44,19 +69,72 @@ class ELF {
   // Close the file; normally the destructor will do this for you.
   void Close();
 
-  // Parse the ELF sections.
+  // Parse the ELF sections. The dynamic sections are optional, for static
+  // executables, but there has to be a .dynsym or a .symtab.
   void Parse();
 
-  // Find the DT_NEEDED fields. This is similar to the ldd(1) command.
+  // Find the DT_NEEDED fields. This is similar to the ldd(1) command. A static
+  // executable has none.
   std::vector<std::string> NeededLibs();
 
-  // Get the address of _PyThreadState_Current
-  unsigned long GetThreadState();
+  // The size of the file
+  inline size_t size() const { return length_; }
+
+  // The file type, e.g. ET_EXEC or ET_DYN
+  inline uint16_t type() const { return hdr()->e_type; }
+
+  // The NT_GNU_BUILD_ID note as a hex string, or an empty string if there
+  // isn't one. This only reads the program headers, so it doesn't need Parse().
+  std::string BuildId() const;
+
+  // The program headers, e.g. the PT_LOAD segments of a core file. Like
+  // BuildId() this doesn't need Parse().
+  std::vector<Elf64_Phdr> Segments() const;
+
+  // The notes in the PT_NOTE segments.
+  std::vector<ElfNote> Notes() const;
+
+  // The section called name, or null if there isn't one. Like BuildId() this
+  // doesn't need Parse().
+  const Elf64_Shdr *FindSection(const char *name) const;
+
+  // The functions defined in the full symbol table and the dynamic one, sorted
+  // by address. Functions that are in both are listed twice. This doesn't need
+  // Parse(), so it works for static executables too.
+  std::vector<ElfSymbol> Functions() const;
+
+  // Check that a range of the file is in bounds, and get a pointer to it.
+  const void *At(unsigned long offset, size_t len) const;
+
+  // Get the address of a symbol, or 0 if it isn't defined. The dynamic symbol
+  // table is searched first, using its hash table (DT_GNU_HASH, or else
+  // DT_HASH), and then the full symbol table if the file has one, so that
+  // static variables can be found in files that aren't stripped.
+  unsigned long LookupSymbol(const char *name);
+
+  // Look up several symbols at once. The full symbol table has no index, so
+  // this only scans it once for all of the symbols that aren't dynamic.
+  std::vector<unsigned long> LookupSymbols(
+      const std::vector<const char *> &names);
 
  private:
   void *addr_;
   size_t length_;
-  int dynamic_, dynstr_, dynsym_;
+  int dynamic_, dynstr_, dynsym_, strtab_, symtab_, gnu_hash_, hash_;
+
+  // Find a symbol in .dynsym, using the hash tables if there are any
+  unsigned long LookupDynamic(const char *name);
+  unsigned long LookupGnuHash(const char *name);
+  unsigned long LookupHash(const char *name);
+
+  // Find symbols by scanning a whole symbol table section. Only the names whose
+  // address is still 0 are looked for.
+  void SearchSymbols(int symbols, int strings,
+                     const std::vector<const char *> &names,
+                     std::vector<unsigned long> *addrs);
+
+  // The address of the idx-th symbol of .dynsym if it's called name, else 0
+  unsigned long MatchDynamic(size_t idx, const char *name);
 
   inline const Elf64_Ehdr *hdr() const {
     return reinterpret_cast<const Elf64_Ehdr *>(addr_);
@@ -0,0 +1,183 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./symcache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+namespace pystack {
+namespace {
+const char kMagic[8] = {'P', 'S', 'Y', 'M', 'C', 'A', 'C', '2'};
+
+// Entries beyond this many are dropped, oldest first
+const size_t kMaxRecords = 256;
+
+struct Header {
+  char magic[8];
+  uint32_t count;
+  uint32_t record_size;
+};
+
+struct Record {
+  char build_id[64];  // hex, NUL padded
+  char libpython[128];
+  uint64_t thread_state;
+  uint64_t interp_head;
+  uint32_t layout;
+  uint32_t reserved;
+};
+
+// Create a directory that only we can use, or check that an existing one is
+// ours, since it may be in a shared place like /tmp.
+bool MakePrivateDir(const std::string &dir) {
+  if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    return false;
+  }
+  struct stat st;
+  return lstat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+         st.st_uid == geteuid() && (st.st_mode & 022) == 0;
+}
+
+// Read all of the records in the cache file
+std::vector<Record> ReadRecords(const std::string &path) {
+  std::vector<Record> records;
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return records;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+    close(fd);
+    return records;
+  }
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return records;
+  }
+  const Header *header = static_cast<const Header *>(addr);
+  const size_t room = (st.st_size - sizeof(Header)) / sizeof(Record);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+      header->record_size == sizeof(Record) && header->count <= room) {
+    const Record *begin = reinterpret_cast<const Record *>(header + 1);
+    records.assign(begin, begin + header->count);
+  }
+  munmap(addr, st.st_size);
+  return records;
+}
+}  // namespace
+
+SymbolCache::SymbolCache(const std::string &dir) : path_(dir + "/symbols") {
+  if (!MakePrivateDir(dir)) {
+    path_.clear();
+  }
+}
+
+std::string SymbolCache::DefaultDir() {
+  const char *dir = getenv("PYSTACK_CACHE_DIR");
+  if (dir != nullptr && *dir) {
+    return dir;
+  }
+  dir = getenv("XDG_CACHE_HOME");
+  if (dir != nullptr && *dir == '/') {
+    return std::string(dir) + "/pystack";
+  }
+  dir = getenv("HOME");
+  if (dir != nullptr && *dir == '/') {
+    const std::string cache = std::string(dir) + "/.cache";
+    mkdir(cache.c_str(), 0700);
+    return cache + "/pystack";
+  }
+  std::ostringstream ss;
+  ss << "/tmp/pystack-" << geteuid();
+  return ss.str();
+}
+
+bool SymbolCache::Lookup(const std::string &build_id,
+                         CachedSymbols *symbols) const {
+  if (path_.empty() || build_id.empty() ||
+      build_id.size() >= sizeof(Record::build_id)) {
+    return false;
+  }
+  for (const Record &r : ReadRecords(path_)) {
+    if (strncmp(r.build_id, build_id.c_str(), sizeof(r.build_id)) == 0) {
+      symbols->libpython.assign(r.libpython,
+                                strnlen(r.libpython, sizeof(r.libpython)));
+      symbols->thread_state = r.thread_state;
+      symbols->interp_head = r.interp_head;
+      symbols->layout = r.layout;
+      return true;
+    }
+  }
+  return false;
+}
+
+void SymbolCache::Store(const std::string &build_id,
+                        const CachedSymbols &symbols) const {
+  if (path_.empty() || build_id.empty() ||
+      build_id.size() >= sizeof(Record::build_id) ||
+      symbols.libpython.size() >= sizeof(Record::libpython)) {
+    return;
+  }
+  Record record;
+  memset(&record, 0, sizeof(record));
+  memcpy(record.build_id, build_id.data(), build_id.size());
+  memcpy(record.libpython, symbols.libpython.data(), symbols.libpython.size());
+  record.thread_state = symbols.thread_state;
+  record.interp_head = symbols.interp_head;
+  record.layout = symbols.layout;
+
+  std::vector<Record> records;
+  for (const Record &r : ReadRecords(path_)) {
+    if (strncmp(r.build_id, record.build_id, sizeof(r.build_id)) != 0) {
+      records.push_back(r);
+    }
+  }
+  if (records.size() >= kMaxRecords) {
+    records.erase(records.begin(),
+                  records.begin() + (records.size() - kMaxRecords + 1));
+  }
+  records.push_back(record);
+
+  // Write a new file and rename it over the old one, so that readers always
+  // see a complete file.
+  std::string tmp = path_ + ".XXXXXX";
+  const int fd = mkstemp(&tmp[0]);
+  if (fd == -1) {
+    return;
+  }
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.count = records.size();
+  header.record_size = sizeof(Record);
+  const size_t len = records.size() * sizeof(Record);
+  const bool ok =
+      write(fd, &header, sizeof(header)) == sizeof(header) &&
+      write(fd, records.data(), len) == static_cast<ssize_t>(len);
+  close(fd);
+  if (!ok || rename(tmp.c_str(), path_.c_str()) == -1) {
+    unlink(tmp.c_str());
+  }
+}
+}  // namespace pystack
@@ -0,0 +1,62 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace pystack {
+
+// What we found out about one ELF file (an executable or libpython) when
+// looking for the interpreter in it.
+struct CachedSymbols {
+  // For an executable that uses a shared libpython, the name of the library.
+  // The symbols are then cached under the library's own build id.
+  std::string libpython;
+
+  // The symbol values, before adding the load address
+  unsigned long thread_state;
+  unsigned long interp_head;
+
+  // The interpreter structure layout that the entry was made for
+  uint32_t layout;
+};
+
+// An on-disk cache of CachedSymbols keyed by the NT_GNU_BUILD_ID note of the
+// file, so that attaching to an interpreter build we've seen before doesn't
+// need to parse its symbol tables.
+//
+// The cache is a single file of fixed-size records that's mapped into memory to
+// look things up, and replaced atomically when something is added, so any
+// number of processes can share it. Errors reading or writing the cache are
+// ignored, and just make lookups miss.
+class SymbolCache {
+ public:
+  // Use the cache in dir, which is created if it doesn't exist.
+  explicit SymbolCache(const std::string &dir);
+
+  // $PYSTACK_CACHE_DIR if it's set, otherwise $XDG_CACHE_HOME/pystack or
+  // ~/.cache/pystack, falling back to a per-user directory in /tmp.
+  static std::string DefaultDir();
+
+  bool Lookup(const std::string &build_id, CachedSymbols *symbols) const;
+
+  void Store(const std::string &build_id, const CachedSymbols &symbols) const;
+
+ private:
+  std::string path_;
+};
+}  // namespace pystack
@@ -0,0 +1,83 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./ticker.h"
+
+#include <time.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include "./exc.h"
+
+namespace pystack {
+namespace {
+const uint64_t kNanosPerSecond = 1000000000;
+}  // namespace
+
+uint64_t MonotonicNanos() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kNanosPerSecond + ts.tv_nsec;
+}
+
+Ticker::Ticker(uint64_t period_ns)
+    : period_(period_ns),
+      start_(MonotonicNanos()),
+      next_(start_),
+      last_(start_),
+      ticks_(1),
+      missed_(0) {}
+
+bool Ticker::Advance(uint64_t end) {
+  next_ += period_;
+  const uint64_t now = MonotonicNanos();
+  if (period_ != 0 && now >= next_ + period_) {
+    // the last sample took so long that whole ticks went by
+    const uint64_t skipped = (now - next_) / period_;
+    missed_ += skipped;
+    next_ += skipped * period_;
+  }
+  return next_ < end;
+}
+
+void Ticker::Sleep() {
+  timespec ts;
+  ts.tv_sec = next_ / kNanosPerSecond;
+  ts.tv_nsec = next_ % kNanosPerSecond;
+  for (;;) {
+    const int err =
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+    if (err == 0) {
+      break;
+    } else if (err != EINTR) {
+      std::ostringstream ss;
+      ss << "Failed to sleep: " << strerror(err);
+      throw FatalException(ss.str());
+    }
+  }
+  last_ = MonotonicNanos();
+  jitter_.Add(last_ > next_ ? last_ - next_ : 0);
+  ticks_++;
+}
+
+double Ticker::rate() const {
+  if (last_ == start_) {
+    return 0;
+  }
+  return (ticks_ - 1) * static_cast<double>(kNanosPerSecond) / (last_ - start_);
+}
+}  // namespace pystack
@@ -0,0 +1,66 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+
+#include "./histogram.h"
+
+namespace pystack {
+
+// Nanoseconds on CLOCK_MONOTONIC.
+uint64_t MonotonicNanos();
+
+// Schedules samples at a fixed rate. Ticks are at absolute times on
+// CLOCK_MONOTONIC (start + n * period), so the time spent taking a sample
+// doesn't add up to drift. If a sample overruns one or more whole periods the
+// ticks that passed are skipped and counted as missed, rather than being taken
+// in a burst to catch up.
+class Ticker {
+ public:
+  // The first tick is now.
+  explicit Ticker(uint64_t period_ns);
+
+  // Move to the next tick that hasn't passed yet. Returns false if that is at
+  // or after end (in MonotonicNanos time), i.e. the session is over.
+  bool Advance(uint64_t end);
+
+  // Sleep until the current tick, and record how late we woke up.
+  void Sleep();
+
+  // When the current tick is, in MonotonicNanos time
+  inline uint64_t next() const { return next_; }
+  inline uint64_t period() const { return period_; }
+  inline uint64_t ticks() const { return ticks_; }
+  inline uint64_t missed() const { return missed_; }
+
+  // How late each tick was, in nanoseconds.
+  inline const Histogram &jitter() const { return jitter_; }
+
+  // The number of ticks per second since the first one, counting only the
+  // ticks that weren't missed.
+  double rate() const;
+
+ private:
+  uint64_t period_;
+  uint64_t start_;
+  uint64_t next_;  // the current tick
+  uint64_t last_;  // when we last woke up
+  uint64_t ticks_;
+  uint64_t missed_;
+  Histogram jitter_;
+};
+}  // namespace pystack
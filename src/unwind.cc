@@ -0,0 +1,772 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "./unwind.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "./exc.h"
+
+namespace pystack {
+namespace {
+// The DWARF numbers of the x86-64 registers that we track
+const uint64_t kDwarfBp = 6;
+const uint64_t kDwarfSp = 7;
+
+// Stop unwinding after this many frames, in case the stack is corrupt. The
+// eval loop is called through a few other functions, so this allows for the
+// deepest Python stacks that the walker reads.
+const size_t kMaxNativeDepth = 16384;
+
+// How much of a stack to read at once
+const size_t kStackWindow = 64 * 1024;
+const unsigned long kPageSize = 4096;
+
+// A label that hasn't been interned yet
+const uint32_t kNoLabel = UINT32_MAX;
+
+// The eval loop of Python 3.6 and later, and of Python 2.7. In Python 3 there's
+// also a PyEval_EvalFrameEx, which calls _PyEval_EvalFrameDefault, so only the
+// latter is used if it's there.
+const char *const kEvalFunctions[] = {"_PyEval_EvalFrameDefault",
+                                      "PyEval_EvalFrameEx"};
+
+// DW_EH_PE_* pointer encodings
+const uint8_t kPeOmit = 0xff;
+const uint8_t kPeFormat = 0x0f;
+const uint8_t kPeApplication = 0x70;
+const uint8_t kPePcRel = 0x10;
+
+void ThrowBadCfi(const std::string &what) {
+  throw FatalException("Bad .eh_frame: " + what);
+}
+
+// Reads .eh_frame, whose pointers may be relative to where they are
+class CfiReader {
+ public:
+  CfiReader(const uint8_t *data, size_t size, unsigned long addr)
+      : data_(data), size_(size), addr_(addr), pos_(0) {}
+
+  inline size_t pos() const { return pos_; }
+  inline size_t size() const { return size_; }
+
+  void Seek(size_t pos) {
+    if (pos > size_) {
+      ThrowBadCfi("offset out of range");
+    }
+    pos_ = pos;
+  }
+
+  template <typename T>
+  T Get() {
+    Need(sizeof(T));
+    T value;
+    memcpy(&value, data_ + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return value;
+  }
+
+  uint64_t Uleb() {
+    uint64_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+      const uint8_t byte = Get<uint8_t>();
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+  }
+
+  int64_t Sleb() {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+      byte = Get<uint8_t>();
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+      value |= ~uint64_t(0) << shift;
+    }
+    return static_cast<int64_t>(value);
+  }
+
+  // A NUL-terminated string
+  const char *String() {
+    const char *str = reinterpret_cast<const char *>(data_ + pos_);
+    const void *nul = memchr(str, 0, size_ - pos_);
+    if (nul == nullptr) {
+      ThrowBadCfi("unterminated string");
+    }
+    pos_ += static_cast<const char *>(nul) - str + 1;
+    return str;
+  }
+
+  unsigned long Pointer(uint8_t encoding) {
+    if (encoding == kPeOmit) {
+      return 0;
+    }
+    const unsigned long here = addr_ + pos_;
+    unsigned long value;
+    switch (encoding & kPeFormat) {
+      case 0x00:  // absptr
+      case 0x04:  // udata8
+      case 0x0c:  // sdata8
+        value = Get<uint64_t>();
+        break;
+      case 0x01:
+        value = Uleb();
+        break;
+      case 0x02:
+        value = Get<uint16_t>();
+        break;
+      case 0x03:
+        value = Get<uint32_t>();
+        break;
+      case 0x09:
+        value = Sleb();
+        break;
+      case 0x0a:
+        value = static_cast<int16_t>(Get<uint16_t>());
+        break;
+      case 0x0b:
+        value = static_cast<int32_t>(Get<uint32_t>());
+        break;
+      default:
+        ThrowBadCfi("unknown pointer format");
+    }
+    // the other ways of applying a pointer aren't used by .eh_frame, and the
+    // indirect bit is only used by personality routines, which we skip
+    switch (encoding & kPeApplication) {
+      case 0:
+        return value;
+      case kPePcRel:
+        return value + here;
+      default:
+        ThrowBadCfi("unsupported pointer encoding");
+    }
+    return 0;
+  }
+
+ private:
+  const uint8_t *data_;
+  size_t size_;
+  unsigned long addr_;  // of data_[0]
+  size_t pos_;
+
+  void Need(size_t len) {
+    if (len > size_ - pos_) {
+      ThrowBadCfi("truncated");
+    }
+  }
+};
+
+// How to get a register of the caller
+struct RegRule {
+  enum Kind : uint8_t { kSame, kUndefined, kOffset, kOther };
+  Kind kind;
+  int64_t offset;  // from the CFA
+};
+
+// The rules at one point of a CFI program
+struct CfiState {
+  uint64_t cfa_reg;
+  int64_t cfa_offset;
+  bool cfa_expression;
+  RegRule ra;
+  RegRule bp;
+};
+
+struct Cie {
+  bool supported;
+  uint64_t code_align;
+  int64_t data_align;
+  uint64_t ra_reg;
+  uint8_t fde_encoding;
+  bool augmented;  // the FDEs have augmentation data
+  CfiState initial;
+};
+
+template <typename T>
+bool Fits(int64_t value) {
+  return value >= std::numeric_limits<T>::min() &&
+         value <= std::numeric_limits<T>::max();
+}
+
+UnwindRow MakeRow(unsigned long addr, const CfiState &state) {
+  UnwindRow row = {addr, 0, 0, 0, kCfaUnknown};
+  if (state.cfa_expression || !Fits<int32_t>(state.cfa_offset) ||
+      (state.cfa_reg != kDwarfSp && state.cfa_reg != kDwarfBp)) {
+    return row;
+  }
+  row.cfa_reg = state.cfa_reg == kDwarfSp ? kCfaSp : kCfaBp;
+  row.cfa_offset = static_cast<int32_t>(state.cfa_offset);
+  if (state.ra.kind == RegRule::kOffset && Fits<int16_t>(state.ra.offset)) {
+    row.ra_offset = static_cast<int16_t>(state.ra.offset);
+  }
+  if (state.bp.kind == RegRule::kOffset && Fits<int16_t>(state.bp.offset)) {
+    row.bp_offset = static_cast<int16_t>(state.bp.offset);
+  }
+  return row;
+}
+
+// Runs the CFI program of a CIE or an FDE
+class CfiProgram {
+ public:
+  CfiProgram(const Cie &cie, CfiState *state) : cie_(cie), state_(state) {}
+
+  // Run the instructions up to end. With rows set, a row is added each time
+  // the location moves on, and once more for the rest of the function, which
+  // ends at end_addr. Returns false if there's an instruction that we don't
+  // know, since the rules after it would be wrong.
+  bool Run(CfiReader *r, size_t end, unsigned long loc, unsigned long end_addr,
+           std::vector<UnwindRow> *rows) {
+    rows_ = rows;
+    first_ = rows ? rows->size() : 0;
+    loc_ = loc;
+    while (r->pos() < end) {
+      const uint8_t op = r->Get<uint8_t>();
+      const uint8_t low = op & 0x3f;
+      switch (op >> 6) {
+        case 1:  // DW_CFA_advance_loc
+          Advance(loc_ + low * cie_.code_align);
+          continue;
+        case 2:  // DW_CFA_offset
+          SetOffset(low, r->Uleb() * cie_.data_align);
+          continue;
+        case 3:  // DW_CFA_restore
+          Restore(low);
+          continue;
+      }
+      uint64_t reg;
+      switch (op) {
+        case 0x00:  // DW_CFA_nop
+          break;
+        case 0x01:  // DW_CFA_set_loc
+          Advance(r->Pointer(cie_.fde_encoding));
+          break;
+        case 0x02:  // DW_CFA_advance_loc1
+          Advance(loc_ + r->Get<uint8_t>() * cie_.code_align);
+          break;
+        case 0x03:  // DW_CFA_advance_loc2
+          Advance(loc_ + r->Get<uint16_t>() * cie_.code_align);
+          break;
+        case 0x04:  // DW_CFA_advance_loc4
+          Advance(loc_ + r->Get<uint32_t>() * cie_.code_align);
+          break;
+        case 0x05:  // DW_CFA_offset_extended
+          reg = r->Uleb();
+          SetOffset(reg, r->Uleb() * cie_.data_align);
+          break;
+        case 0x06:  // DW_CFA_restore_extended
+          Restore(r->Uleb());
+          break;
+        case 0x07:  // DW_CFA_undefined
+          SetKind(r->Uleb(), RegRule::kUndefined);
+          break;
+        case 0x08:  // DW_CFA_same_value
+          SetKind(r->Uleb(), RegRule::kSame);
+          break;
+        case 0x09:  // DW_CFA_register
+          SetKind(r->Uleb(), RegRule::kOther);
+          r->Uleb();
+          break;
+        case 0x0a:  // DW_CFA_remember_state
+          saved_.push_back(*state_);
+          break;
+        case 0x0b:  // DW_CFA_restore_state
+          if (saved_.empty()) {
+            return false;
+          }
+          *state_ = saved_.back();
+          saved_.pop_back();
+          break;
+        case 0x0c:  // DW_CFA_def_cfa
+          state_->cfa_reg = r->Uleb();
+          state_->cfa_offset = r->Uleb();
+          state_->cfa_expression = false;
+          break;
+        case 0x0d:  // DW_CFA_def_cfa_register
+          state_->cfa_reg = r->Uleb();
+          state_->cfa_expression = false;
+          break;
+        case 0x0e:  // DW_CFA_def_cfa_offset
+          state_->cfa_offset = r->Uleb();
+          break;
+        case 0x0f:  // DW_CFA_def_cfa_expression
+          r->Seek(r->pos() + r->Uleb());
+          state_->cfa_expression = true;
+          break;
+        case 0x10:  // DW_CFA_expression
+          SetKind(r->Uleb(), RegRule::kOther);
+          r->Seek(r->pos() + r->Uleb());
+          break;
+        case 0x11:  // DW_CFA_offset_extended_sf
+          reg = r->Uleb();
+          SetOffset(reg, r->Sleb() * cie_.data_align);
+          break;
+        case 0x12:  // DW_CFA_def_cfa_sf
+          state_->cfa_reg = r->Uleb();
+          state_->cfa_offset = r->Sleb() * cie_.data_align;
+          state_->cfa_expression = false;
+          break;
+        case 0x13:  // DW_CFA_def_cfa_offset_sf
+          state_->cfa_offset = r->Sleb() * cie_.data_align;
+          break;
+        case 0x14:  // DW_CFA_val_offset
+        case 0x15:  // DW_CFA_val_offset_sf
+          SetKind(r->Uleb(), RegRule::kOther);
+          r->Uleb();
+          break;
+        case 0x16:  // DW_CFA_val_expression
+          SetKind(r->Uleb(), RegRule::kOther);
+          r->Seek(r->pos() + r->Uleb());
+          break;
+        case 0x2e:  // DW_CFA_GNU_args_size
+          r->Uleb();
+          break;
+        case 0x2f:  // DW_CFA_GNU_negative_offset_extended
+          reg = r->Uleb();
+          SetOffset(reg, -static_cast<int64_t>(r->Uleb()) * cie_.data_align);
+          break;
+        default:
+          return false;
+      }
+    }
+    if (rows_ != nullptr && loc_ < end_addr) {
+      Emit();
+      rows_->push_back({end_addr, 0, 0, 0, kCfaNone});
+    }
+    return true;
+  }
+
+ private:
+  const Cie &cie_;
+  CfiState *state_;
+  std::vector<CfiState> saved_;
+  std::vector<UnwindRow> *rows_;
+  size_t first_;  // the first row of this program
+  unsigned long loc_;
+
+  RegRule *Rule(uint64_t reg) {
+    if (reg == cie_.ra_reg) {
+      return &state_->ra;
+    } else if (reg == kDwarfBp) {
+      return &state_->bp;
+    }
+    return nullptr;
+  }
+
+  void SetKind(uint64_t reg, RegRule::Kind kind) {
+    if (RegRule *rule = Rule(reg)) {
+      rule->kind = kind;
+    }
+  }
+
+  void SetOffset(uint64_t reg, int64_t offset) {
+    if (RegRule *rule = Rule(reg)) {
+      rule->kind = RegRule::kOffset;
+      rule->offset = offset;
+    }
+  }
+
+  void Restore(uint64_t reg) {
+    if (RegRule *rule = Rule(reg)) {
+      *rule = reg == cie_.ra_reg ? cie_.initial.ra : cie_.initial.bp;
+    }
+  }
+
+  void Advance(unsigned long loc) {
+    if (rows_ != nullptr && loc > loc_) {
+      Emit();
+    }
+    loc_ = loc;
+  }
+
+  void Emit() {
+    const UnwindRow row = MakeRow(loc_, *state_);
+    if (rows_->size() > first_ && rows_->back().addr == loc_) {
+      rows_->back() = row;
+    } else {
+      rows_->push_back(row);
+    }
+  }
+};
+
+// Parse the CIE at pos, and run its initial instructions
+Cie ParseCie(CfiReader r, size_t pos) {
+  Cie cie;
+  cie.supported = false;
+  r.Seek(pos);
+  uint64_t length = r.Get<uint32_t>();
+  if (length == 0xffffffff) {
+    length = r.Get<uint64_t>();
+  }
+  if (length > r.size() - r.pos()) {
+    ThrowBadCfi("CIE is truncated");
+  }
+  const size_t end = r.pos() + length;
+  if (r.Get<uint32_t>() != 0) {
+    ThrowBadCfi("FDE points to another FDE");
+  }
+  const uint8_t version = r.Get<uint8_t>();
+  const char *augmentation = r.String();
+  if (strstr(augmentation, "eh") != nullptr) {
+    r.Get<uint64_t>();
+  }
+  cie.code_align = r.Uleb();
+  cie.data_align = r.Sleb();
+  cie.ra_reg = version == 1 ? r.Get<uint8_t>() : r.Uleb();
+  cie.fde_encoding = 0;
+  cie.augmented = augmentation[0] == 'z';
+  if (cie.augmented) {
+    const size_t data_end = r.Uleb() + r.pos();
+    for (const char *c = augmentation + 1; *c; c++) {
+      if (*c == 'R') {
+        cie.fde_encoding = r.Get<uint8_t>();
+      } else if (*c == 'P') {
+        r.Pointer(r.Get<uint8_t>() & 0x7f);
+      } else if (*c == 'L') {
+        r.Get<uint8_t>();
+      } else if (*c != 'S' && *c != 'B') {
+        break;  // the rest is skipped, since we know its length
+      }
+    }
+    r.Seek(data_end);
+  } else if (augmentation[0] != '\0') {
+    return cie;
+  }
+
+  cie.initial = {kDwarfSp, 0, false, {RegRule::kUndefined, 0},
+                 {RegRule::kSame, 0}};
+  CfiState state = cie.initial;
+  cie.supported =
+      CfiProgram(cie, &state).Run(&r, std::min(end, r.size()), 0, 0, nullptr);
+  cie.initial = state;
+  return cie;
+}
+}  // namespace
+
+NativeModule::NativeModule(const std::string &path, StringTable *strings)
+    : strings_(strings) {
+  elf_.Open(path);
+  const size_t slash = path.rfind('/');
+  file_ = strings_->Intern(
+      slash == std::string::npos ? path : path.substr(slash + 1));
+  for (const auto &ph : elf_.Segments()) {
+    if (ph.p_type == PT_LOAD) {
+      loads_.push_back(ph);
+    }
+  }
+
+  // exported functions are in both symbol tables
+  functions_ = elf_.Functions();
+  functions_.erase(std::unique(functions_.begin(), functions_.end(),
+                               [](const ElfSymbol &a, const ElfSymbol &b) {
+                                 return a.addr == b.addr;
+                               }),
+                   functions_.end());
+  labels_.reset(new std::atomic<uint32_t>[functions_.size() + 1]);
+  for (size_t i = 0; i <= functions_.size(); i++) {
+    labels_[i].store(kNoLabel, std::memory_order_relaxed);
+  }
+  for (const char *eval : kEvalFunctions) {
+    const size_t len = strlen(eval);
+    for (const auto &f : functions_) {
+      // gcc moves the unlikely paths of a function to name.cold
+      if (strncmp(f.name, eval, len) == 0 &&
+          (f.name[len] == '\0' || strcmp(f.name + len, ".cold") == 0)) {
+        eval_.push_back({f.addr, f.addr + f.size});
+      }
+    }
+    if (!eval_.empty()) {
+      break;
+    }
+  }
+
+  ParseEhFrame();
+}
+
+void NativeModule::ParseEhFrame() {
+  const Elf64_Shdr *s = elf_.FindSection(".eh_frame");
+  if (s == nullptr || s->sh_type == SHT_NOBITS) {
+    return;
+  }
+  CfiReader r(static_cast<const uint8_t *>(elf_.At(s->sh_offset, s->sh_size)),
+              s->sh_size, s->sh_addr);
+  std::unordered_map<size_t, Cie> cies;
+  while (r.size() - r.pos() >= sizeof(uint32_t)) {
+    uint64_t length = r.Get<uint32_t>();
+    if (length == 0) {
+      break;  // the terminator
+    } else if (length == 0xffffffff) {
+      length = r.Get<uint64_t>();
+    }
+    const size_t body = r.pos();
+    if (length > r.size() - body || length < sizeof(uint32_t)) {
+      ThrowBadCfi("entry is truncated");
+    }
+    const size_t next = body + length;
+    const uint32_t cie_pointer = r.Get<uint32_t>();
+    if (cie_pointer == 0) {
+      r.Seek(next);  // a CIE, which is parsed when an FDE uses it
+      continue;
+    } else if (cie_pointer > body) {
+      ThrowBadCfi("CIE pointer out of range");
+    }
+    const size_t cie_pos = body - cie_pointer;
+    auto it = cies.find(cie_pos);
+    if (it == cies.end()) {
+      it = cies.insert({cie_pos, ParseCie(r, cie_pos)}).first;
+    }
+    const Cie &cie = it->second;
+    if (cie.supported) {
+      const unsigned long start = r.Pointer(cie.fde_encoding);
+      const unsigned long range = r.Pointer(cie.fde_encoding & kPeFormat);
+      if (cie.augmented) {
+        r.Seek(r.Uleb() + r.pos());
+      }
+      // the linker leaves FDEs of discarded functions at address 0
+      if (start != 0 && range != 0) {
+        const size_t first = rows_.size();
+        CfiState state = cie.initial;
+        if (!CfiProgram(cie, &state)
+                 .Run(&r, next, start, start + range, &rows_)) {
+          rows_.resize(first);
+        }
+      }
+    }
+    r.Seek(next);
+  }
+
+  // Where one function ends and the next starts, keep the start.
+  std::sort(rows_.begin(), rows_.end(),
+            [](const UnwindRow &a, const UnwindRow &b) {
+              return a.addr < b.addr ||
+                     (a.addr == b.addr && a.cfa_reg == kCfaNone &&
+                      b.cfa_reg != kCfaNone);
+            });
+  size_t n = 0;
+  for (const auto &row : rows_) {
+    if (n > 0 && rows_[n - 1].addr == row.addr) {
+      rows_[n - 1] = row;
+    } else {
+      rows_[n++] = row;
+    }
+  }
+  rows_.resize(n);
+  rows_.shrink_to_fit();
+}
+
+const UnwindRow *NativeModule::Find(unsigned long addr) const {
+  auto it = std::upper_bound(
+      rows_.begin(), rows_.end(), addr,
+      [](unsigned long a, const UnwindRow &row) { return a < row.addr; });
+  if (it == rows_.begin()) {
+    return nullptr;
+  }
+  --it;
+  return it->cfa_reg == kCfaNone ? nullptr : &*it;
+}
+
+Frame NativeModule::Symbolize(unsigned long addr) const {
+  size_t idx = functions_.size();
+  auto it = std::upper_bound(
+      functions_.begin(), functions_.end(), addr,
+      [](unsigned long a, const ElfSymbol &f) { return a < f.addr; });
+  if (it != functions_.begin()) {
+    --it;
+    // assembly functions often have no size
+    if (it->size == 0 || addr < it->addr + it->size) {
+      idx = it - functions_.begin();
+    }
+  }
+  uint32_t id = labels_[idx].load(std::memory_order_relaxed);
+  if (id == kNoLabel) {
+    // another thread may intern the same name, and get the same id
+    id = strings_->Intern(idx < functions_.size() ? functions_[idx].name
+                                                  : "??");
+    labels_[idx].store(id, std::memory_order_relaxed);
+  }
+  return {file_, id, kNativeLine, kNativeLine};
+}
+
+bool NativeModule::IsEval(unsigned long addr) const {
+  for (const auto &range : eval_) {
+    if (addr >= range.first && addr < range.second) {
+      return true;
+    }
+  }
+  return false;
+}
+
+unsigned long NativeModule::Bias(unsigned long start,
+                                 unsigned long offset) const {
+  for (const auto &ph : loads_) {
+    if (offset >= (ph.p_offset & ~(kPageSize - 1)) &&
+        offset < ph.p_offset + ph.p_filesz) {
+      return start - offset + ph.p_offset - ph.p_vaddr;
+    }
+  }
+  return start - offset;
+}
+
+const NativeModule *NativeModules::Get(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = modules_.find(path);
+  if (it != modules_.end()) {
+    return it->second.get();
+  }
+  std::unique_ptr<NativeModule> module;
+  try {
+    module.reset(new NativeModule(path, strings_));
+  } catch (const FatalException &exc) {
+    // e.g. the file was deleted, or it isn't ELF; its frames have no names
+  }
+  const NativeModule *result = module.get();
+  modules_.insert({path, std::move(module)});
+  return result;
+}
+
+NativeUnwinder::NativeUnwinder(MemoryReader *mem, const MemoryMap *maps,
+                               NativeModules *modules, StringTable *strings)
+    : mem_(mem),
+      maps_(maps),
+      modules_(modules),
+      unknown_(strings->Intern("??")),
+      generation_(maps->generation()),
+      window_(kStackWindow),
+      window_start_(0),
+      window_len_(0) {}
+
+void NativeUnwinder::Merge(const NativeRegs &regs, std::vector<Frame> *stack) {
+  python_.assign(stack->begin(), stack->end());
+  stack->clear();
+  window_len_ = 0;  // the stack has changed since the last sample
+  size_t next = 0;  // the next Python frame
+  unsigned long ip = regs.ip;
+  unsigned long sp = regs.sp;
+  unsigned long bp = regs.bp;
+  for (size_t depth = 0; depth < kMaxNativeDepth && ip != 0; depth++) {
+    // A return address is just after the call, which may be the end of the
+    // function if the call doesn't return.
+    const unsigned long pc = depth == 0 ? ip : ip - 1;
+    const Located *located = Locate(pc);
+    const NativeModule *module = located ? located->module : nullptr;
+    const unsigned long addr = pc - (module ? located->bias : 0);
+    if (module && module->IsEval(addr) && next < python_.size()) {
+      stack->push_back(python_[next++]);
+    } else if (module) {
+      stack->push_back(module->Symbolize(addr));
+    } else {
+      stack->push_back({unknown_, unknown_, kNativeLine, kNativeLine});
+    }
+
+    // find the caller's registers
+    const UnwindRow *row = module ? module->Find(addr) : nullptr;
+    unsigned long cfa;
+    if (row != nullptr) {
+      if (row->cfa_reg == kCfaUnknown || row->ra_offset == 0) {
+        break;  // e.g. the outermost frame, or a signal handler's
+      }
+      cfa = (row->cfa_reg == kCfaSp ? sp : bp) + row->cfa_offset;
+      if (!ReadStack(cfa + row->ra_offset, &ip) ||
+          (row->bp_offset != 0 && !ReadStack(cfa + row->bp_offset, &bp))) {
+        break;
+      }
+    } else {
+      // without unwind information, hope that there's a frame pointer
+      cfa = bp + 2 * sizeof(unsigned long);
+      if (bp <= sp || !ReadStack(bp + sizeof(unsigned long), &ip) ||
+          !ReadStack(bp, &bp)) {
+        break;
+      }
+    }
+    // the stack grows down, so each caller's frame is above the last
+    if (cfa <= sp) {
+      break;
+    }
+    sp = cfa;
+  }
+  stack->insert(stack->end(), python_.begin() + next, python_.end());
+}
+
+const NativeUnwinder::Located *NativeUnwinder::Locate(unsigned long addr) {
+  if (maps_->generation() != generation_) {
+    located_.clear();
+    generation_ = maps_->generation();
+  }
+  for (const auto &located : located_) {
+    if (addr >= located.start && addr < located.end) {
+      return &located;
+    }
+  }
+  const Mapping *m = maps_->Find(addr);
+  if (m == nullptr) {
+    return nullptr;
+  }
+  // Mappings of core files don't say whether they're executable, so any file
+  // will do. Special mappings like [vdso] aren't files.
+  Located located = {m->start, m->end, nullptr, 0};
+  if (!m->path.empty() && m->path[0] == '/') {
+    located.module = modules_->Get(m->path);
+    if (located.module != nullptr) {
+      located.bias = located.module->Bias(m->start, m->offset);
+    }
+  }
+  located_.push_back(located);
+  return &located_.back();
+}
+
+bool NativeUnwinder::ReadStack(unsigned long addr, unsigned long *value) {
+  if (window_len_ == 0 || addr < window_start_ ||
+      addr - window_start_ + sizeof(*value) > window_len_) {
+    // Read ahead up the stack, but not past the end of its mapping. The stacks
+    // in a core file aren't in its map, so if the read fails just read the
+    // page.
+    const unsigned long start = addr & ~(kPageSize - 1);
+    size_t len = window_.size();
+    const Mapping *m = maps_->Find(start);
+    if (m != nullptr) {
+      len = std::min<size_t>(len, m->end - start);
+    }
+    window_len_ = 0;
+    try {
+      mem_->Read(start, window_.data(), len);
+    } catch (const InvalidDataException &exc) {
+      len = kPageSize;
+      try {
+        mem_->Read(start, window_.data(), len);
+      } catch (const InvalidDataException &exc) {
+        return false;
+      }
+    }
+    window_start_ = start;
+    window_len_ = len;
+    if (addr - start + sizeof(*value) > len) {
+      return false;
+    }
+  }
+  memcpy(value, window_.data() + (addr - window_start_), sizeof(*value));
+  return true;
+}
+}  // namespace pystack
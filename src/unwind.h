@@ -0,0 +1,167 @@
+// This file is part of Pystack.
+//
+// Pystack is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pystack is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Pystack.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./frame.h"
+#include "./maps.h"
+#include "./memory.h"
+#include "./symbol.h"
+
+namespace pystack {
+
+// The registers of a stopped thread that unwinding starts from
+struct NativeRegs {
+  pid_t tid;
+  unsigned long ip;
+  unsigned long sp;
+  unsigned long bp;
+  unsigned long tp;  // the thread pointer, which is pthread_self()
+};
+
+// How to find the caller of the code from addr up to the next row: the
+// canonical frame address (CFA) is a register plus an offset, and the return
+// address and the caller's frame pointer are saved at offsets from the CFA.
+struct UnwindRow {
+  unsigned long addr;
+  int32_t cfa_offset;
+  int16_t ra_offset;  // 0 if there's no caller
+  int16_t bp_offset;  // 0 if the frame pointer isn't saved
+  uint8_t cfa_reg;    // one of the kCfa* values
+};
+
+const uint8_t kCfaNone = 0;     // no function has unwind information here
+const uint8_t kCfaSp = 1;       // the CFA is the stack pointer plus the offset
+const uint8_t kCfaBp = 2;       // the CFA is the frame pointer plus the offset
+const uint8_t kCfaUnknown = 3;  // the rule is one that we can't follow
+
+// The unwind table and the functions of an ELF file (the executable or a
+// library), from its .eh_frame section and symbol tables. The CFI programs are
+// run once, when the file is loaded, so finding the row for an address is just
+// a binary search. Only the x86-64 registers that unwinding needs are tracked.
+class NativeModule {
+ public:
+  // Throws FatalException if the file can't be read.
+  NativeModule(const std::string &path, StringTable *strings);
+
+  NativeModule(const NativeModule &other) = delete;
+  NativeModule &operator=(const NativeModule &other) = delete;
+
+  // The row for an address in the file (not in a process), or null if no
+  // function has unwind information for it. The row may be kCfaUnknown.
+  const UnwindRow *Find(unsigned long addr) const;
+
+  // The frame for an address: the function that it's in and the file's name.
+  Frame Symbolize(unsigned long addr) const;
+
+  // Whether the address is in the interpreter's eval loop, which runs one
+  // Python frame per call.
+  bool IsEval(unsigned long addr) const;
+
+  // What to subtract from an address in a mapping of the file, which starts at
+  // start in the process and at offset in the file.
+  unsigned long Bias(unsigned long start, unsigned long offset) const;
+
+  inline size_t rows() const { return rows_.size(); }
+
+ private:
+  ELF elf_;  // kept open, since the function names point into it
+  StringTable *strings_;
+  uint32_t file_;  // the file's name, interned
+  std::vector<UnwindRow> rows_;  // sorted by address
+  std::vector<ElfSymbol> functions_;
+  // the names of the functions, interned when they're first needed, and the
+  // name of addresses outside of any function at the end
+  std::unique_ptr<std::atomic<uint32_t>[]> labels_;
+  std::vector<Elf64_Phdr> loads_;
+  // the eval loop's code, which the compiler may have split in two
+  std::vector<std::pair<unsigned long, unsigned long>> eval_;
+
+  void ParseEhFrame();
+};
+
+// The modules that have been loaded so far, by path. Samplers of different
+// processes share the modules of the libraries that they have in common.
+class NativeModules {
+ public:
+  explicit NativeModules(StringTable *strings) : strings_(strings) {}
+
+  NativeModules(const NativeModules &other) = delete;
+  NativeModules &operator=(const NativeModules &other) = delete;
+
+  // Load the file, or get it if it's already loaded. Returns null if the file
+  // can't be read, and doesn't try again.
+  const NativeModule *Get(const std::string &path);
+
+ private:
+  StringTable *strings_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<NativeModule>> modules_;
+};
+
+// Unwinds the native stacks of a process's threads, and merges them with the
+// Python stacks. Besides the modules, which are shared, the unwinder caches
+// which module each mapping is, and it keeps a window of the stack being read
+// so that unwinding a deep stack takes a few large reads rather than one per
+// frame.
+class NativeUnwinder {
+ public:
+  NativeUnwinder(MemoryReader *mem, const MemoryMap *maps,
+                 NativeModules *modules, StringTable *strings);
+
+  // Replace the Python stack of a thread, innermost frame first, with its
+  // native stack, where each call of the eval loop is replaced by the next
+  // Python frame. If unwinding stops early, the Python frames that are left
+  // go at the end.
+  void Merge(const NativeRegs &regs, std::vector<Frame> *stack);
+
+ private:
+  struct Located {
+    unsigned long start;
+    unsigned long end;
+    const NativeModule *module;  // null if it isn't an ELF file
+    unsigned long bias;
+  };
+
+  MemoryReader *mem_;
+  const MemoryMap *maps_;
+  NativeModules *modules_;
+  uint32_t unknown_;
+  size_t generation_;
+  std::vector<Located> located_;
+  std::vector<Frame> python_;
+  std::vector<char> window_;
+  unsigned long window_start_;
+  size_t window_len_;
+
+  // The module of the mapping that contains addr, or null if it isn't mapped
+  const Located *Locate(unsigned long addr);
+
+  // Read a word of the stack
+  bool ReadStack(unsigned long addr, unsigned long *value);
+};
+}  // namespace pystack